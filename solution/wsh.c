@@ -1,25 +1,184 @@
+#define _GNU_SOURCE // sched_setaffinity and the CPU_SET macros
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <malloc.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include "wsh.h"
 
 // Global vars
 extern char** environ;
 struct ShellVar* shellLinkedListHead = NULL;
 struct ShellVar* shellLinkedListTail = NULL;
+struct ShellVar** varBuckets = NULL; // Hash index over the var list
+size_t varBucketCount = 0;
+size_t varCount = 0;
 int exit_global = 0;
+int exit_requested = 0; // Set by exit and set -e, the shell exits once the line unwinds
+
+// Node pools, the mem builtin reports on these
+struct NodePool tokenArrPool = {"TokenArr", sizeof(TokenArr), NULL, NULL, 0, 0, 0};
+struct NodePool histEntryPool = {"HistEntry", sizeof(struct HistEntry), NULL, NULL, 0, 0, 0};
+struct NodePool shellVarPool = {"ShellVar", sizeof(struct ShellVar), NULL, NULL, 0, 0, 0};
+struct NodePool* NODE_POOLS[] = {&tokenArrPool, &histEntryPool, &shellVarPool};
+int errexit_flag = 0; // Set by set -e
 
 // History globals
 struct HistEntry* histHead;
 struct HistEntry* histTail;
 int histLimit = 5;
 int histSize = 0;
+char* hist_line = NULL; // Line typed at the prompt, what recall and search bring back
+
+// History search index globals
+struct TrigramPosting** trigramBuckets = NULL;
+struct HistEntry** histBySeq = NULL; // Live entries oldest first from histBySeqStart
+size_t histBySeqStart = 0;
+size_t histBySeqLen = 0;
+size_t histBySeqCap = 0;
+unsigned int histNextSeq = 1;
+
+// Background job globals
+struct BgJob* bgJobHead = NULL;
+int nextJobId = 1;
+int background_flag = 0; // Set while running a line ending in &
+
+// Job control globals, only turned on when stdin is a terminal
+int job_control = 0;
+pid_t shell_pgid = 0;
+int JOB_SIGNALS[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+// Deadline for the next external command, -1 for none
+long child_timeout_ms = -1;
+
+// Scheduling settings for the next external command
+struct ChildSched childSched = {0};
+
+// ulimit settings applied in each child before execve
+struct ShellLimit shellLimits[] = {
+	{'t', RLIMIT_CPU, 1, "cpu time (seconds)", 0, 0},
+	{'v', RLIMIT_AS, 1024, "virtual memory (kbytes)", 0, 0},
+	{'n', RLIMIT_NOFILE, 1, "open files", 0, 0}
+};
+
+// Event loop globals, only set up for interactive input
+int epoll_fd = -1;
+int signal_fd = -1;
+int stdin_pollable = 0;
+sigset_t shell_orig_mask;
+char* reader_buf = NULL;
+size_t reader_start = 0; // Start of the unread input
+size_t reader_scan = 0; // Input before this has no newline
+size_t reader_len = 0;
+size_t reader_cap = 0;
+int reader_eof = 0;
+
+// Line editor globals, only used when stdin is a terminal
+int editor_on = 0;
+int editor_active = 0; // Set while a line is being edited in raw mode
+struct termios editor_orig_termios;
+struct EditLine edit_line = {0};
+struct EditLine edit_saved = {0}; // The new line while history is being browsed
+struct EditLine edit_shown = {0}; // What is on screen after the prompt
+struct EditLine edit_out = {0}; // Escape codes and text for one refresh
+struct EditLine search_query = {0};
+struct EditLine search_view = {0}; // The search prompt as it should be shown
+struct HistEntry* edit_hist = NULL; // History entry being shown, NULL for the new line
+struct HistEntry* search_match = NULL;
+int searching = 0;
+
+// Command completion globals, the trie is only built on the first Tab
+struct TrieNode* cmdTrie = NULL;
+char* cmd_trie_path = NULL; // PATH the trie was built from
+struct timespec* cmd_trie_mtimes = NULL; // mtime of each PATH dir when it was read
+int cmd_trie_dirs = 0;
+time_t cmd_trie_time = 0;
+int last_key_tab = 0;
+
+// getline buffer for script input, grows to fit the longest line
+char* line_buf = NULL;
+size_t line_cap = 0;
+
+// Directory listings cached for globbing
+struct DirCache* dirCacheBuckets[DIR_CACHE_BUCKETS];
+struct DirCache* dirCacheRetired = NULL;
+int dirCacheCount = 0;
+int dirCachePinned = 0;
+
+// Delimiter scan picked for this cpu
+#if defined(__x86_64__)
+size_t (*scanBytesImpl)(const char*, size_t, const char*) = NULL;
+#endif
+
+// Files run by source, newest first
+struct SourceFile* sourceCache = NULL;
+int source_depth = 0;
+
+// Functions and aliases, hashed by name
+struct ShellFunc* funcBuckets[FUNC_BUCKETS];
+struct ShellFunc* aliasBuckets[FUNC_BUCKETS];
+struct ShellFunc* pendingFunc = NULL; // Function whose body is still being read
+TokenArr* funcArgs = NULL; // Call tokens of the running function
+int func_depth = 0;
+
+// Set while running the last command of a script, which is exec'd in place
+int tail_exec_line = 0;
+int tail_exec = 0;
+
+// Cached cwd, only checked against the real dir when cwd_stale is set
+char* cwd_cache = NULL;
+int cwd_stale = 1;
+
+// CDPATH split into its dirs, redone only when CDPATH changes
+char* cdpath_cache = NULL;
+char** cdpath_dirs = NULL;
+int cdpath_count = 0;
+
+// Writer threads of |> on & jobs still copying output
+int tee_writers = 0;
+pthread_mutex_t tee_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tee_writers_done = PTHREAD_COND_INITIALIZER;
+
+// Buffers of the read builtin
+struct ReadBuffer* readBuffers = NULL;
+
+// Profiler state, only used with --profile or --profile-top
+int profile_on = 0;
+int profile_top = 0;
+char* profile_path = NULL;
+char* profile_script = NULL;
+long spawn_count = 0;
+pid_t profile_pid = 0;
+struct ProfileEntry* profileStacks[PROFILE_BUCKETS];
+struct ProfileEntry* profileLines[PROFILE_BUCKETS];
+struct ProfileFrame* profileFrames = NULL;
+int profileDepth = 0;
+int profileCap = 0;
 
 // Globals to restore redirects
 int original_desc = -1;
@@ -27,51 +186,393 @@ int new_desc = -1;
 int second_original_desc = -1;
 int second_new_desc = -1;
 
+size_t scanBytesScalar(const char* my_str, size_t len, const char* byte_set) {
+	for(size_t i = 0; i < len; i++) {
+		if(strchr(byte_set, my_str[i]) != NULL) {
+			return i;
+		}
+	}
+	return len;
+}
+
+#if defined(__x86_64__)
+size_t scanBytesSse2(const char* my_str, size_t len, const char* byte_set) {
+	__m128i set_vecs[LEX_MAX_SET];
+	int set_len = strlen(byte_set);
+	size_t i = 0;
+	for(int j = 0; j < set_len; j++) {
+		set_vecs[j] = _mm_set1_epi8(byte_set[j]);
+	}
+
+	// Compare 16 bytes against every set byte at once
+	for(; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(my_str + i));
+		__m128i hits = _mm_setzero_si128();
+		for(int j = 0; j < set_len; j++) {
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, set_vecs[j]));
+		}
+		int mask = _mm_movemask_epi8(hits);
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + scanBytesScalar(my_str + i, len - i, byte_set);
+}
+
+__attribute__((target("avx2")))
+size_t scanBytesAvx2(const char* my_str, size_t len, const char* byte_set) {
+	__m256i set_vecs[LEX_MAX_SET];
+	int set_len = strlen(byte_set);
+	size_t i = 0;
+	for(int j = 0; j < set_len; j++) {
+		set_vecs[j] = _mm256_set1_epi8(byte_set[j]);
+	}
+
+	// Same as the SSE2 scan 32 bytes at a time
+	for(; i + 32 <= len; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)(my_str + i));
+		__m256i hits = _mm256_setzero_si256();
+		for(int j = 0; j < set_len; j++) {
+			hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, set_vecs[j]));
+		}
+		unsigned int mask = _mm256_movemask_epi8(hits);
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + scanBytesSse2(my_str + i, len - i, byte_set);
+}
+#endif
+
+size_t scanBytes(const char* my_str, size_t len, const char* byte_set) {
+#if defined(__x86_64__)
+	// Pick the widest scan the cpu supports on first use
+	if(scanBytesImpl == NULL) {
+		__builtin_cpu_init();
+		scanBytesImpl = __builtin_cpu_supports("avx2") ? scanBytesAvx2 : scanBytesSse2;
+	}
+	return scanBytesImpl(my_str, len, byte_set);
+#else
+	return scanBytesScalar(my_str, len, byte_set);
+#endif
+}
+
+void addQuotedChar(char* word, size_t* word_len, char my_char) {
+	// Later stages skip any char marked with CTLESC
+	if(strchr(QUOTED_SPECIAL, my_char) != NULL) {
+		word[(*word_len)++] = CTLESC;
+	}
+	word[(*word_len)++] = my_char;
+}
+
+int addToken(TokenArr* my_tokens, int* token_arr_size, char* word, size_t word_len) {
+
+	// Double the array when full, keeping a slot for the terminating NULL
+	if(my_tokens->token_count + 1 == *token_arr_size) {
+		char** alloc_ret = realloc(my_tokens->tokens, *token_arr_size * 2 * sizeof(char*));
+		if(alloc_ret == NULL) {
+			return -1;
+		}
+		my_tokens->tokens = alloc_ret;
+		*token_arr_size *= 2;
+	}
+	my_tokens->tokens[my_tokens->token_count] = strndup(word, word_len);
+	if(my_tokens->tokens[my_tokens->token_count] == NULL) {
+		return -1;
+	}
+	my_tokens->token_count++;
+	my_tokens->tokens[my_tokens->token_count] = NULL; // Use for terminating as args
+	return 0;
+}
+
 TokenArr* tokenizeString(char* my_str) {
 	char error_message[] = "Error tokenizing string";
-	char* next_token;
 	int token_arr_size;
-	TokenArr* my_tokens = malloc(sizeof(TokenArr));
+	size_t len = strlen(my_str);
+	size_t pos = 0;
+	size_t run;
+	size_t word_len = 0;
+	int word_started = 0;
+	int ret_val = 0;
+	char* word;
+	TokenArr* my_tokens = poolAlloc(&tokenArrPool);
 	if(my_tokens == NULL) {
-		printf("%s\n", error_message);
+		fprintf(stderr, "%s\n", error_message);
+		return NULL;
 	}
 	
 	my_tokens->token_count = 0;
 	token_arr_size = 10; // Start with array of limit
 	my_tokens->tokens = malloc(token_arr_size * sizeof(char*));
-	if(my_tokens->tokens == NULL) {
-		printf("%s\n", error_message);
+
+	// Every char could gain a CTLESC
+	word = malloc(len * 2 + 1);
+	if(my_tokens->tokens == NULL || word == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		free(word);
+		free(my_tokens->tokens);
+		poolFree(&tokenArrPool, my_tokens);
 		return NULL;
 	}
+	my_tokens->tokens[0] = NULL;
 	
-	next_token = strtok(my_str, " ");
-	while(next_token != NULL) {
-	
-		// Check if there is enough space and realloc otherwise
-		if(my_tokens->token_count + 2 == token_arr_size) {
-			char* alloc_ret = NULL;
-			alloc_ret = realloc(my_tokens->tokens, (token_arr_size * sizeof(char*)) + sizeof(char*));
-			if(alloc_ret == NULL) {
-				fprintf(stderr, "%s\n", error_message);
-				return NULL;
-			}
-			token_arr_size++;
+	while(pos < len && ret_val == 0) {
+
+		// Copy plain chars up to the next one the lexer cares about
+		run = scanBytes(my_str + pos, len - pos, LEX_SPECIAL);
+		memcpy(word + word_len, my_str + pos, run);
+		word_len += run;
+		word_started |= run > 0;
+		pos += run;
+		if(pos == len) {
+			break;
+		}
+
+		switch(my_str[pos]) {
+			case ' ':
+			case '\t':
+			case '\n':
+			case '\r':
+				if(word_started) {
+					ret_val = addToken(my_tokens, &token_arr_size, word, word_len);
+				}
+				word_len = 0;
+				word_started = 0;
+				pos++;
+				break;
+
+			case '\'':
+				// Everything up to the closing quote is literal
+				run = scanBytes(my_str + pos + 1, len - pos - 1, "'");
+				if(pos + 1 + run == len) {
+					fprintf(stderr, "Error, unterminated quote\n");
+					ret_val = -1;
+					break;
+				}
+				for(size_t i = 0; i < run; i++) {
+					addQuotedChar(word, &word_len, my_str[pos + 1 + i]);
+				}
+				word_started = 1;
+				pos += run + 2;
+				break;
+
+			case '"':
+				// $ still expands, \ only escapes $ " \ and `
+				word_started = 1;
+				pos++;
+				while(1) {
+					run = scanBytes(my_str + pos, len - pos, "\"\\$");
+					for(size_t i = 0; i < run; i++) {
+						addQuotedChar(word, &word_len, my_str[pos + i]);
+					}
+					pos += run;
+					if(pos == len) {
+						fprintf(stderr, "Error, unterminated quote\n");
+						ret_val = -1;
+						break;
+					}
+					if(my_str[pos] == '"') {
+						pos++;
+						break;
+					}
+					if(my_str[pos] == '$' && pos + 2 < len && my_str[pos + 1] == '(' && my_str[pos + 2] == '(') {
+						if(lexArithmetic(my_str, len, &pos, word, &word_len) == -1) {
+							ret_val = -1;
+							break;
+						}
+					}
+					else if(my_str[pos] == '$') {
+						word[word_len++] = CTLQUOTE;
+						word[word_len++] = '$';
+						pos++;
+					}
+					else if(pos + 1 < len && strchr("$\"\\`", my_str[pos + 1]) != NULL) {
+						addQuotedChar(word, &word_len, my_str[pos + 1]);
+						pos += 2;
+					}
+					else {
+						addQuotedChar(word, &word_len, '\\');
+						pos++;
+					}
+				}
+				break;
+
+			case '\\':
+				// A trailing backslash is dropped
+				if(pos + 1 < len) {
+					addQuotedChar(word, &word_len, my_str[pos + 1]);
+					word_started = 1;
+				}
+				pos += 2;
+				break;
+
+			case '&':
+			case '|':
+				// && and || split words even without spaces
+				if(pos + 1 < len && my_str[pos + 1] == my_str[pos]) {
+					if(word_started) {
+						ret_val = addToken(my_tokens, &token_arr_size, word, word_len);
+					}
+					if(ret_val == 0) {
+						ret_val = addToken(my_tokens, &token_arr_size, my_str + pos, 2);
+					}
+					word_len = 0;
+					word_started = 0;
+					pos += 2;
+				}
+
+				// A lone & runs in the background unless it is part of &> or >&
+				else if(my_str[pos] == '&' && !(pos + 1 < len && my_str[pos + 1] == '>') 
+					&& !(word_len > 0 && (word[word_len - 1] == '>' || word[word_len - 1] == '<'))) {
+					if(word_started) {
+						ret_val = addToken(my_tokens, &token_arr_size, word, word_len);
+					}
+					if(ret_val == 0) {
+						ret_val = addToken(my_tokens, &token_arr_size, "&", 1);
+					}
+					word_len = 0;
+					word_started = 0;
+					pos++;
+				}
+				else {
+					word[word_len++] = my_str[pos++];
+					word_started = 1;
+				}
+				break;
+
+			case ';':
+				// Ends a command like a newline
+				if(word_started) {
+					ret_val = addToken(my_tokens, &token_arr_size, word, word_len);
+				}
+				if(ret_val == 0) {
+					ret_val = addToken(my_tokens, &token_arr_size, ";", 1);
+				}
+				word_len = 0;
+				word_started = 0;
+				pos++;
+				break;
+
+			case '$':
+				if(pos + 2 < len && my_str[pos + 1] == '(' && my_str[pos + 2] == '(') {
+					ret_val = lexArithmetic(my_str, len, &pos, word, &word_len);
+				}
+				else {
+					word[word_len++] = my_str[pos++];
+				}
+				word_started = 1;
+				break;
+
+			case '#':
+				// Comments only start at the beginning of a word
+				if(!word_started) {
+					pos = len;
+				}
+				else {
+					word[word_len++] = my_str[pos++];
+				}
+				break;
+
+			default:
+				// A raw CTLESC or CTLQUOTE in the input is kept literal
+				addQuotedChar(word, &word_len, my_str[pos++]);
+				word_started = 1;
+				break;
 		}
-		my_tokens->tokens[my_tokens->token_count] = strdup(next_token);
-		my_tokens->token_count++;
-		next_token = strtok(NULL, " ");
-		
 	}
 
-	my_tokens->tokens[my_tokens->token_count] = NULL; // Use for terminating as args
+	if(ret_val == 0 && word_started) {
+		ret_val = addToken(my_tokens, &token_arr_size, word, word_len);
+	}
+	free(word);
+	if(ret_val == -1) {
+		freeTokenArr(my_tokens);
+		return NULL;
+	}
 	return my_tokens;	
 }
 
-int parseInputs(char* input_buffer, int* input_size, FILE* input_stream) {	
-	size_t buffer_len = SHELL_MAX_INPUT; // The size of the buffer
+int lexArithmetic(char* my_str, size_t len, size_t* pos, char* word, size_t* word_len) {
+	size_t expr_start = *pos + 3;
+	size_t expr_end = expr_start;
+	int depth = 0;
+
+	// Find the )) that closes it, skipping over any inner brackets
+	for(; expr_end < len; expr_end++) {
+		if(my_str[expr_end] == '(') {
+			depth++;
+		}
+		else if(my_str[expr_end] == ')') {
+			if(depth == 0 && expr_end + 1 < len && my_str[expr_end + 1] == ')') {
+				break;
+			}
+			depth--;
+		}
+	}
+	if(expr_end >= len) {
+		fprintf(stderr, "Error, unterminated $((\n");
+		return -1;
+	}
+	memcpy(word + *word_len, "$((", 3);
+	*word_len += 3;
+	for(size_t i = expr_start; i < expr_end; i++) {
+		addQuotedChar(word, word_len, my_str[i]);
+	}
+	memcpy(word + *word_len, "))", 2);
+	*word_len += 2;
+	*pos = expr_end + 2;
+	return 0;
+}
+
+char* findUnquoted(char* my_str, char* my_needle) {
+	size_t needle_len = strlen(my_needle);
+	for(size_t i = 0; my_str[i] != '\0'; i++) {
+		if(my_str[i] == CTLESC) {
+			if(my_str[++i] == '\0') {
+				break;
+			}
+			continue;
+		}
+		if(strncmp(my_str + i, my_needle, needle_len) == 0) {
+			return my_str + i;
+		}
+	}
+	return NULL;
+}
+
+void dequoteString(char* my_str) {
+	char* write_ptr = my_str;
+	for(char* read_ptr = my_str; *read_ptr != '\0'; read_ptr++) {
+		if(*read_ptr == CTLESC) {
+			read_ptr++;
+			if(*read_ptr == '\0') {
+				break;
+			}
+		}
+		else if(*read_ptr == CTLQUOTE) {
+			continue;
+		}
+		*write_ptr++ = *read_ptr;
+	}
+	*write_ptr = '\0';
+}
+
+void dequoteTokens(TokenArr* my_tokens) {
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		dequoteString(my_tokens->tokens[i]);
+	}
+}
+
+int parseInputs(char** input_line, ssize_t* input_size, FILE* input_stream) {	
 	
-	// Getting next user input
-	*input_size = getline(&input_buffer, &buffer_len, input_stream);
+	// Interactive input goes through the event loop
+	if(input_stream == stdin && epoll_fd != -1) {
+		return readEventLoop(input_line, input_size);
+	}
+
+	// Getting next user input, getline grows line_buf as needed
+	*input_size = getline(&line_buf, &line_cap, input_stream);
+	*input_line = line_buf;
 
 	// Checking whether input has errors or not
 	if(*input_size == -1) {
@@ -83,8 +584,8 @@ int parseInputs(char* input_buffer, int* input_size, FILE* input_stream) {
 	}
 
 	// Sanitize string to not include \n
-	else if(*input_size >= 1){
-		input_buffer[*input_size - 1] = '\0';
+	else if(*input_size >= 1 && line_buf[*input_size - 1] == '\n'){
+		line_buf[*input_size - 1] = '\0';
 		(*input_size)--;
 	}
 	return 0;
@@ -93,12 +594,30 @@ int parseInputs(char* input_buffer, int* input_size, FILE* input_stream) {
 int substituteShellVars(TokenArr* my_tokens) {
 	char* my_var;
 	char* shortened_input;
+	char status_str[4];
+	int var_quoted;
 	for(int i = 0;i< my_tokens->token_count;i++) {
-		if(my_tokens->tokens[i][0] == '$') { // If token is a var
-			shortened_input = &my_tokens->tokens[i][1]; // Retrieve str without the $
+		var_quoted = my_tokens->tokens[i][0] == CTLQUOTE;
+		if(my_tokens->tokens[i][var_quoted] == '$') { // If token is a var
+			shortened_input = &my_tokens->tokens[i][var_quoted + 1]; // Retrieve str without the $
 			
+			// Exit status of the last command
+			if(strcmp(shortened_input, "?") == 0) {
+				snprintf(status_str, sizeof(status_str), "%d", exit_global & 0xFF);
+				my_var = status_str;
+			}
+
+			// $1..$n are the args of the running function
+			else if(shortened_input[0] >= '1' && shortened_input[0] <= '9' 
+				&& strspn(shortened_input, "0123456789") == strlen(shortened_input)) {
+				int arg_index = atoi(shortened_input);
+				my_var = (funcArgs != NULL && arg_index < funcArgs->token_count) ? funcArgs->tokens[arg_index] : "";
+			}
+
 			// Get from env first
-			my_var = getenv(shortened_input);
+			else {
+				my_var = getenv(shortened_input);
+			}
 
 			// If var not found in env
 			if(my_var == NULL) {
@@ -106,12 +625,21 @@ int substituteShellVars(TokenArr* my_tokens) {
 			}
 			// Replacing the token with the var's value
 			free(my_tokens->tokens[i]);
-			my_tokens->tokens[i] = malloc(strlen(my_var) + 1);
+			my_tokens->tokens[i] = malloc(strlen(my_var) * (var_quoted + 1) + 1);
 			if(my_tokens->tokens[i] == NULL) {
 				fprintf(stderr, "Malloc error\n");
 				return -1;
 			}
-			if(strcpy(my_tokens->tokens[i], my_var) == NULL) {
+
+			// A "$var" stays quoted so globs and redirects leave its value alone
+			if(var_quoted) {
+				size_t val_len = 0;
+				for(size_t j = 0; my_var[j] != '\0'; j++) {
+					addQuotedChar(my_tokens->tokens[i], &val_len, my_var[j]);
+				}
+				my_tokens->tokens[i][val_len] = '\0';
+			}
+			else if(strcpy(my_tokens->tokens[i], my_var) == NULL) {
 				fprintf(stderr, "Substitute copy error\n");
 				return -1;
 			}
@@ -120,783 +648,6228 @@ int substituteShellVars(TokenArr* my_tokens) {
 	return 0;
 }
 
-void programLoop(FILE* input_stream) {
-	TokenArr* my_tokens;
-	char user_input[SHELL_MAX_INPUT];
-	int input_size;
-	char* redirect_val = NULL;
+int expandArithmetic(TokenArr* my_tokens) {
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		size_t search_from = 0;
+		char* expr_start;
+		while((expr_start = findUnquoted(my_tokens->tokens[i] + search_from, "$((")) != NULL) {
+			char* my_token = my_tokens->tokens[i];
+			char* expr_end = findUnquoted(expr_start + 3, "))");
+			char* new_token;
+			char num_str[24];
+			long long expr_val;
+			size_t prefix_len = expr_start - my_token;
+			size_t num_len;
 
-	// Run loop until exit
-	while(1) {
-		if(input_stream == stdin) {
-			printf("wsh> ");
-			fflush(stdout);
-		}	
+			// Only the lexer makes these so the )) is always there
+			if(expr_end == NULL) {
+				break;
+			}
+			*expr_end = '\0';
+			dequoteString(expr_start + 3);
+			if(evalArithmetic(expr_start + 3, &expr_val) == -1) {
+				return -1;
+			}
+			num_len = sprintf(num_str, "%lld", expr_val);
+			new_token = malloc(prefix_len + num_len + strlen(expr_end + 2) + 1);
+			if(new_token == NULL) {
+				fprintf(stderr, "Malloc error\n");
+				return -1;
+			}
+			memcpy(new_token, my_token, prefix_len);
+			memcpy(new_token + prefix_len, num_str, num_len);
+			strcpy(new_token + prefix_len + num_len, expr_end + 2);
+			free(my_token);
+			my_tokens->tokens[i] = new_token;
+			search_from = prefix_len + num_len;
+		}
+	}
+	return 0;
+}
 
-		// Don't want to execute further if cant parse
-		if(parseInputs(user_input, &input_size, input_stream) == -1) {
-			exit_global = -1;
-			continue;
+int evalArithmetic(char* my_expr, long long* expr_val) {
+	struct ArithParser my_parser = {my_expr, 0, 0};
+
+	*expr_val = parseArithAssign(&my_parser);
+	while(isspace((unsigned char)*my_parser.expr_pos)) {
+		my_parser.expr_pos++;
+	}
+	if(!my_parser.arith_error && *my_parser.expr_pos != '\0') {
+		fprintf(stderr, "Error, bad arithmetic near %s\n", my_parser.expr_pos);
+		my_parser.arith_error = 1;
+	}
+	return my_parser.arith_error ? -1 : 0;
+}
+
+long long parseArithAssign(struct ArithParser* my_parser) {
+	char* start_pos = my_parser->expr_pos;
+	char* name_end;
+	char* op_str;
+	int op_len = 0;
+	long long rhs;
+	long long lhs;
+
+	// An assignment is a bare var name then = or a compound op like +=
+	while(isspace((unsigned char)*start_pos)) {
+		start_pos++;
+	}
+	name_end = start_pos;
+	if(isalpha((unsigned char)*name_end) || *name_end == '_') {
+		while(isalnum((unsigned char)*name_end) || *name_end == '_') {
+			name_end++;
 		}
-		
-		// Check for EOF after getting input
-		if(feof(input_stream)) {
-			wshExit();
+		op_str = name_end;
+		while(isspace((unsigned char)*op_str)) {
+			op_str++;
 		}
-
-		if(input_size != 0) {
-			my_tokens = tokenizeString(user_input); // Tokenize input
-			if(my_tokens->tokens[0][0] != '#') {				
-				if(substituteShellVars(my_tokens) == -1) {
-					exit_global = -1;
-					freeTokenArr(my_tokens);
-					continue;
-				}
-				
-				// Check for redirect
-				redirect_val = getRedirect(my_tokens->tokens[my_tokens->token_count - 1]);
-				if(redirect_val != NULL) {
-
-					// Last token not part of command
-					if(performRedirect(redirect_val, my_tokens->tokens[my_tokens->token_count - 1]) == -1) {
-						exit_global = -1;
-						freeTokenArr(my_tokens);
-						continue;
-					}
-					free(my_tokens->tokens[my_tokens->token_count -1]);
-					my_tokens->tokens[my_tokens->token_count -1] = NULL;
-					my_tokens->token_count--;
+		if(op_str[0] == '=' && op_str[1] != '=') {
+			op_len = 0;
+		}
+		else if(!isCompoundAssign(op_str, &op_len)) {
+			op_str = NULL;
+		}
+		if(op_str != NULL) {
+			char var_name[name_end - start_pos + 1];
+			memcpy(var_name, start_pos, name_end - start_pos);
+			var_name[name_end - start_pos] = '\0';
+			my_parser->expr_pos = op_str + op_len + 1;
+			rhs = parseArithAssign(my_parser);
+			if(my_parser->arith_error) {
+				return 0;
+			}
+			if(op_len > 0) {
+				if(getArithVar(var_name, &lhs) == -1) {
+					my_parser->arith_error = 1;
+					return 0;
 				}
-				exit_global = runCommand(my_tokens);
-				restoreFileDescs();
+				rhs = applyArithOp(my_parser, op_str, op_len, lhs, rhs);
 			}
-			freeTokenArr(my_tokens);
+			if(my_parser->skip_depth == 0 && !my_parser->arith_error && setArithVar(var_name, rhs) == -1) {
+				my_parser->arith_error = 1;
+			}
+			return rhs;
 		}
 	}
-	wshExit();
+	return parseArithBinary(my_parser, ARITH_MIN_PREC);
 }
 
-int checkBuiltIn(char* my_command) {
-	int commands_size = (sizeof(COMMAND_ARR)/sizeof(char*));
-	for(int i = 0; i < commands_size;i++) {
-		if(strcmp(my_command, COMMAND_ARR[i]) == 0) {
-			return i;
-		}
+int arithOperator(char* op_str, int* op_len) {
+	*op_len = 2;
+	switch(op_str[0]) {
+		case '|':
+			if(op_str[1] == '|') {
+				return 1;
+			}
+			*op_len = 1;
+			return 3;
+		case '&':
+			if(op_str[1] == '&') {
+				return 2;
+			}
+			*op_len = 1;
+			return 5;
+		case '^':
+			*op_len = 1;
+			return 4;
+		case '=':
+			return op_str[1] == '=' ? 6 : 0;
+		case '!':
+			return op_str[1] == '=' ? 6 : 0;
+		case '<':
+		case '>':
+			if(op_str[1] == op_str[0]) {
+				return 8;
+			}
+			*op_len = op_str[1] == '=' ? 2 : 1;
+			return 7;
+		case '+':
+		case '-':
+			*op_len = 1;
+			return 9;
+		case '*':
+		case '/':
+		case '%':
+			*op_len = 1;
+			return 10;
 	}
-	return -1;
+	return 0;
 }
 
-char* getShellVar(char* var_name) {
-	struct ShellVar* my_var;
-	my_var = shellLinkedListHead;
-	while(my_var != NULL) {
-		if(strcmp(my_var->var_name, var_name) == 0) {
-			return my_var->var_val;
-		}
-		my_var = my_var->next_var;
+int isCompoundAssign(char* op_str, int* op_len) {
+	int op_prec = arithOperator(op_str, op_len);
+
+	// Bit, shift and math ops have a form like +=, logic and comparisons don't
+	return ((op_prec >= 3 && op_prec <= 5) || op_prec >= 8) && op_str[*op_len] == '=';
+}
+
+long long applyArithOp(struct ArithParser* my_parser, char* op_str, int op_len, long long lhs, long long rhs) {
+	// Wrap on overflow instead of leaving it undefined
+	unsigned long long ulhs = lhs;
+	unsigned long long urhs = rhs;
+
+	switch(op_str[0]) {
+		case '|':
+			return op_len == 2 ? (lhs || rhs) : (long long)(ulhs | urhs);
+		case '&':
+			return op_len == 2 ? (lhs && rhs) : (long long)(ulhs & urhs);
+		case '^':
+			return ulhs ^ urhs;
+		case '=':
+			return lhs == rhs;
+		case '!':
+			return lhs != rhs;
+		case '<':
+			if(op_str[1] == '<') {
+				return ulhs << (urhs & 63);
+			}
+			return op_len == 2 ? lhs <= rhs : lhs < rhs;
+		case '>':
+			if(op_str[1] == '>') {
+				return lhs >> (urhs & 63);
+			}
+			return op_len == 2 ? lhs >= rhs : lhs > rhs;
+		case '+':
+			return ulhs + urhs;
+		case '-':
+			return ulhs - urhs;
+		case '*':
+			return ulhs * urhs;
+		case '/':
+		case '%':
+			if(rhs == 0) {
+				// The skipped side of && or || can't fail
+				if(my_parser->skip_depth == 0) {
+					fprintf(stderr, "Error, division by zero\n");
+					my_parser->arith_error = 1;
+				}
+				return 0;
+			}
+			if(rhs == -1) {
+				return op_str[0] == '/' ? (long long)(0 - ulhs) : 0;
+			}
+			return op_str[0] == '/' ? lhs / rhs : lhs % rhs;
 	}
-	return "";
+	return 0;
 }
 
-int findShellVar(char* var_name) {
-	int index = 0;
-	struct ShellVar* var_ptr = shellLinkedListHead;
+long long parseArithBinary(struct ArithParser* my_parser, int min_prec) {
+	long long lhs = parseArithUnary(my_parser);
+	long long rhs;
+	char* op_str;
+	int op_len;
+	int op_prec;
 
-	// Linear search for var index
-	while(var_ptr != NULL) {
+	while(!my_parser->arith_error) {
+		while(isspace((unsigned char)*my_parser->expr_pos)) {
+			my_parser->expr_pos++;
+		}
+		op_str = my_parser->expr_pos;
+		op_prec = arithOperator(op_str, &op_len);
 
-		// Var found
-		if(strcmp(var_ptr->var_name,var_name) == 0){
-			return index;
+		// A compound assignment isn't a binary op, it fails as bad syntax later
+		if(op_prec < min_prec || isCompoundAssign(op_str, &op_len)) {
+			break;
+		}
+		my_parser->expr_pos += op_len;
+
+		// && and || skip the side they don't need
+		int skip_rhs = (op_prec == 2 && !lhs) || (op_prec == 1 && lhs);
+		my_parser->skip_depth += skip_rhs;
+		rhs = parseArithBinary(my_parser, op_prec + 1);
+		my_parser->skip_depth -= skip_rhs;
+		if(skip_rhs) {
+			lhs = op_prec == 1;
+		}
+		else {
+			lhs = applyArithOp(my_parser, op_str, op_len, lhs, rhs);
 		}
-		var_ptr = var_ptr->next_var;
-		index++;
 	}
-	return -1; // Var not found
+	return lhs;
 }
 
-int tokenCmp(TokenArr* arr1, TokenArr* arr2) {
+long long parseArithUnary(struct ArithParser* my_parser) {
+	char* my_pos;
+	long long my_val;
 
-	// Compare they're same size
-	if(arr1->token_count != arr2->token_count) {
-		return 0;
+	while(isspace((unsigned char)*my_parser->expr_pos)) {
+		my_parser->expr_pos++;
+	}
+	my_pos = my_parser->expr_pos;
+	switch(*my_pos) {
+		case '-':
+			my_parser->expr_pos++;
+			return 0 - (unsigned long long)parseArithUnary(my_parser);
+		case '+':
+			my_parser->expr_pos++;
+			return parseArithUnary(my_parser);
+		case '!':
+			my_parser->expr_pos++;
+			return !parseArithUnary(my_parser);
+		case '~':
+			my_parser->expr_pos++;
+			return ~parseArithUnary(my_parser);
+		case '(':
+			my_parser->expr_pos++;
+			my_val = parseArithAssign(my_parser);
+			while(isspace((unsigned char)*my_parser->expr_pos)) {
+				my_parser->expr_pos++;
+			}
+			if(*my_parser->expr_pos != ')') {
+				if(!my_parser->arith_error) {
+					fprintf(stderr, "Error, missing ) in arithmetic\n");
+				}
+				my_parser->arith_error = 1;
+				return 0;
+			}
+			my_parser->expr_pos++;
+			return my_val;
 	}
 
-	// Compare each token
-	for(int i = 0; i < arr1->token_count;i++) {
-		if(strcmp(arr1->tokens[i],arr2->tokens[i]) != 0) {
+	// Numbers take C's 0x and 0 prefixes
+	if(isdigit((unsigned char)*my_pos)) {
+		errno = 0;
+		my_val = strtoll(my_pos, &my_parser->expr_pos, 0);
+		if(errno == ERANGE || isalnum((unsigned char)*my_parser->expr_pos) || *my_parser->expr_pos == '_') {
+			fprintf(stderr, "Error, bad number %s in arithmetic\n", my_pos);
+			my_parser->arith_error = 1;
 			return 0;
 		}
+		return my_val;
 	}
-	return -1;
-}
-
-TokenArr* copyTokenArr(TokenArr* my_tokens) {
-	char error_message[] = "Error copying token arr";
-	TokenArr* my_copy;
 
-	// Allocating copy
-	my_copy = malloc(sizeof(TokenArr));
-	if(my_copy == NULL) {
-		printf("%s\n", error_message);
-		return NULL;
+	// Vars can be written with or without the $
+	if(*my_pos == '$') {
+		my_pos++;
+		if(*my_pos == '?') {
+			my_parser->expr_pos = my_pos + 1;
+			return exit_global & 0xFF;
+		}
+		if(isdigit((unsigned char)*my_pos)) {
+			int arg_index = strtol(my_pos, &my_parser->expr_pos, 10);
+			char* arg_val = (funcArgs != NULL && arg_index > 0 && arg_index < funcArgs->token_count) ? funcArgs->tokens[arg_index] : "";
+			char* arg_end;
+			my_val = strtoll(arg_val, &arg_end, 10);
+			if(*arg_end != '\0') {
+				fprintf(stderr, "Error, $%d is not a number\n", arg_index);
+				my_parser->arith_error = 1;
+			}
+			return my_val;
+		}
 	}
-	my_copy->token_count = my_tokens->token_count;
-
-	// Allocating copy's tokens arr
-	my_copy->tokens = malloc((my_copy->token_count + 1) * sizeof(char*));
-	if(my_copy->tokens == NULL) {
-		printf("%s\n", error_message);
-		return NULL;
+	if(isalpha((unsigned char)*my_pos) || *my_pos == '_') {
+		char* name_end = my_pos;
+		while(isalnum((unsigned char)*name_end) || *name_end == '_') {
+			name_end++;
+		}
+		char var_name[name_end - my_pos + 1];
+		memcpy(var_name, my_pos, name_end - my_pos);
+		var_name[name_end - my_pos] = '\0';
+		my_parser->expr_pos = name_end;
+		if(getArithVar(var_name, &my_val) == -1) {
+			my_parser->arith_error = 1;
+			return 0;
+		}
+		return my_val;
 	}
-
-	// Copy values over
-	for(int i = 0;i < my_copy->token_count;i++) {
-		my_copy->tokens[i] = malloc(strlen(my_tokens->tokens[i]) + sizeof(char*));
-		if(my_copy->tokens[i] == NULL) {
-			printf("%s\n", error_message);
-			return NULL;
+	if(!my_parser->arith_error) {
+		if(*my_pos == '\0') {
+			fprintf(stderr, "Error, arithmetic ends early\n");
 		}
-		if(strcpy(my_copy->tokens[i], my_tokens->tokens[i]) == NULL)  {
-			printf("%s\n", error_message);
-			return NULL;
+		else {
+			fprintf(stderr, "Error, bad arithmetic near %s\n", my_pos);
 		}
 	}
-	my_copy->tokens[my_copy->token_count] = NULL; // Terminating null when used as args
-	return my_copy;
+	my_parser->arith_error = 1;
+	return 0;
 }
 
-int addHistEntry(TokenArr* my_tokens) { 
-	char error_message[] = "Error adding command to history";
+int getArithVar(char* var_name, long long* var_num) {
+	struct ShellVar* my_var;
+	char* var_val = getenv(var_name);
+	char* val_end;
 
-	// Adding first entry
-	if(histSize == 0) {
-		histHead = malloc(sizeof(struct HistEntry));
-		histTail = histHead;
-		if(histHead == NULL || histTail == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			return -1;
+	// Env vars win like in substituteShellVars but have nowhere to cache
+	if(var_val == NULL) {
+		my_var = findShellVar(var_name);
+		if(my_var == NULL) {
+			*var_num = 0;
+			return 0;
 		}
-
-		// Create a copy of the tokens at head entry
-		histHead->entry_tokens = copyTokenArr(my_tokens);
-		histHead->next_entry = NULL;
-		histHead->prev_entry = NULL;
-		histSize++;
-	}
-
-	// >= 1 Entry
-	else if(tokenCmp(histHead->entry_tokens, my_tokens) != 1){
-		struct HistEntry* command_ptr;
-		command_ptr = malloc(sizeof(struct HistEntry));
-		if(command_ptr == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			return -1;
+		if(my_var->num_valid) {
+			*var_num = my_var->var_num;
+			return 0;
 		}
-		command_ptr->entry_tokens = copyTokenArr(my_tokens);
-		command_ptr->next_entry = histHead;
-		histHead->prev_entry = command_ptr;
-		command_ptr->prev_entry = NULL;
-		histHead = command_ptr;
-		histSize++;
+		var_val = my_var->var_val;
+	}
+	else {
+		my_var = NULL;
 	}
 
-	// Remove any entries over limit 
-	while(histSize > histLimit) {
-		removeHistEntry();
+	// Unset and empty vars are 0
+	errno = 0;
+	*var_num = strtoll(var_val, &val_end, 10);
+	while(isspace((unsigned char)*val_end)) {
+		val_end++;
+	}
+	if(errno == ERANGE || *val_end != '\0') {
+		fprintf(stderr, "Error, %s is not a number\n", var_name);
+		return -1;
+	}
+	if(my_var != NULL) {
+		my_var->var_num = *var_num;
+		my_var->num_valid = 1;
 	}
 	return 0;
 }
 
-struct HistEntry* getHistEntry(int index) {
-	index = index-1;
-	struct HistEntry* ret_val;
-	ret_val = histHead;
-	for(int i = 0; i < index;i++) {
-		ret_val = ret_val->next_entry;
-	}
-	return ret_val;
-}
+int setArithVar(char* var_name, long long var_num) {
+	struct ShellVar* my_var;
+	char num_str[24];
 
-void freeTokenArr(TokenArr* my_tokens) {
-	for(int i = 0;i < my_tokens->token_count;i++) {
-		free(my_tokens->tokens[i]);
+	// The string is still kept for $var and vars
+	sprintf(num_str, "%lld", var_num);
+	if(getenv(var_name) != NULL) {
+		return wshExport(var_name, num_str);
 	}
-	free(my_tokens->tokens);
-	free(my_tokens);
+	if(wshLocal(var_name, num_str) == -1) {
+		return -1;
+	}
+	my_var = findShellVar(var_name);
+	my_var->var_num = var_num;
+	my_var->num_valid = 1;
+	return 0;
 }
 
-void removeHistEntry() {
-	struct HistEntry* hist_ptr = histTail;
-	freeTokenArr(hist_ptr->entry_tokens);
-	histTail = hist_ptr->prev_entry;
-	free(histTail->next_entry);
-	histTail->next_entry = NULL;
-	histSize--;
-}
+int wshLet(TokenArr* my_tokens) {
+	long long expr_val = 0;
 
-void freeHistory() {
-	struct HistEntry* next_entry_ptr;
-	struct HistEntry* current_entry_ptr;
-	current_entry_ptr = histHead;
-	while(current_entry_ptr != NULL) {
-		next_entry_ptr = current_entry_ptr->next_entry;
-		freeTokenArr(current_entry_ptr->entry_tokens);
-		free(current_entry_ptr);
-		current_entry_ptr = next_entry_ptr;
+	if(my_tokens->token_count < 2) {
+		fprintf(stderr, "Error, let needs an expression\n");
+		return -1;
 	}
-}
-
-void freeShellVars() {
-	struct ShellVar* next_entry_ptr;
-	struct ShellVar* current_entry_ptr;
-	current_entry_ptr = shellLinkedListHead;
-	while(current_entry_ptr != NULL) {
-		next_entry_ptr = current_entry_ptr->next_var;
-		free(current_entry_ptr);
-		current_entry_ptr = next_entry_ptr;
+	for(int i = 1; i < my_tokens->token_count; i++) {
+		if(evalArithmetic(my_tokens->tokens[i], &expr_val) == -1) {
+			return -1;
+		}
 	}
+	return expr_val == 0;
 }
 
-char* getPath(TokenArr* my_tokens) {
-	char error_message[] = "Error getting path";
-	int acc_val;
-	char* command_cpy;
-	command_cpy = malloc(strlen(my_tokens->tokens[0]) + sizeof(char*));
-	if(command_cpy == NULL) {
-		return NULL;
-	}
+void programLoop(FILE* input_stream) {
+	TokenArr* my_tokens;
+	char* user_input;
+	ssize_t input_size;
+	int line_num = 0;
+	char frame_label[PATH_MAX + 16];
+	struct stat input_stat;
+	int input_is_file;
 
-	if(strcpy(command_cpy, my_tokens->tokens[0]) == NULL) {
-		fprintf(stderr, "%s\n", error_message);
-		return NULL;
-	}
-	
-	// Check if in wd
-	acc_val = access(command_cpy, X_OK);
-	if(acc_val == 0) {
-		return command_cpy;
-	}
-	else {
-		char* path_ptr;
-		char* path_str;
-		char* full_dir_ptr;
+	getCwd(); // So $PWD is right from the first line
+	input_is_file = !(input_stream == stdin && epoll_fd != -1) && fstat(fileno(input_stream), &input_stat) == 0 
+		&& S_ISREG(input_stat.st_mode);
 
-		path_str = malloc(sizeof(char) * MAX_DIR_SIZE);
-		if(path_str == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			free(command_cpy);
-			return NULL;
-		}
+	// Run loop until exit
+	while(1) {
+		if(input_stream == stdin) {
+			printf("wsh> ");
+			fflush(stdout);
+		}	
 
-		// Copy path var into path_str
-		if(strcpy(path_str, getenv("PATH")) == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			free(command_cpy);
-			return NULL;
+		// Don't want to execute further if cant parse
+		if(parseInputs(&user_input, &input_size, input_stream) == -1) {
+			exit_global = -1;
+			continue;
+		}
+		line_num++;
+		
+		// Check for EOF after getting input
+		if(inputAtEOF(input_stream)) {
+			if(pendingFunc != NULL) {
+				fprintf(stderr, "Error, function %s has no closing }\n", pendingFunc->func_name);
+				exit_global = -1;
+			}
+			wshExit();
 		}
 
-		// Allocate mem for the dir
-		full_dir_ptr = malloc(sizeof(char) * MAX_DIR_SIZE);
-		if(full_dir_ptr == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			free(command_cpy);
-			return NULL;
+		// Script mode and stdin that can't be polled have no idle time so reap here
+		if(epoll_fd == -1 || !stdin_pollable) {
+			reapJobs(0);
 		}
 
-		// Check for each path
-		path_ptr = strtok(path_str, ":");
-		while(path_ptr != NULL) {
+		if(input_size > 0) {
+			my_tokens = tokenizeString(user_input); // Tokenize input
+			if(my_tokens == NULL) {
+				exit_global = -1;
+				continue;
+			}
 
-			full_dir_ptr[0] = '\0'; // Clearing str
-			
-			// Concat for full path
-			strcat(full_dir_ptr, path_ptr);
-			strcat(full_dir_ptr, "/");
-			strcat(full_dir_ptr, command_cpy);
-			
-			// Check for exec access
-			if(access(full_dir_ptr, X_OK) == 0) {
-				free(path_str);
-				free(command_cpy);
-				return full_dir_ptr;
-			}
-			path_ptr = strtok(NULL, ":"); // Get new path
-			strcpy(command_cpy, my_tokens->tokens[0]);
-			
+			// A script's last line may exec its last command instead of forking.
+			// Only files are peeked, a pipe or socket would wait for the next line first
+			if(input_is_file) {
+				int next_char = getc(input_stream);
+				tail_exec_line = next_char == EOF;
+				if(next_char != EOF) {
+					ungetc(next_char, input_stream);
+				}
+			}
+
+			// Copied since the reader's buffer can move while the line runs
+			if(editor_on && input_stream == stdin) {
+				hist_line = strdup(user_input);
+			}
+			if(profile_on && my_tokens->token_count > 0) {
+				snprintf(frame_label, sizeof(frame_label), "%s:%d", profile_script, line_num);
+				profileEnter(frame_label, user_input, NULL);
+				exit_global = runLine(my_tokens);
+				profileLeave();
+			}
+			else {
+				exit_global = runLine(my_tokens);
+			}
+			tail_exec_line = 0;
+			free(hist_line);
+			hist_line = NULL;
+			freeTokenArr(my_tokens);
+			if(exit_requested) {
+				wshExit();
+			}
 		}
-		free(full_dir_ptr);
-		free(path_str);
-		free(command_cpy);
-		return NULL; // No path found
 	}
-	
+	wshExit();
 }
 
-char* getRedirect(char* my_token) {
-	if(strstr(my_token, "&>>") != NULL) {
-		return "&>>";
-	}
-	else if (strstr(my_token, "&>") != NULL) {
-		return "&>";
+int runLine(TokenArr* my_tokens) {
+	// Lines of a function body are kept until its closing }
+	if(pendingFunc != NULL) {
+		return addFuncLine(my_tokens, 0);
 	}
-	else if(strstr(my_token, ">>") != NULL) {
-		return ">>";
+	if(my_tokens->token_count == 0 || my_tokens->tokens[0][0] == '#') {
+		return exit_global;
 	}
-	else if(strstr(my_token, ">") != NULL) {
-		return ">";
+	if(isFuncStart(my_tokens)) {
+		return defineFunction(my_tokens);
 	}
-	else if(strstr(my_token, "<") != NULL) {
-		return "<";
+	return runCommandList(my_tokens);
+}
+
+long childCpuUs() {
+	struct rusage child_usage;
+	getrusage(RUSAGE_CHILDREN, &child_usage);
+	return (child_usage.ru_utime.tv_sec + child_usage.ru_stime.tv_sec) * 1000000L 
+		+ child_usage.ru_utime.tv_usec + child_usage.ru_stime.tv_usec;
+}
+
+struct ProfileEntry* findProfileEntry(struct ProfileEntry** entry_buckets, char* entry_key) {
+	size_t bucket = hashVarName(entry_key) % PROFILE_BUCKETS;
+	struct ProfileEntry* my_entry;
+
+	for(my_entry = entry_buckets[bucket]; my_entry != NULL; my_entry = my_entry->next_entry) {
+		if(strcmp(my_entry->entry_key, entry_key) == 0) {
+			return my_entry;
+		}
 	}
-	else {
+	my_entry = calloc(1, sizeof(struct ProfileEntry));
+	if(my_entry == NULL || (my_entry->entry_key = strdup(entry_key)) == NULL) {
+		free(my_entry);
 		return NULL;
 	}
+	my_entry->next_entry = entry_buckets[bucket];
+	entry_buckets[bucket] = my_entry;
+	return my_entry;
 }
 
-int outputAppend(char* lhs, char* rhs) {
-	int lhs_file = atoi(lhs);
-	int rhs_file = open(rhs, O_WRONLY | O_CREAT | O_APPEND, 
-	S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+int profileEnter(char* frame_label, char* frame_text, TokenArr* frame_tokens) {
+	struct ProfileFrame* my_frame;
+	struct ProfileEntry* line_entry;
+	char* parent_key = profileDepth > 0 ? profileFrames[profileDepth - 1].stack_key : "";
+	size_t parent_len = strlen(parent_key);
 
-	// Error checking
-	if(lhs_file < 0 || rhs_file == -1) {
+	if(profileDepth == profileCap) {
+		struct ProfileFrame* alloc_ret = realloc(profileFrames, (profileCap * 2 + 16) * sizeof(struct ProfileFrame));
+		if(alloc_ret == NULL) {
+			fprintf(stderr, "Error growing profiler stack\n");
+			return -1;
+		}
+		profileFrames = alloc_ret;
+		profileCap = profileCap * 2 + 16;
+	}
+
+	// ; splits frames in the folded format so a label can't hold one
+	my_frame = &profileFrames[profileDepth];
+	my_frame->stack_key = malloc(parent_len + strlen(frame_label) + 2);
+	my_frame->frame_label = my_frame->stack_key;
+	if(my_frame->stack_key == NULL) {
+		fprintf(stderr, "Error entering profiler frame\n");
 		return -1;
 	}
+	sprintf(my_frame->stack_key, parent_len > 0 ? "%s;%s" : "%s%s", parent_key, frame_label);
+	my_frame->frame_label = my_frame->stack_key + (parent_len > 0 ? parent_len + 1 : 0);
+	for(char* label_ptr = my_frame->frame_label; *label_ptr != '\0'; label_ptr++) {
+		if(*label_ptr == ';') {
+			*label_ptr = ',';
+		}
+	}
 
-	// Redirect lhs to rhs
-	original_desc = lhs_file;
-	new_desc = dup(original_desc);
-	return dup2(rhs_file, lhs_file);	
+	// A line's text is only kept the first time it runs
+	line_entry = findProfileEntry(profileLines, my_frame->frame_label);
+	if(line_entry != NULL && line_entry->calls == 0) {
+		line_entry->entry_text = frame_text != NULL ? strdup(frame_text) : frame_tokens != NULL ? joinTokens(frame_tokens) : NULL;
+	}
+	profileDepth++;
+	my_frame->nested_wall_us = 0;
+	my_frame->nested_cpu_us = 0;
+	my_frame->nested_spawns = 0;
+	my_frame->start_spawns = spawn_count;
+	my_frame->start_cpu_us = childCpuUs();
+	clock_gettime(CLOCK_MONOTONIC, &my_frame->start);
+	return 0;
 }
 
-int inputRedirect(char* lhs, char* rhs) {
-	int lhs_file = atoi(lhs);
-	int rhs_file = open(rhs, O_RDONLY);	
+void profileLeave() {
+	struct ProfileFrame* my_frame;
+	struct ProfileEntry* stack_entry;
+	struct ProfileEntry* line_entry;
+	long wall_us;
+	long cpu_us;
+	long spawns;
 
-	// Error checking
-	if(rhs_file == -1 || lhs_file < 0) {
-		return -1;
+	if(profileDepth == 0) {
+		return;
 	}
+	my_frame = &profileFrames[--profileDepth];
+	wall_us = elapsedUs(&my_frame->start);
+	cpu_us = childCpuUs() - my_frame->start_cpu_us;
+	spawns = spawn_count - my_frame->start_spawns;
 
-	// Redirect rhs as input to lhs
-	original_desc = lhs_file;
-	new_desc = dup(original_desc);
-	return dup2(rhs_file, lhs_file);
+	// Stacks get self time as flamegraphs add up the frames below, lines get the total
+	stack_entry = findProfileEntry(profileStacks, my_frame->stack_key);
+	if(stack_entry != NULL) {
+		stack_entry->wall_us += wall_us - my_frame->nested_wall_us;
+		stack_entry->cpu_us += cpu_us - my_frame->nested_cpu_us;
+		stack_entry->spawns += spawns - my_frame->nested_spawns;
+		stack_entry->calls++;
+	}
+	line_entry = findProfileEntry(profileLines, my_frame->frame_label);
+	if(line_entry != NULL) {
+		line_entry->wall_us += wall_us;
+		line_entry->cpu_us += cpu_us;
+		line_entry->spawns += spawns;
+		line_entry->calls++;
+	}
+	if(profileDepth > 0) {
+		profileFrames[profileDepth - 1].nested_wall_us += wall_us;
+		profileFrames[profileDepth - 1].nested_cpu_us += cpu_us;
+		profileFrames[profileDepth - 1].nested_spawns += spawns;
+	}
+	free(my_frame->stack_key);
+}
+int cmpProfileKeys(const void* lhs, const void* rhs) {
+	return strcmp((*(struct ProfileEntry**)lhs)->entry_key, (*(struct ProfileEntry**)rhs)->entry_key);
 }
 
-int outputRedirect(char* lhs, char* rhs) {
-	int lhs_file = atoi(lhs);
-	int rhs_file = open(rhs, O_WRONLY | O_TRUNC | O_CREAT,
-	 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+int cmpProfileWall(const void* lhs, const void* rhs) {
+	long lhs_us = (*(struct ProfileEntry**)lhs)->wall_us;
+	long rhs_us = (*(struct ProfileEntry**)rhs)->wall_us;
+	return (lhs_us < rhs_us) - (lhs_us > rhs_us);
+}
 
-	// Error checking
-	if(lhs_file < 0 || rhs_file == -1) {
-		return -1;
+struct ProfileEntry** sortProfileEntries(struct ProfileEntry** entry_buckets, int* entry_count, int (*cmp_func)(const void*, const void*)) {
+	struct ProfileEntry** sorted;
+	*entry_count = 0;
+	for(int i = 0; i < PROFILE_BUCKETS; i++) {
+		for(struct ProfileEntry* my_entry = entry_buckets[i]; my_entry != NULL; my_entry = my_entry->next_entry) {
+			(*entry_count)++;
+		}
 	}
-
-	// Redirect lhs to rhs
-	original_desc = lhs_file;
-	new_desc = dup(original_desc);
-	return dup2(rhs_file, lhs_file);
+	sorted = malloc((*entry_count + 1) * sizeof(struct ProfileEntry*));
+	if(sorted == NULL) {
+		return NULL;
+	}
+	*entry_count = 0;
+	for(int i = 0; i < PROFILE_BUCKETS; i++) {
+		for(struct ProfileEntry* my_entry = entry_buckets[i]; my_entry != NULL; my_entry = my_entry->next_entry) {
+			sorted[(*entry_count)++] = my_entry;
+		}
+	}
+	qsort(sorted, *entry_count, sizeof(struct ProfileEntry*), cmp_func);
+	return sorted;
 }
 
-int outputErrRedirect(char* rhs) {
-	int ret_val;
-	int rhs_file = open(rhs, O_WRONLY| O_TRUNC | O_CREAT,
-		 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+int writeProfile() {
+	struct ProfileEntry** sorted;
+	int entry_count;
+	int ret_val = 0;
 
-	if(rhs_file == -1) {
-		return -1;
+	// exit can leave frames open
+	while(profileDepth > 0) {
+		profileLeave();
 	}
 
-	// Redirect stdout to rhs
-	original_desc = 1;
-	new_desc = dup(original_desc);
-	ret_val = dup2(rhs_file, 1);
-	if(ret_val == -1) {
-		return -1;
+	if(profile_path != NULL) {
+		const char* suffixes[] = {"", ".cpu", ".spawns"};
+		sorted = sortProfileEntries(profileStacks, &entry_count, cmpProfileKeys);
+		if(sorted == NULL) {
+			fprintf(stderr, "Error sorting profile\n");
+			return -1;
+		}
+		for(int i = 0; i < 3; i++) {
+			char file_path[strlen(profile_path) + 8];
+			FILE* profile_file;
+			sprintf(file_path, "%s%s", profile_path, suffixes[i]);
+			profile_file = fopen(file_path, "w");
+			if(profile_file == NULL) {
+				fprintf(stderr, "Error writing profile %s\n", file_path);
+				ret_val = -1;
+				continue;
+			}
+			for(int j = 0; j < entry_count; j++) {
+				long entry_val = i == 0 ? sorted[j]->wall_us : i == 1 ? sorted[j]->cpu_us : sorted[j]->spawns;
+				// Zero frames only matter for wall time
+				if(i == 0 || entry_val > 0) {
+					fprintf(profile_file, "%s %ld\n", sorted[j]->entry_key, entry_val);
+				}
+			}
+			fclose(profile_file);
+		}
+		free(sorted);
 	}
 
-	// Redirect stderr to rhs
-	second_original_desc = 2;
-	second_new_desc = dup(second_original_desc);
-	ret_val = dup2(rhs_file, 2);
-	if(ret_val == -1) {
-		return -1;
+	if(profile_top) {
+		sorted = sortProfileEntries(profileLines, &entry_count, cmpProfileWall);
+		if(sorted == NULL) {
+			fprintf(stderr, "Error sorting profile\n");
+			return -1;
+		}
+		fprintf(stderr, "%10s %10s %7s %7s  %s\n", "wall ms", "cpu ms", "spawns", "calls", "line");
+		for(int i = 0; i < entry_count && i < PROFILE_TOP; i++) {
+			fprintf(stderr, "%10.2f %10.2f %7ld %7ld  %s", sorted[i]->wall_us / 1000.0, sorted[i]->cpu_us / 1000.0,
+				sorted[i]->spawns, sorted[i]->calls, sorted[i]->entry_key);
+			if(sorted[i]->entry_text != NULL) {
+				fprintf(stderr, "  %s", sorted[i]->entry_text);
+			}
+			fprintf(stderr, "\n");
+		}
+		free(sorted);
 	}
-	return 0;	 
+	return ret_val;
 }
 
-int outputErrAppend(char* rhs) {
-	int ret_val;
-		int rhs_file = open(rhs, O_WRONLY| O_APPEND | O_CREAT,
-			 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
-	
-	if(rhs_file == -1) {
-		return -1;
-	}
+void freeProfile() {
+	struct ProfileEntry** entry_tables[] = {profileStacks, profileLines};
+	for(int i = 0; i < 2; i++) {
+		for(int j = 0; j < PROFILE_BUCKETS; j++) {
+			struct ProfileEntry* my_entry = entry_tables[i][j];
+			while(my_entry != NULL) {
+				struct ProfileEntry* next_entry = my_entry->next_entry;
+				free(my_entry->entry_key);
+				free(my_entry->entry_text);
+				free(my_entry);
+				my_entry = next_entry;
+			}
+			entry_tables[i][j] = NULL;
+		}
+	}
+	free(profileFrames);
+	profileFrames = NULL;
+	profileCap = 0;
+	profile_on = 0;
+}
 
-	// Redirect stdout to rhs
-	original_desc = 1;
-	new_desc = dup(original_desc);
-	ret_val = dup2(rhs_file, 1);
-	if(ret_val == -1) {
+int openServeSocket(char* sock_path) {
+	struct sockaddr_un sock_addr = {0};
+	int listen_fd;
+
+	if(strlen(sock_path) >= sizeof(sock_addr.sun_path)) {
+		fprintf(stderr, "Error, socket path %s is too long\n", sock_path);
+		return -1;
+	}
+	sock_addr.sun_family = AF_UNIX;
+	strcpy(sock_addr.sun_path, sock_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(listen_fd == -1) {
+		fprintf(stderr, "Error creating socket\n");
 		return -1;
 	}
 
-	// Redirect stderr to rhs
-	second_original_desc = 2;
-	second_new_desc = dup(second_original_desc);
-	ret_val = dup2(rhs_file, 2);
-	if(ret_val == -1) {
+	// A socket file nobody answers on is left over from a dead server
+	if(bind(listen_fd, (struct sockaddr*)&sock_addr, sizeof(sock_addr)) == -1) {
+		int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int in_use = errno != EADDRINUSE || probe_fd == -1 
+			|| connect(probe_fd, (struct sockaddr*)&sock_addr, sizeof(sock_addr)) == 0 || errno != ECONNREFUSED;
+		if(probe_fd != -1) {
+			close(probe_fd);
+		}
+		if(in_use || unlink(sock_path) == -1 || bind(listen_fd, (struct sockaddr*)&sock_addr, sizeof(sock_addr)) == -1) {
+			fprintf(stderr, "Error binding %s\n", sock_path);
+			close(listen_fd);
+			return -1;
+		}
+	}
+	if(listen(listen_fd, SERVE_BACKLOG) == -1) {
+		fprintf(stderr, "Error listening on %s\n", sock_path);
+		close(listen_fd);
+		unlink(sock_path);
 		return -1;
 	}
-	return 0;	  
+	return listen_fd;
 }
 
-void restoreFileDescs() {
-	if(original_desc != -1 && new_desc != -1) {
-		dup2(new_desc, original_desc);
-		original_desc = -1;
-		new_desc = -1;
+int wshServe(char* sock_path, char* init_path) {
+	struct ServeSession* session_head = NULL;
+	struct ServeSession* my_session;
+	struct ServeSession** session_ptr;
+	struct signalfd_siginfo sig_info;
+	struct pollfd poll_fds[2];
+	sigset_t serve_mask;
+	pid_t session_pid;
+	int listen_fd;
+	int serve_fd;
+	int conn_fd;
+	int status;
+
+	// Sessions are forked from this state, so the init script runs once
+	if(init_path != NULL && wshSource(init_path) != 0) {
+		fprintf(stderr, "Error running %s\n", init_path);
 	}
-	if(second_original_desc != -1 && second_new_desc != -1) {
-		dup2(second_new_desc, second_original_desc);
-		second_original_desc = -1;
-		second_new_desc = -1;
+	listen_fd = openServeSocket(sock_path);
+	if(listen_fd == -1) {
+		return -1;
 	}
-}
 
-int performRedirect(char* my_redirect, char* my_token) {
-	int ret_val = 0;
-	char* lhs;
-	char* rhs;
-	char* token_copy;
-	token_copy = strdup(my_token);
+	// Session exits and shutdown requests both arrive through the signalfd
+	sigemptyset(&serve_mask);
+	sigaddset(&serve_mask, SIGCHLD);
+	sigaddset(&serve_mask, SIGTERM);
+	sigaddset(&serve_mask, SIGINT);
+	if(sigprocmask(SIG_BLOCK, &serve_mask, &shell_orig_mask) == -1 
+		|| (serve_fd = signalfd(-1, &serve_mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "Error setting up server signals\n");
+		close(listen_fd);
+		unlink(sock_path);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN); // A client that left early must not kill the server
+	poll_fds[0].fd = listen_fd;
+	poll_fds[0].events = POLLIN;
+	poll_fds[1].fd = serve_fd;
+	poll_fds[1].events = POLLIN;
 
-	// Two token redirections
-	if(strcmp(my_redirect, "<") == 0 || strcmp(my_redirect, ">") == 0 || strcmp(my_redirect, ">>") == 0) {
-		if(token_copy[0] == '>') {
-			lhs = "1";
-			rhs = strtok(token_copy, my_redirect);
+	while(1) {
+		if(poll(poll_fds, 2, -1) == -1) {
+			continue;
 		}
-		else if(token_copy[0] == '<') {
-			lhs = "0";
-			rhs = strtok(token_copy, my_redirect);
+		if(poll_fds[0].revents & POLLIN) {
+			conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			my_session = conn_fd == -1 ? NULL : malloc(sizeof(struct ServeSession));
+			session_pid = my_session == NULL ? -1 : fork();
+			if(session_pid == 0) {
+				close(listen_fd);
+				close(serve_fd);
+				runServeSession(conn_fd);
+			}
+			if(session_pid == -1) {
+				fprintf(stderr, "Error starting session\n");
+				free(my_session);
+				if(conn_fd != -1) {
+					close(conn_fd);
+				}
+			}
+			else {
+				my_session->session_pid = session_pid;
+				my_session->session_fd = conn_fd;
+				my_session->next_session = session_head;
+				session_head = my_session;
+			}
 		}
-		else {
-			lhs = strtok(token_copy, my_redirect);
-			rhs = strtok(NULL, my_redirect);
+		if(!(poll_fds[1].revents & POLLIN)) {
+			continue;
 		}
-			
-		//printf("LHS: %s\nRHS: %s\n", lhs, rhs);
-		if(lhs == NULL || rhs == NULL) {
-			ret_val = -1;
+		while(read(serve_fd, &sig_info, sizeof(sig_info)) == sizeof(sig_info)) {
+			if(sig_info.ssi_signo != SIGCHLD) {
+				close(listen_fd);
+				unlink(sock_path);
+				wshExit();
+			}
+		}
+
+		// One SIGCHLD can stand for many exits, send each status back
+		while((session_pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for(session_ptr = &session_head; *session_ptr != NULL; session_ptr = &(*session_ptr)->next_session) {
+				if((*session_ptr)->session_pid == session_pid) {
+					int session_status = decodeStatus(status);
+					my_session = *session_ptr;
+					*session_ptr = my_session->next_session;
+					if(write(my_session->session_fd, &session_status, sizeof(session_status)) != sizeof(session_status)) {
+						fprintf(stderr, "Error sending status to client\n");
+					}
+					close(my_session->session_fd);
+					free(my_session);
+					break;
+				}
+			}
 		}
+	}
+}
+
+void runServeSession(int conn_fd) {
+	char hello;
+	struct iovec hello_iov = {&hello, 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+	} control;
+	struct msghdr hello_msg = {0};
+	struct cmsghdr* my_cmsg;
+	int client_fds[SERVE_FDS];
+	int null_fd;
+	FILE* conn_stream;
+
+	sigprocmask(SIG_SETMASK, &shell_orig_mask, NULL);
+	signal(SIGPIPE, SIG_DFL);
+
+	// The client's stdout, stderr and cwd come with the hello byte
+	hello_msg.msg_iov = &hello_iov;
+	hello_msg.msg_iovlen = 1;
+	hello_msg.msg_control = control.buf;
+	hello_msg.msg_controllen = sizeof(control.buf);
+	my_cmsg = recvmsg(conn_fd, &hello_msg, MSG_CMSG_CLOEXEC) == 1 && hello == SERVE_HELLO ? CMSG_FIRSTHDR(&hello_msg) : NULL;
+	if(my_cmsg == NULL || my_cmsg->cmsg_type != SCM_RIGHTS || my_cmsg->cmsg_len != CMSG_LEN(SERVE_FDS * sizeof(int))) {
+		_exit(126);
+	}
+	memcpy(client_fds, CMSG_DATA(my_cmsg), sizeof(client_fds));
+	null_fd = open("/dev/null", O_RDONLY);
+	if(null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1 || dup2(client_fds[0], STDOUT_FILENO) == -1 
+		|| dup2(client_fds[1], STDERR_FILENO) == -1 || fchdir(client_fds[2]) == -1) {
+		_exit(126);
+	}
+	cwd_stale = 1; // The session's cwd is the client's
+	for(int i = 0; i < SERVE_FDS; i++) {
+		close(client_fds[i]);
+	}
+	close(null_fd);
+
+	// The rest of the stream is the script
+	conn_stream = fdopen(conn_fd, "r");
+	if(conn_stream == NULL) {
+		_exit(126);
+	}
+	programLoop(conn_stream);
+	_exit(exit_global);
+}
+
+int isListOperator(char* my_token) {
+	return strcmp(my_token, "&&") == 0 || strcmp(my_token, "||") == 0 || strcmp(my_token, ";") == 0;
+}
+
+TokenArr* sliceTokenArr(TokenArr* my_tokens, int start, int end) {
+	char error_message[] = "Error slicing token arr";
+	TokenArr* my_slice;
+
+	my_slice = poolAlloc(&tokenArrPool);
+	if(my_slice == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		return NULL;
+	}
+	my_slice->token_count = end - start;
+	my_slice->tokens = malloc((my_slice->token_count + 1) * sizeof(char*));
+	if(my_slice->tokens == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		poolFree(&tokenArrPool, my_slice);
+		return NULL;
+	}
 
-		// Checking different redirs
-		else if(strcmp(my_redirect,"<") == 0) {
-			ret_val = inputRedirect(lhs,rhs);
+	// Copy values over
+	for(int i = 0; i < my_slice->token_count; i++) {
+		my_slice->tokens[i] = strdup(my_tokens->tokens[start + i]);
+		if(my_slice->tokens[i] == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			my_slice->token_count = i;
+			freeTokenArr(my_slice);
+			return NULL;
 		}
-		else if(strcmp(my_redirect, ">") == 0) {
-			ret_val = outputRedirect(lhs, rhs);
+	}
+	my_slice->tokens[my_slice->token_count] = NULL; // Terminating null when used as args
+	return my_slice;
+}
+
+int runSegment(TokenArr* my_tokens) {
+	struct TeeStage* my_tee = NULL;
+	char* redirect_val = NULL;
+	int built_in_val;
+	int ret_val;
+
+	// Arithmetic first so its $ isn't read as a var
+	if(expandArithmetic(my_tokens) == -1 || substituteShellVars(my_tokens) == -1) {
+		return -1;
+	}
+
+	// Any number of trailing |>file copy stdout to the files as well
+	while(my_tokens->token_count > 1 && isTeeRedirect(my_tokens->tokens[my_tokens->token_count - 1])) {
+		if(my_tee == NULL) {
+			my_tee = calloc(1, sizeof(struct TeeStage));
+			if(my_tee == NULL) {
+				fprintf(stderr, "Error allocating tee\n");
+				return -1;
+			}
 		}
-		else {
-			ret_val = outputAppend(lhs, rhs);
+		if(addTeeFile(my_tee, my_tokens->tokens[my_tokens->token_count - 1]) == -1) {
+			freeTee(my_tee);
+			return -1;
 		}
-	} 
+		free(my_tokens->tokens[my_tokens->token_count - 1]);
+		my_tokens->tokens[my_tokens->token_count - 1] = NULL;
+		my_tokens->token_count--;
+	}
 
-	// One token redirection
-	else if(strcmp(my_redirect, "&>") == 0 || strcmp(my_redirect, "&>>") == 0) {
+	// Check for redirect
+	redirect_val = getRedirect(my_tokens->tokens[my_tokens->token_count - 1]);
+	if(redirect_val != NULL) {
 
-		// No tokens on LHS
-		if(token_copy[0] != '&') {
-			ret_val =  -1;
+		// Last token not part of command
+		if(performRedirect(redirect_val, my_tokens->tokens[my_tokens->token_count - 1]) == -1) {
+			restoreFileDescs();
+			freeTee(my_tee);
+			return -1;
 		}
-		else {
-			
-			rhs = strtok(token_copy, my_redirect);	
-			if(rhs == NULL) { // Check for strtok error
-				ret_val = -1;		
-			}
-			else if(strcmp(my_redirect, "&>") == 0) {
-				ret_val = outputErrRedirect(rhs);
-			}
-			else {
-				ret_val =  outputErrAppend(rhs);
-			}
+		free(my_tokens->tokens[my_tokens->token_count -1]);
+		my_tokens->tokens[my_tokens->token_count -1] = NULL;
+		my_tokens->token_count--;
+
+		// Redirect with nothing to run
+		if(my_tokens->token_count == 0) {
+			restoreFileDescs();
+			freeTee(my_tee);
+			return -1;
 		}
-	} 
-	free(token_copy);
+	}
+	if(expandGlobs(my_tokens) == -1) {
+		restoreFileDescs();
+		freeTee(my_tee);
+		return -1;
+	}
+
+	// Started after the redirect so a >file becomes the first target
+	if(my_tee != NULL) {
+		my_tee->detached = background_flag; // A & job's writer outlives the line
+		if(startTee(my_tee) == -1) {
+			restoreFileDescs();
+			freeTee(my_tee);
+			return -1;
+		}
+		tail_exec = 0; // The shell has to stay to run the writer
+	}
+
+	// local and export dequote after substituting their value
+	built_in_val = checkBuiltIn(my_tokens->tokens[0]);
+	if(built_in_val != LOCAL && built_in_val != EXPORT) {
+		dequoteTokens(my_tokens);
+	}
+	ret_val = runCommand(my_tokens);
+	if(my_tee != NULL) {
+		stopTee(my_tee);
+	}
+	restoreFileDescs();
 	return ret_val;
 }
 
-int runCommand(TokenArr* my_tokens) {
-	char* my_command = my_tokens->tokens[0];
-	char* path_val;
-	int fork_val;
-	int built_in_val = checkBuiltIn(my_command);
-	
-	switch(built_in_val) {
+int hasGlobChars(char* my_str) {
+	for(size_t i = 0; my_str[i] != '\0'; i++) {
 
-		// Non built in command
-		case -1: 
-	
-			path_val = getPath(my_tokens);
-			if(path_val == NULL) {
-				fprintf(stderr, "Not a valid command\n");
-				return -1;
+		// Quoted and backslashed chars never glob
+		if(my_str[i] == CTLESC || my_str[i] == '\\') {
+			if(my_str[++i] == '\0') {
+				break;
 			}
+		}
+		else if(strchr("*?[", my_str[i]) != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-			fork_val = fork();
+void unescapeGlob(char* my_str) {
+	char* write_ptr = my_str;
+	for(char* read_ptr = my_str; *read_ptr != '\0'; read_ptr++) {
+		if(*read_ptr == '\\' && read_ptr[1] != '\0') {
+			read_ptr++;
+		}
+		*write_ptr++ = *read_ptr;
+	}
+	*write_ptr = '\0';
+}
 
-			// Parent
-			if(fork_val > 0) { 
-				addHistEntry(my_tokens);
-				wait(NULL);
-				if(path_val != NULL) {
-					free(path_val);
-				}
-				return 0;
-				
-			}
-			
-			 // Child
-			else if(fork_val == 0) {
-				return execve(path_val, my_tokens->tokens, environ);
-			}
+int cmpStrings(const void* lhs, const void* rhs) {
+	return strcmp(*(char* const*)lhs, *(char* const*)rhs);
+}
 
-			// ERROR
-			else { 
-				fprintf(stderr, "Error executing in child\n");
-				return -1;
-			}
-			break;
-			
-		case EXIT: // exit
+void freeDirCacheEntry(struct DirCache* my_cache) {
+	for(int i = 0; i < my_cache->entry_count; i++) {
+		free(my_cache->entries[i].name);
+	}
+	free(my_cache->entries);
+	free(my_cache);
+}
 
-			// Checking for zero flags or parameters
-			if(my_tokens->token_count > 1) {
-				fprintf(stderr, "Error, exit should be used with no parameters\n");
-				return -1;
-			}
-			else {
-				freeTokenArr(my_tokens);
-				wshExit();
-			}
-			break;
-			
-		case LS: // ls
-		
-			// Checking for zero flags or parameters
-			if(my_tokens->token_count > 1) {
-				fprintf(stderr, "Error, ls should be used with no parameters\n");
-				return -1;
-			}
-			else{
-				return wshLs();
-			}
-			break;
-		case CD: // cd
+void retireDirCacheEntry(struct DirCache* my_cache) {
 
-			// Checking for exactly one arg
-			if(my_tokens->token_count != 2) {
-				fprintf(stderr, "Error, cd should be used with a single argument\n");
+	// A glob may still be walking this listing
+	if(dirCachePinned) {
+		my_cache->next_cache = dirCacheRetired;
+		dirCacheRetired = my_cache;
+	}
+	else {
+		freeDirCacheEntry(my_cache);
+	}
+	dirCacheCount--;
+}
+
+void freeDirCache() {
+	struct DirCache* next_cache;
+	for(int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+		while(dirCacheBuckets[i] != NULL) {
+			next_cache = dirCacheBuckets[i]->next_cache;
+			freeDirCacheEntry(dirCacheBuckets[i]);
+			dirCacheBuckets[i] = next_cache;
+		}
+	}
+	while(dirCacheRetired != NULL) {
+		next_cache = dirCacheRetired->next_cache;
+		freeDirCacheEntry(dirCacheRetired);
+		dirCacheRetired = next_cache;
+	}
+	dirCacheCount = 0;
+}
+
+int cmpDirEntries(const void* lhs, const void* rhs) {
+	return strcmp(((const struct DirEntry*)lhs)->name, ((const struct DirEntry*)rhs)->name);
+}
+
+int scanDir(char* dir_path, struct DirCache* my_cache) {
+	DIR* my_dir;
+	struct dirent* my_dirent;
+	struct stat entry_stat;
+	struct DirEntry* my_entry;
+	int cap = 16;
+	int fd;
+
+	my_dir = opendir(dir_path);
+	if(my_dir == NULL) {
+		return -1;
+	}
+	fd = dirfd(my_dir);
+	my_cache->entry_count = 0;
+	my_cache->entries = malloc(cap * sizeof(struct DirEntry));
+	if(my_cache->entries == NULL) {
+		closedir(my_dir);
+		return -1;
+	}
+
+	while((my_dirent = readdir(my_dir)) != NULL) {
+		if(strcmp(my_dirent->d_name, ".") == 0 || strcmp(my_dirent->d_name, "..") == 0) {
+			continue;
+		}
+		if(my_cache->entry_count == cap) {
+			struct DirEntry* alloc_ret = realloc(my_cache->entries, cap * 2 * sizeof(struct DirEntry));
+			if(alloc_ret == NULL) {
+				closedir(my_dir);
 				return -1;
 			}
-			else {
-				return wshCd(my_tokens->tokens[1]);
-			}
-			break;
-			
-		case EXPORT:
-		case LOCAL: 
-			// Always uses form export/local x=(y)
-			if(my_tokens->token_count != 2) {
-				fprintf(stderr, "Error, command should be of form export/local VAR=value\n");
-				return -1;
+			my_cache->entries = alloc_ret;
+			cap *= 2;
+		}
+		my_entry = &my_cache->entries[my_cache->entry_count];
+
+		// Links count as dirs for matching but are never walked by **
+		my_entry->type = 0;
+		if(my_dirent->d_type == DT_DIR) {
+			my_entry->type = GLOB_DIR;
+		}
+		else if(my_dirent->d_type == DT_LNK || my_dirent->d_type == DT_UNKNOWN) {
+			if(fstatat(fd, my_dirent->d_name, &entry_stat, 0) == 0 && S_ISDIR(entry_stat.st_mode)) {
+				my_entry->type = GLOB_DIR;
 			}
-			if(my_tokens->tokens[1][0] == '=') {
-				fprintf(stderr, "Error, can't have empty lhs in var assignment\n");
-				return -1;
+			if(my_dirent->d_type == DT_LNK) {
+				my_entry->type |= GLOB_LINK;
 			}
-		
-			char* var_name;
-			char* var_val;
-			var_name = strtok(my_tokens->tokens[1], "="); 
-			var_val = strtok(NULL, "=");
-			
-			
-			// Check for strtok error
-			if(var_name == NULL) {
-				fprintf(stderr, "Error, Failed to assign var\n");
-				return -1;
+			else if(fstatat(fd, my_dirent->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) == 0 
+				&& S_ISLNK(entry_stat.st_mode)) {
+				my_entry->type |= GLOB_LINK;
 			}
+		}
+		my_entry->name = strdup(my_dirent->d_name);
+		if(my_entry->name == NULL) {
+			closedir(my_dir);
+			return -1;
+		}
+		my_cache->entry_count++;
+	}
+	closedir(my_dir);
+	qsort(my_cache->entries, my_cache->entry_count, sizeof(struct DirEntry), cmpDirEntries);
+	return 0;
+}
 
-			// Replace empty rhs with empty str
-			if(var_val == NULL) {
-				var_val = "";
-			}
+struct DirCache* getDirCache(char* dir_path) {
+	struct stat dir_stat;
+	struct DirCache** cache_ptr;
+	struct DirCache* my_cache;
+	struct timespec now;
+	int bucket;
 
-			// Putting these values into a token arr
-			TokenArr* var_toks = malloc(sizeof(TokenArr));
-			if(var_toks == NULL) {
-				fprintf(stderr, "Error, Failed to assign var\n");
-				return -1;
-			}
-			var_toks->token_count = 2;
-			var_toks->tokens = malloc(2 * sizeof(char*));
-			if(var_toks->tokens == NULL) {
-				fprintf(stderr, "Error, Failed to assign var\n");
+	if(stat(dir_path, &dir_stat) == -1 || !S_ISDIR(dir_stat.st_mode)) {
+		return NULL;
+	}
+
+	// Keyed by inode so cd doesn't change what a relative path finds
+	bucket = (dir_stat.st_ino ^ dir_stat.st_dev) % DIR_CACHE_BUCKETS;
+	for(cache_ptr = &dirCacheBuckets[bucket]; *cache_ptr != NULL; cache_ptr = &(*cache_ptr)->next_cache) {
+		my_cache = *cache_ptr;
+		if(my_cache->dir_ino != dir_stat.st_ino || my_cache->dir_dev != dir_stat.st_dev) {
+			continue;
+		}
+		if(my_cache->dir_mtime.tv_sec == dir_stat.st_mtim.tv_sec 
+			&& my_cache->dir_mtime.tv_nsec == dir_stat.st_mtim.tv_nsec 
+			&& my_cache->dir_mtime.tv_sec < my_cache->scan_time) {
+			return my_cache;
+		}
+
+		// Stale, drop it and rescan below
+		*cache_ptr = my_cache->next_cache;
+		retireDirCacheEntry(my_cache);
+		break;
+	}
+
+	// Bound the cache by starting over once it gets big
+	if(dirCacheCount >= DIR_CACHE_LIMIT && !dirCachePinned) {
+		freeDirCache();
+	}
+
+	my_cache = calloc(1, sizeof(struct DirCache));
+	if(my_cache == NULL) {
+		return NULL;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	if(scanDir(dir_path, my_cache) == -1) {
+		freeDirCacheEntry(my_cache);
+		return NULL;
+	}
+	my_cache->dir_dev = dir_stat.st_dev;
+	my_cache->dir_ino = dir_stat.st_ino;
+	my_cache->dir_mtime = dir_stat.st_mtim;
+
+	// A dir changed in the same second as the scan could change again unseen
+	my_cache->scan_time = now.tv_sec;
+	my_cache->next_cache = dirCacheBuckets[bucket];
+	dirCacheBuckets[bucket] = my_cache;
+	dirCacheCount++;
+	return my_cache;
+}
+
+int addGlobMatch(TokenArr* my_matches, char* my_path) {
+	if(my_matches->token_count % 16 == 0) {
+		char** alloc_ret = realloc(my_matches->tokens, (my_matches->token_count + 16) * sizeof(char*));
+		if(alloc_ret == NULL) {
+			return -1;
+		}
+		my_matches->tokens = alloc_ret;
+	}
+	my_matches->tokens[my_matches->token_count] = strdup(my_path);
+	if(my_matches->tokens[my_matches->token_count] == NULL) {
+		return -1;
+	}
+	my_matches->token_count++;
+	return 0;
+}
+
+char* joinPath(char* base_path, char* my_name) {
+	char* full_path = malloc(strlen(base_path) + strlen(my_name) + 2);
+	if(full_path == NULL) {
+		return NULL;
+	}
+	if(base_path[0] == '\0') {
+		strcpy(full_path, my_name);
+	}
+	else if(base_path[strlen(base_path) - 1] == '/') {
+		sprintf(full_path, "%s%s", base_path, my_name);
+	}
+	else {
+		sprintf(full_path, "%s/%s", base_path, my_name);
+	}
+	return full_path;
+}
+
+int globWalk(char* base_path, char** segments, int seg_count, int seg_index, TokenArr* my_matches) {
+	struct DirCache* my_cache;
+	struct stat path_stat;
+	char* segment;
+	char* next_path;
+	int last_seg = seg_index == seg_count - 1;
+	int ret_val = 0;
+
+	// Every segment matched
+	if(seg_index == seg_count) {
+		if(base_path[0] != '\0') {
+			return addGlobMatch(my_matches, base_path);
+		}
+		return 0;
+	}
+	segment = segments[seg_index];
+
+	// A trailing / only matches dirs
+	if(segment[0] == '\0') {
+		if(stat(base_path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+			next_path = joinPath(base_path, "");
+			ret_val = next_path == NULL ? -1 : addGlobMatch(my_matches, next_path);
+			free(next_path);
+		}
+		return ret_val;
+	}
+
+	// Literal segments don't need a listing
+	if(!hasGlobChars(segment)) {
+		next_path = joinPath(base_path, segment);
+		if(next_path == NULL) {
+			return -1;
+		}
+		unescapeGlob(next_path + strlen(next_path) - strlen(segment));
+		if(!last_seg || lstat(next_path, &path_stat) == 0) {
+			ret_val = globWalk(next_path, segments, seg_count, seg_index + 1, my_matches);
+		}
+		free(next_path);
+		return ret_val;
+	}
+
+	my_cache = getDirCache(base_path[0] == '\0' ? "." : base_path);
+	if(my_cache == NULL) {
+		return 0;
+	}
+
+	// ** first matches no dirs at all
+	if(strcmp(segment, "**") == 0 && !last_seg) {
+		ret_val = globWalk(base_path, segments, seg_count, seg_index + 1, my_matches);
+	}
+
+	for(int i = 0; i < my_cache->entry_count && ret_val == 0; i++) {
+		char* entry = my_cache->entries[i].name;
+		unsigned char entry_type = my_cache->entries[i].type;
+
+		if(strcmp(segment, "**") == 0) {
+			if(entry[0] == '.') {
+				continue;
+			}
+			next_path = joinPath(base_path, entry);
+			if(next_path == NULL) {
 				return -1;
 			}
 
-			// Copy into tokenArr
-			var_toks->tokens[0] = strdup(var_name);
-			var_toks->tokens[1] = strdup(var_val);
-			if(var_toks->tokens[0] == NULL || var_toks->tokens[1] == NULL) {
-				fprintf(stderr, "Error, Failed to assign var\n");
-				free(var_toks->tokens);
-				free(var_toks);
-				return -1;
+			// A final ** matches everything below, otherwise only dirs are walked
+			if(last_seg) {
+				ret_val = addGlobMatch(my_matches, next_path);
+			}
+			if(ret_val == 0 && entry_type == GLOB_DIR) {
+				ret_val = globWalk(next_path, segments, seg_count, seg_index, my_matches);
 			}
+			free(next_path);
+			continue;
+		}
 
-			// Substituting any vars
-			if(substituteShellVars(var_toks) == -1) {
-				fprintf(stderr, "Error, Failed to assign var\n");
+		if(fnmatch(segment, entry, FNM_PERIOD) != 0 || (!last_seg && !(entry_type & GLOB_DIR))) {
+			continue;
+		}
+		next_path = joinPath(base_path, entry);
+		if(next_path == NULL) {
+			return -1;
+		}
+		ret_val = globWalk(next_path, segments, seg_count, seg_index + 1, my_matches);
+		free(next_path);
+	}
+	return ret_val;
+}
+
+int globToken(char* my_pattern, TokenArr* my_matches) {
+	char* pattern_copy = malloc(strlen(my_pattern) + 1);
+	char** segments;
+	char* segment;
+	char* save_ptr;
+	int seg_count = 0;
+	int ret_val;
+	size_t pattern_len = 0;
+	int is_absolute = my_pattern[0] == '/';
+	int wants_dir;
+
+	if(pattern_copy == NULL) {
+		return -1;
+	}
+
+	// fnmatch takes quoted chars as backslash escapes
+	for(size_t i = 0; my_pattern[i] != '\0'; i++) {
+		pattern_copy[pattern_len++] = my_pattern[i] == CTLESC ? '\\' : my_pattern[i];
+	}
+	pattern_copy[pattern_len] = '\0';
+	wants_dir = pattern_len > 1 && pattern_copy[pattern_len - 1] == '/';
+
+	segments = malloc((pattern_len / 2 + 2) * sizeof(char*));
+	if(segments == NULL) {
+		free(pattern_copy);
+		return -1;
+	}
+
+	// Empty segments from repeated slashes are dropped, a trailing one is kept
+	segment = strtok_r(pattern_copy, "/", &save_ptr);
+	while(segment != NULL) {
+		segments[seg_count++] = segment;
+		segment = strtok_r(NULL, "/", &save_ptr);
+	}
+	if(wants_dir) {
+		segments[seg_count++] = "";
+	}
+
+	ret_val = globWalk(is_absolute ? "/" : "", segments, seg_count, 0, my_matches);
+	if(ret_val == 0 && my_matches->token_count > 1) {
+		qsort(my_matches->tokens, my_matches->token_count, sizeof(char*), cmpStrings);
+	}
+	free(segments);
+	free(pattern_copy);
+	return ret_val;
+}
+
+int expandGlobs(TokenArr* my_tokens) {
+	int ret_val = 0;
+
+	// Listings replaced mid walk are freed once the walk is over
+	dirCachePinned = 1;
+	for(int i = 0; i < my_tokens->token_count && ret_val == 0; i++) {
+		if(hasGlobChars(my_tokens->tokens[i])) {
+			ret_val = expandGlobToken(my_tokens, &i);
+		}
+	}
+	dirCachePinned = 0;
+	while(dirCacheRetired != NULL) {
+		struct DirCache* next_cache = dirCacheRetired->next_cache;
+		freeDirCacheEntry(dirCacheRetired);
+		dirCacheRetired = next_cache;
+	}
+	return ret_val;
+}
+
+int expandGlobToken(TokenArr* my_tokens, int* index) {
+	TokenArr my_matches;
+	char** new_tokens;
+	int new_count;
+	int i = *index;
+
+	my_matches.token_count = 0;
+	my_matches.tokens = NULL;
+	if(globToken(my_tokens->tokens[i], &my_matches) == -1) {
+		fprintf(stderr, "Error expanding %s\n", my_tokens->tokens[i]);
+		freeMatches(&my_matches);
+		return -1;
+	}
+
+	// Patterns with no matches are passed on as typed
+	if(my_matches.token_count == 0) {
+		return 0;
+	}
+
+	// Splice the matches in where the pattern was
+	new_count = my_tokens->token_count - 1 + my_matches.token_count;
+	new_tokens = malloc((new_count + 1) * sizeof(char*));
+	if(new_tokens == NULL) {
+		freeMatches(&my_matches);
+		return -1;
+	}
+	memcpy(new_tokens, my_tokens->tokens, i * sizeof(char*));
+	memcpy(new_tokens + i, my_matches.tokens, my_matches.token_count * sizeof(char*));
+	memcpy(new_tokens + i + my_matches.token_count, my_tokens->tokens + i + 1, 
+		(my_tokens->token_count - i - 1) * sizeof(char*));
+	new_tokens[new_count] = NULL;
+	free(my_tokens->tokens[i]);
+	free(my_tokens->tokens);
+	free(my_matches.tokens);
+	my_tokens->tokens = new_tokens;
+	my_tokens->token_count = new_count;
+	*index = i + my_matches.token_count - 1; // Matches aren't globbed again
+	return 0;
+}
+
+void freeMatches(TokenArr* my_matches) {
+	for(int j = 0; j < my_matches->token_count; j++) {
+		free(my_matches->tokens[j]);
+	}
+	free(my_matches->tokens);
+}
+
+int runCommandList(TokenArr* my_tokens) {
+	TokenArr* segment;
+	int seg_start = 0;
+	int run_next = 1;
+	int ret_val = exit_global;
+
+	// Aliases are spliced in before the line is split
+	if(expandAliases(my_tokens) == -1) {
+		return -1;
+	}
+	if(my_tokens->token_count == 0) {
+		return ret_val; // An alias to nothing
+	}
+
+	// A trailing ; ends the last command like a newline
+	if(my_tokens->token_count > 1 && strcmp(my_tokens->tokens[my_tokens->token_count - 1], ";") == 0) {
+		free(my_tokens->tokens[my_tokens->token_count - 1]);
+		my_tokens->tokens[my_tokens->token_count - 1] = NULL;
+		my_tokens->token_count--;
+	}
+
+	// Trailing & runs the command in the background
+	background_flag = 0;
+	if(my_tokens->token_count > 0 && strcmp(my_tokens->tokens[my_tokens->token_count - 1], "&") == 0) {
+		free(my_tokens->tokens[my_tokens->token_count - 1]);
+		my_tokens->tokens[my_tokens->token_count - 1] = NULL;
+		my_tokens->token_count--;
+		for(int i = 0; i < my_tokens->token_count; i++) {
+			if(isListOperator(my_tokens->tokens[i])) {
+				fprintf(stderr, "Error, & can't be used with &&, || or ;\n");
 				return -1;
 			}
+		}
+		if(my_tokens->token_count == 0) {
+			fprintf(stderr, "Error, & must follow a command\n");
+			return -1;
+		}
+		background_flag = 1;
+	}
 
-			// Reassign the tokens
-			var_name = var_toks->tokens[0];
-			var_val = var_toks->tokens[1];
+	// Operators need a command on both sides
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		if(isListOperator(my_tokens->tokens[i]) && (i == 0 || i == my_tokens->token_count - 1 
+			|| isListOperator(my_tokens->tokens[i + 1]))) {
+			fprintf(stderr, "Error, %s must be between two commands\n", my_tokens->tokens[i]);
+			return -1;
+		}
+	}
 
-			// Free the data struct holding the toks but not the tokens themselves
-			free(var_toks->tokens);
-			free(var_toks);
-						
-			int ret_val;
-			if(built_in_val == LOCAL) {
-				ret_val = wshLocal(var_name, var_val);
-			}	
-			else {
-				ret_val = wshExport(var_name, var_val);
-			}
-			free(var_name);
-			free(var_val);
-			return ret_val;
-			break;	
-				
-		case VARS: // vars
+	for(int i = 0; i <= my_tokens->token_count; i++) {
 
-			// Checking vars is run on its own
-			if(my_tokens->token_count != 1) {
-				fprintf(stderr, "Invalid user of vars\n");
+		// Segments end at an operator or the end of the line
+		if(i < my_tokens->token_count && !isListOperator(my_tokens->tokens[i])) {
+			continue;
+		}
+
+		if(run_next) {
+			segment = sliceTokenArr(my_tokens, seg_start, i);
+			if(segment == NULL) {
 				return -1;
 			}
+			tail_exec = tail_exec_line && i == my_tokens->token_count && !background_flag;
+			ret_val = runSegment(segment);
+			tail_exec = 0;
+			freeTokenArr(segment);
+			exit_global = ret_val; // Visible as $? to the next segment
+
+			// set -e only applies to the last command of an && or || chain
+			if(errexit_flag && ret_val != 0 && (i == my_tokens->token_count || strcmp(my_tokens->tokens[i], ";") == 0)) {
+				exit_requested = 1;
+			}
+			if(exit_requested) {
+				break;
+			}
+		}
+
+		// Skipped segments leave the status of the last one that ran
+		if(i < my_tokens->token_count) {
+			if(strcmp(my_tokens->tokens[i], "&&") == 0) {
+				run_next = (ret_val == 0);
+			}
+			else if(strcmp(my_tokens->tokens[i], "||") == 0) {
+				run_next = (ret_val != 0);
+			}
 			else {
-				return wshVars();
+				run_next = 1;
 			}
-			break;	
+		}
+		seg_start = i + 1;
+	}
+	background_flag = 0;
+	return ret_val;
+}
 
-		case HISTORY: // history
+int decodeStatus(int status) {
+	if(WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	if(WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return -1;
+}
 
-			// Prints list of previous commands
-			if(my_tokens->token_count == 1) {
-				return wshGetHist();
+int waitChild(pid_t child_pid, int* stopped) {
+	int status;
+	*stopped = 0;
+	if(child_timeout_ms >= 0) {
+		return waitChildTimeout(child_pid, child_timeout_ms, stopped);
+	}
+
+	// A child stopped by Ctrl-Z hands control back like one that exited
+	while(waitpid(child_pid, &status, job_control ? WUNTRACED : 0) == -1) {
+		if(errno != EINTR) {
+			fprintf(stderr, "Error waiting on child\n");
+			return -1;
+		}
+	}
+	if(WIFSTOPPED(status)) {
+		*stopped = 1;
+		return 128 + WSTOPSIG(status);
+	}
+	return decodeStatus(status);
+}
+
+long elapsedMs(struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+long elapsedUs(struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int waitChildTimeout(pid_t child_pid, long timeout_ms, int* stopped) {
+	struct pollfd child_poll;
+	struct timespec start;
+	int poll_ret;
+	int status;
+	long remaining;
+
+	// Without pidfds just wait with no deadline
+	child_poll.fd = syscall(SYS_pidfd_open, child_pid, 0);
+	if(child_poll.fd == -1) {
+		child_timeout_ms = -1;
+		return waitChild(child_pid, stopped);
+	}
+	child_poll.events = POLLIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		remaining = timeout_ms - elapsedMs(&start);
+		poll_ret = poll(&child_poll, 1, remaining > 0 ? remaining : 0);
+	} while(poll_ret == -1 && errno == EINTR);
+
+	// Deadline passed, the child is still unreaped so its pid is safe to kill
+	if(poll_ret == 0) {
+		syscall(SYS_pidfd_send_signal, child_poll.fd, SIGKILL, NULL, 0);
+	}
+	close(child_poll.fd);
+
+	while(waitpid(child_pid, &status, 0) == -1) {
+		if(errno != EINTR) {
+			fprintf(stderr, "Error waiting on child\n");
+			return -1;
+		}
+	}
+	if(poll_ret == 0) {
+		fprintf(stderr, "Command timed out after %ld ms\n", timeout_ms);
+		return 124;
+	}
+	return decodeStatus(status);
+}
+
+int applyChildLimits() {
+	struct rlimit my_limit;
+	int limit_count = sizeof(shellLimits) / sizeof(struct ShellLimit);
+	for(int i = 0; i < limit_count; i++) {
+		if(!shellLimits[i].is_set) {
+			continue;
+		}
+		if(getrlimit(shellLimits[i].resource, &my_limit) == -1) {
+			return -1;
+		}
+		my_limit.rlim_cur = shellLimits[i].value;
+		if(setrlimit(shellLimits[i].resource, &my_limit) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int applyChildSched() {
+	if(childSched.cpus_set && sched_setaffinity(0, sizeof(cpu_set_t), &childSched.cpus) == -1) {
+		return -1;
+	}
+
+	// nice returns -1 as a valid value so errno has to be checked
+	if(childSched.nice_set) {
+		errno = 0;
+		if(nice(childSched.nice_val) == -1 && errno != 0) {
+			return -1;
+		}
+	}
+	if(childSched.ioprio_set && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, childSched.ioprio) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int parseCpuList(char* cpu_list, cpu_set_t* my_cpus) {
+	char* list_copy;
+	char* range;
+	char* save_ptr;
+	char* end_ptr;
+	long first;
+	long last;
+
+	list_copy = strdup(cpu_list);
+	if(list_copy == NULL) {
+		return -1;
+	}
+	CPU_ZERO(my_cpus);
+
+	// Comma separated cpus or first-last ranges
+	range = strtok_r(list_copy, ",", &save_ptr);
+	while(range != NULL) {
+		first = strtol(range, &end_ptr, 10);
+		last = first;
+		if(*end_ptr == '-') {
+			last = strtol(end_ptr + 1, &end_ptr, 10);
+		}
+		if(*end_ptr != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+			free(list_copy);
+			return -1;
+		}
+		for(long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, my_cpus);
+		}
+		range = strtok_r(NULL, ",", &save_ptr);
+	}
+	free(list_copy);
+	return CPU_COUNT(my_cpus) > 0 ? 0 : -1;
+}
+
+int runShifted(TokenArr* my_tokens, int shift) {
+	int ret_val;
+	TokenArr* my_command = sliceTokenArr(my_tokens, shift, my_tokens->token_count);
+	if(my_command == NULL) {
+		return -1;
+	}
+	ret_val = runCommand(my_command);
+	freeTokenArr(my_command);
+	return ret_val;
+}
+
+int addBgJob(pid_t job_pid, TokenArr* my_tokens, int job_state) {
+	struct BgJob* my_job = malloc(sizeof(struct BgJob));
+	if(my_job == NULL) {
+		fprintf(stderr, "Error adding background job\n");
+		return -1;
+	}
+	my_job->job_id = nextJobId++;
+	my_job->job_pid = job_pid;
+	my_job->job_pgid = job_control ? job_pid : 0;
+	my_job->job_state = job_state;
+	my_job->job_tokens = copyTokenArr(my_tokens);
+	my_job->next_job = bgJobHead;
+	bgJobHead = my_job;
+	if(job_state == JOB_STOPPED) {
+		printf("\n");
+		printJob(my_job, "Stopped");
+	}
+	else if(epoll_fd != -1) {
+		printf("[%d] %d\n", my_job->job_id, job_pid);
+	}
+	return 0;
+}
+
+void printJob(struct BgJob* my_job, const char* state_str) {
+	printf("[%d] %s", my_job->job_id, state_str);
+	for(int i = 0; i < my_job->job_tokens->token_count; i++) {
+		printf(" %s", my_job->job_tokens->tokens[i]);
+	}
+	printf("\n");
+}
+
+int reapJobs(int notify) {
+	struct BgJob** job_ptr = &bgJobHead;
+	struct BgJob* my_job;
+	char done_str[32];
+	int status;
+	int reaped = 0;
+
+	// Only wait on our own jobs so foreground children are never stolen
+	while(*job_ptr != NULL) {
+		my_job = *job_ptr;
+		if(waitpid(my_job->job_pid, &status, WNOHANG | WUNTRACED | WCONTINUED) != my_job->job_pid) {
+			job_ptr = &my_job->next_job;
+			continue;
+		}
+
+		// Stopped and continued jobs stay in the list, only a stop is worth a notice
+		if(WIFSTOPPED(status) || WIFCONTINUED(status)) {
+			my_job->job_state = WIFSTOPPED(status) ? JOB_STOPPED : JOB_RUNNING;
+			if(notify && WIFSTOPPED(status)) {
+				printJob(my_job, "Stopped");
+				reaped++;
 			}
+			job_ptr = &my_job->next_job;
+			continue;
+		}
+		if(notify) {
+			snprintf(done_str, sizeof(done_str), "Done (%d)", decodeStatus(status));
+			printJob(my_job, done_str);
+		}
+		*job_ptr = my_job->next_job;
+		freeTokenArr(my_job->job_tokens);
+		free(my_job);
+		reaped++;
+	}
 
-			// Case where size is set
-			else if(my_tokens->token_count == 3) {
+	// Job ids start over once nothing is running
+	if(bgJobHead == NULL) {
+		nextJobId = 1;
+	}
+	return reaped;
+}
 
-				// Fail is second token isnt 'set'
-				if(strcmp(my_tokens->tokens[1],"set") !=0) {
-					fprintf(stderr, "Invalid input for history\n");
-					return -1;
+struct BgJob* findJob(char* job_arg) {
+	struct BgJob* my_job;
+	char* end_ptr;
+	long job_id;
+
+	// Newest job is at the head
+	if(job_arg == NULL) {
+		return bgJobHead;
+	}
+	if(job_arg[0] == '%') {
+		job_arg++;
+	}
+	job_id = strtol(job_arg, &end_ptr, 10);
+	if(*end_ptr != '\0' || end_ptr == job_arg) {
+		return NULL;
+	}
+	for(my_job = bgJobHead; my_job != NULL; my_job = my_job->next_job) {
+		if(my_job->job_id == job_id) {
+			return my_job;
+		}
+	}
+	return NULL;
+}
+
+void removeJob(struct BgJob* my_job) {
+	struct BgJob** job_ptr = &bgJobHead;
+	while(*job_ptr != my_job) {
+		job_ptr = &(*job_ptr)->next_job;
+	}
+	*job_ptr = my_job->next_job;
+	freeTokenArr(my_job->job_tokens);
+	free(my_job);
+	if(bgJobHead == NULL) {
+		nextJobId = 1;
+	}
+}
+
+int signalJob(struct BgJob* my_job, int sig) {
+	// Jobs with their own group get the signal in every process
+	if(my_job->job_pgid != 0) {
+		return kill(-my_job->job_pgid, sig);
+	}
+	return kill(my_job->job_pid, sig);
+}
+
+void freeJobs(int hang_up) {
+	struct BgJob* next_job;
+
+	// Stopped jobs would never run again, so hang them up like bash
+	while(bgJobHead != NULL) {
+		next_job = bgJobHead->next_job;
+		if(hang_up && bgJobHead->job_state == JOB_STOPPED) {
+			signalJob(bgJobHead, SIGHUP);
+			signalJob(bgJobHead, SIGCONT);
+		}
+		freeTokenArr(bgJobHead->job_tokens);
+		free(bgJobHead);
+		bgJobHead = next_job;
+	}
+}
+
+int initJobControl() {
+	int signal_count = sizeof(JOB_SIGNALS) / sizeof(int);
+	if(!isatty(STDIN_FILENO)) {
+		return 0;
+	}
+
+	// Started in the background, so wait until we're put in the foreground
+	while(tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+		kill(-getpgrp(), SIGTTIN);
+	}
+
+	// Ctrl-C and Ctrl-Z are only for the foreground job
+	for(int i = 0; i < signal_count; i++) {
+		signal(JOB_SIGNALS[i], SIG_IGN);
+	}
+	shell_pgid = getpid();
+	if(getpgrp() != shell_pgid && setpgid(0, 0) == -1) {
+		fprintf(stderr, "Error, couldn't start job control\n");
+		return -1;
+	}
+	tcsetpgrp(STDIN_FILENO, shell_pgid);
+	job_control = 1;
+	return 0;
+}
+
+void giveTerminal(pid_t my_pgid) {
+	if(job_control) {
+		tcsetpgrp(STDIN_FILENO, my_pgid);
+	}
+}
+
+void setupChildJob() {
+	int signal_count = sizeof(JOB_SIGNALS) / sizeof(int);
+	if(!job_control) {
+		return;
+	}
+	setpgid(0, 0);
+	if(!background_flag) {
+		tcsetpgrp(STDIN_FILENO, getpid());
+	}
+	for(int i = 0; i < signal_count; i++) {
+		signal(JOB_SIGNALS[i], SIG_DFL);
+	}
+}
+
+int initEventLoop() {
+	sigset_t chld_mask;
+	struct epoll_event my_event;
+
+	// SIGCHLD is only delivered through the signalfd
+	sigemptyset(&chld_mask);
+	sigaddset(&chld_mask, SIGCHLD);
+	if(sigprocmask(SIG_BLOCK, &chld_mask, &shell_orig_mask) == -1) {
+		return -1;
+	}
+	signal_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(signal_fd == -1 || epoll_fd == -1) {
+		freeEventLoop();
+		return -1;
+	}
+
+	my_event.events = EPOLLIN;
+	my_event.data.fd = signal_fd;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &my_event) == -1) {
+		freeEventLoop();
+		return -1;
+	}
+
+	// Regular files can't be polled but are always readable
+	my_event.data.fd = STDIN_FILENO;
+	stdin_pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &my_event) == 0;
+	return 0;
+}
+
+void freeEventLoop() {
+	struct EditLine* edit_lines[] = {&edit_line, &edit_saved, &edit_shown, &edit_out, &search_query, &search_view};
+	int edit_line_count = sizeof(edit_lines) / sizeof(struct EditLine*);
+	if(epoll_fd != -1) {
+		close(epoll_fd);
+	}
+	if(signal_fd != -1) {
+		close(signal_fd);
+		sigprocmask(SIG_SETMASK, &shell_orig_mask, NULL);
+	}
+	epoll_fd = -1;
+	signal_fd = -1;
+	free(reader_buf);
+	reader_buf = NULL;
+	reader_start = 0;
+	reader_scan = 0;
+	reader_len = 0;
+	reader_cap = 0;
+
+	// The terminal goes back to how it was found
+	endEditLine();
+	editor_on = 0;
+	for(int i = 0; i < edit_line_count; i++) {
+		free(edit_lines[i]->text);
+		memset(edit_lines[i], 0, sizeof(struct EditLine));
+	}
+}
+
+int fillReader() {
+	ssize_t read_ret;
+
+	// Lines already handed back are dropped once more input is needed
+	if(reader_start > 0) {
+		memmove(reader_buf, reader_buf + reader_start, reader_len - reader_start);
+		reader_len -= reader_start;
+		reader_scan -= reader_start;
+		reader_start = 0;
+	}
+
+	// Grow the buffer before it fills, keeping a byte for the terminator
+	if(reader_cap - reader_len < 1024) {
+		char* alloc_ret = realloc(reader_buf, reader_cap * 2 + 4096);
+		if(alloc_ret == NULL) {
+			return -1;
+		}
+		reader_buf = alloc_ret;
+		reader_cap = reader_cap * 2 + 4096;
+	}
+
+	read_ret = read(STDIN_FILENO, reader_buf + reader_len, reader_cap - reader_len - 1);
+	if(read_ret == -1) {
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	if(read_ret == 0) {
+		reader_eof = 1;
+	}
+	reader_len += read_ret;
+	return 0;
+}
+
+int readEventLoop(char** input_line, ssize_t* input_size) {
+	struct epoll_event my_events[2];
+	struct signalfd_siginfo sig_info;
+	char* newline;
+	size_t line_len;
+	int event_count;
+	int redraw;
+
+	while(1) {
+
+		// A terminal is read a key at a time through the line editor
+		if(editor_on) {
+			if(!editor_active) {
+				beginEditLine();
+			}
+			if(editReader(input_line, input_size) == 1) {
+				return 0;
+			}
+		}
+
+		// Hand back a line in place once a full one is buffered, only new input is scanned
+		else {
+			newline = reader_len > reader_scan ? memchr(reader_buf + reader_scan, '\n', reader_len - reader_scan) : NULL;
+			reader_scan = reader_len;
+			if(newline != NULL || (reader_eof && reader_len > reader_start)) {
+				line_len = newline != NULL ? (size_t)(newline - reader_buf) - reader_start : reader_len - reader_start;
+				*input_line = reader_buf + reader_start;
+				(*input_line)[line_len] = '\0';
+				*input_size = line_len;
+
+				// The line stays valid until the next read moves the buffer
+				reader_start += line_len + (newline != NULL);
+				reader_scan = reader_start;
+				return 0;
+			}
+		}
+		if(reader_eof) {
+			endEditLine();
+			*input_size = -1;
+			return 0;
+		}
+
+		if(!stdin_pollable) {
+			if(fillReader() == -1) {
+				fprintf(stderr, "Error reading new line\nExiting\n");
+				return -1;
+			}
+			continue;
+		}
+
+		event_count = epoll_wait(epoll_fd, my_events, 2, -1);
+		if(event_count == -1 && errno != EINTR) {
+			fprintf(stderr, "Error waiting for input\n");
+			return -1;
+		}
+		for(int i = 0; i < event_count; i++) {
+			if(my_events[i].data.fd == STDIN_FILENO) {
+				if(fillReader() == -1) {
+					fprintf(stderr, "Error reading new line\nExiting\n");
+					return -1;
+				}
+			}
+			else if(my_events[i].data.fd == signal_fd) {
+				while(read(signal_fd, &sig_info, sizeof(sig_info)) == sizeof(sig_info));
+
+				// Notices interrupt the prompt so print a fresh one, the line being edited is drawn again after
+				redraw = editor_active && bgJobHead != NULL;
+				if(redraw) {
+					printf("\r\033[K");
+				}
+				if(reapJobs(1) > 0 || redraw) {
+					printf("wsh> ");
+					fflush(stdout);
+				}
+				if(redraw) {
+					resetEditShown();
+					refreshEditLine();
+				}
+			}
+		}
+	}
+}
+
+int inputAtEOF(FILE* input_stream) {
+	if(input_stream == stdin && epoll_fd != -1) {
+		return reader_eof && reader_len == reader_start;
+	}
+	return feof(input_stream);
+}
+
+int initLineEditor() {
+	if(epoll_fd == -1 || !isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &editor_orig_termios) == -1) {
+		return 0;
+	}
+	editor_on = 1;
+	return 0;
+}
+
+void beginEditLine() {
+	struct termios raw_termios = editor_orig_termios;
+
+	// Keys come in one at a time without echo, and Ctrl-C is read as a key
+	raw_termios.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw_termios.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw_termios.c_cc[VMIN] = 1;
+	raw_termios.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios);
+
+	edit_line.len = 0;
+	edit_line.pos = 0;
+	if(growEditLine(&edit_line, 0) == 0) {
+		edit_line.text[0] = '\0';
+	}
+	edit_hist = NULL;
+	searching = 0;
+	resetEditShown();
+	editor_active = 1;
+}
+
+void endEditLine() {
+	if(editor_active) {
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_orig_termios);
+		editor_active = 0;
+	}
+}
+
+int editReader(char** input_line, ssize_t* input_size) {
+	size_t key_len;
+	int my_key;
+
+	while(reader_start < reader_len) {
+		my_key = decodeKey(&key_len);
+		if(my_key == -1) {
+			break; // Rest of the escape sequence is still coming
+		}
+		reader_start += key_len;
+		if(editKey(my_key, input_line, input_size) == 1) {
+			reader_scan = reader_start;
+			return 1;
+		}
+	}
+	reader_scan = reader_start;
+
+	// A whole paste is drawn with one write
+	refreshEditLine();
+	return 0;
+}
+
+int decodeKey(size_t* key_len) {
+	unsigned char* key_ptr = (unsigned char*)reader_buf + reader_start;
+	size_t avail = reader_len - reader_start;
+
+	*key_len = 1;
+	if(key_ptr[0] != 27) {
+		return key_ptr[0];
+	}
+
+	// A lone escape can only be told apart once more input arrives
+	if(avail < 2) {
+		return reader_eof ? 27 : -1;
+	}
+	if(key_ptr[1] != '[' && key_ptr[1] != 'O') {
+		return 27;
+	}
+
+	// Escape sequences end with a byte from @ to ~
+	for(size_t i = 2; i < avail; i++) {
+		if(key_ptr[i] < 0x40 || key_ptr[i] > 0x7e) {
+			continue;
+		}
+		*key_len = i + 1;
+		switch(key_ptr[i]) {
+			case 'A': return KEY_UP;
+			case 'B': return KEY_DOWN;
+			case 'C': return KEY_RIGHT;
+			case 'D': return KEY_LEFT;
+			case 'H': return KEY_HOME;
+			case 'F': return KEY_END;
+			case '~':
+				if(i == 3 && (key_ptr[2] == '1' || key_ptr[2] == '7')) {
+					return KEY_HOME;
+				}
+				if(i == 3 && (key_ptr[2] == '4' || key_ptr[2] == '8')) {
+					return KEY_END;
+				}
+				if(i == 3 && key_ptr[2] == '3') {
+					return KEY_DELETE;
+				}
+		}
+		return KEY_NONE;
+	}
+	*key_len = avail;
+	return reader_eof ? KEY_NONE : -1;
+}
+
+int editKey(int my_key, char** input_line, ssize_t* input_size) {
+	struct HistEntry* next_hist;
+
+	int tab_twice = last_key_tab;
+	TokenArr my_matches = {0, NULL};
+
+	last_key_tab = my_key == '\t';
+	if(searching && searchKey(my_key) == 0) {
+		return 0;
+	}
+
+	switch(my_key) {
+		case '\t':
+
+			// A second Tab that can't add anything lists the matches
+			if(completeWord(&edit_line, tab_twice ? &my_matches : NULL) > 1 && my_matches.token_count > 0) {
+				printf("\n");
+				for(int i = 0; i < my_matches.token_count && i < 200; i++) {
+					printf("%s  ", my_matches.tokens[i]);
+				}
+				if(my_matches.token_count > 200) {
+					printf("(%d more)", my_matches.token_count - 200);
+				}
+				printf("\nwsh> ");
+				fflush(stdout);
+				resetEditShown();
+			}
+			freeMatches(&my_matches);
+			break;
+
+		case '\r':
+		case '\n':
+			edit_line.pos = edit_line.len;
+			refreshEditLine();
+			printf("\n");
+			fflush(stdout);
+			endEditLine();
+			*input_line = edit_line.text;
+			*input_size = edit_line.len;
+			return 1;
+
+		case CTRL_KEY('c'):
+			printf("^C\n");
+			fflush(stdout);
+			endEditLine();
+			edit_line.len = 0;
+			edit_line.text[0] = '\0';
+			*input_line = edit_line.text;
+			*input_size = 0;
+			return 1;
+
+		case CTRL_KEY('d'):
+
+			// Ctrl-D on an empty line is EOF, otherwise it deletes like the delete key
+			if(edit_line.len == 0) {
+				printf("\n");
+				fflush(stdout);
+				endEditLine();
+				reader_eof = 1;
+				reader_start = reader_len;
+				*input_size = -1;
+				return 1;
+			}
+			// fall through
+		case KEY_DELETE:
+			if(edit_line.pos < edit_line.len) {
+				memmove(edit_line.text + edit_line.pos, edit_line.text + edit_line.pos + 1, edit_line.len - edit_line.pos - 1);
+				edit_line.len--;
+			}
+			break;
+
+		case 127:
+		case CTRL_KEY('h'):
+			if(edit_line.pos > 0) {
+				memmove(edit_line.text + edit_line.pos - 1, edit_line.text + edit_line.pos, edit_line.len - edit_line.pos);
+				edit_line.pos--;
+				edit_line.len--;
+			}
+			break;
+
+		case CTRL_KEY('a'):
+		case KEY_HOME:
+			edit_line.pos = 0;
+			break;
+
+		case CTRL_KEY('e'):
+		case KEY_END:
+			edit_line.pos = edit_line.len;
+			break;
+
+		case CTRL_KEY('b'):
+		case KEY_LEFT:
+			if(edit_line.pos > 0) {
+				edit_line.pos--;
+			}
+			break;
+
+		case CTRL_KEY('f'):
+		case KEY_RIGHT:
+			if(edit_line.pos < edit_line.len) {
+				edit_line.pos++;
+			}
+			break;
+
+		case CTRL_KEY('k'):
+			edit_line.len = edit_line.pos;
+			break;
+
+		case CTRL_KEY('u'):
+			memmove(edit_line.text, edit_line.text + edit_line.pos, edit_line.len - edit_line.pos);
+			edit_line.len -= edit_line.pos;
+			edit_line.pos = 0;
+			break;
+
+		case CTRL_KEY('w'):
+			// Drop the word before the cursor and any spaces after it
+			{
+				size_t word_start = edit_line.pos;
+				while(word_start > 0 && edit_line.text[word_start - 1] == ' ') {
+					word_start--;
+				}
+				while(word_start > 0 && edit_line.text[word_start - 1] != ' ') {
+					word_start--;
+				}
+				memmove(edit_line.text + word_start, edit_line.text + edit_line.pos, edit_line.len - edit_line.pos);
+				edit_line.len -= edit_line.pos - word_start;
+				edit_line.pos = word_start;
+			}
+			break;
+
+		case CTRL_KEY('p'):
+		case KEY_UP:
+
+			// Keep the new line so coming back down restores it
+			next_hist = edit_hist == NULL ? histHead : edit_hist->next_entry;
+			if(next_hist == NULL || next_hist->entry_line == NULL) {
+				break;
+			}
+			if(edit_hist == NULL && setEditLine(&edit_saved, edit_line.text, edit_line.len) == -1) {
+				break;
+			}
+			edit_hist = next_hist;
+			setEditLine(&edit_line, edit_hist->entry_line, strlen(edit_hist->entry_line));
+			break;
+
+		case CTRL_KEY('n'):
+		case KEY_DOWN:
+			if(edit_hist == NULL) {
+				break;
+			}
+			edit_hist = edit_hist->prev_entry;
+			if(edit_hist == NULL) {
+				setEditLine(&edit_line, edit_saved.text, edit_saved.len);
+			}
+			else {
+				setEditLine(&edit_line, edit_hist->entry_line, strlen(edit_hist->entry_line));
+			}
+			break;
+
+		case CTRL_KEY('r'):
+			searching = 1;
+			search_match = NULL;
+			search_query.len = 0;
+			if(growEditLine(&search_query, 0) == -1) {
+				searching = 0;
+				break;
+			}
+			search_query.text[0] = '\0';
+			break;
+
+		case CTRL_KEY('l'):
+			printf("\033[H\033[2Jwsh> ");
+			fflush(stdout);
+			resetEditShown();
+			break;
+
+		default:
+			// Control keys that aren't bound are dropped
+			if(my_key < 32 || my_key >= KEY_NONE) {
+				break;
+			}
+			if(growEditLine(&edit_line, edit_line.len + 1) == -1) {
+				break;
+			}
+			memmove(edit_line.text + edit_line.pos + 1, edit_line.text + edit_line.pos, edit_line.len - edit_line.pos);
+			edit_line.text[edit_line.pos++] = my_key;
+			edit_line.len++;
+			break;
+	}
+	edit_line.text[edit_line.len] = '\0';
+	return 0;
+}
+
+int searchKey(int my_key) {
+	switch(my_key) {
+		case CTRL_KEY('r'):
+			// Step back to the next older match, staying put if there isn't one
+			if(search_match == NULL) {
+				search_match = searchHistory(search_query.text, UINT_MAX);
+			}
+			else if(searchHistory(search_query.text, search_match->entry_seq) != NULL) {
+				search_match = searchHistory(search_query.text, search_match->entry_seq);
+			}
+			return 0;
+
+		case 127:
+		case CTRL_KEY('h'):
+			if(search_query.len > 0) {
+				search_query.text[--search_query.len] = '\0';
+			}
+			search_match = searchHistory(search_query.text, UINT_MAX);
+			return 0;
+
+		case CTRL_KEY('g'):
+			searching = 0; // Back to the line as it was
+			return 0;
+	}
+
+	// Typing narrows the search, starting from the current match
+	if(my_key >= 32 && my_key < KEY_NONE && my_key != 127) {
+		if(growEditLine(&search_query, search_query.len + 1) == 0) {
+			search_query.text[search_query.len++] = my_key;
+			search_query.text[search_query.len] = '\0';
+			search_match = searchHistory(search_query.text, search_match == NULL ? UINT_MAX : search_match->entry_seq + 1);
+		}
+		return 0;
+	}
+
+	// Any other key takes the match into the line and is then applied as usual
+	searching = 0;
+	if(search_match != NULL) {
+		edit_hist = NULL;
+		setEditLine(&edit_line, search_match->entry_line, strlen(search_match->entry_line));
+	}
+	return 1;
+}
+
+void refreshEditLine() {
+	char* target = edit_line.text;
+	size_t target_len = edit_line.len;
+	size_t target_pos = edit_line.pos;
+	size_t same = 0;
+
+	// Search mode shows the query and match after the prompt
+	if(searching) {
+		char* match_line = search_match != NULL ? search_match->entry_line : "";
+		if(growEditLine(&search_view, search_query.len + strlen(match_line) + 32) == -1) {
+			return;
+		}
+		search_view.len = sprintf(search_view.text, "(%sreverse-i-search)`%s': %s", 
+			search_query.len > 0 && search_match == NULL ? "failed " : "", search_query.text, match_line);
+		target = search_view.text;
+		target_len = search_view.len;
+		target_pos = target_len;
+	}
+
+	// Only the part after the first difference is written
+	while(same < edit_shown.len && same < target_len && edit_shown.text[same] == target[same]) {
+		same++;
+	}
+	if(growEditLine(&edit_out, target_len - same + 64) == -1) {
+		return;
+	}
+	edit_out.len = 0;
+	if(edit_shown.pos > same) {
+		edit_out.len += sprintf(edit_out.text, "\033[%zuD", edit_shown.pos - same);
+	}
+	else if(edit_shown.pos < same) {
+		edit_out.len += sprintf(edit_out.text, "\033[%zuC", same - edit_shown.pos);
+	}
+	memcpy(edit_out.text + edit_out.len, target + same, target_len - same);
+	edit_out.len += target_len - same;
+	if(edit_shown.len > target_len) {
+		edit_out.len += sprintf(edit_out.text + edit_out.len, "\033[K");
+	}
+	if(target_len > target_pos) {
+		edit_out.len += sprintf(edit_out.text + edit_out.len, "\033[%zuD", target_len - target_pos);
+	}
+
+	// One write per refresh keeps slow links from seeing partial redraws
+	if(edit_out.len > 0 && write(STDOUT_FILENO, edit_out.text, edit_out.len) == -1) {
+		return;
+	}
+	if(setEditLine(&edit_shown, target, target_len) == 0) {
+		edit_shown.pos = target_pos;
+	}
+}
+
+void resetEditShown() {
+	edit_shown.len = 0;
+	edit_shown.pos = 0;
+}
+
+int completeWord(struct EditLine* my_line, TokenArr* my_matches) {
+	TokenArr file_matches = {0, NULL};
+	struct TrieNode* node;
+	struct EditLine my_word = {0};
+	char* typed;
+	size_t typed_len;
+	size_t common_len;
+	char open_quote;
+	int var_word;
+	int first_word;
+	int match_count;
+	int ret_val = 0;
+
+	// The word is matched by what it means, not how it was typed
+	first_word = scanEditWord(my_line, &my_word, &open_quote, &var_word);
+	if(first_word == -1) {
+		free(my_word.text);
+		return -1;
+	}
+
+	// Commands come from the trie, which gives the common extension without listing every match
+	if(first_word && !var_word && strchr(my_word.text, '/') == NULL) {
+		if(refreshCommandTrie() == -1) {
+			free(my_word.text);
+			return -1;
+		}
+		node = trieFind(cmdTrie, my_word.text, my_word.len);
+		match_count = node == NULL ? 0 : node->word_count;
+		while(node != NULL && !node->is_word && node->first_child != NULL && node->first_child->next_sibling == NULL) {
+			node = node->first_child;
+			if(insertCompletion(my_line, &node->node_char, 1, open_quote) == -1 || insertEditText(&my_word, &node->node_char, 1) == -1) {
+				free(my_word.text);
+				return -1;
+			}
+			ret_val = 1;
+		}
+		if(match_count == 1) {
+			finishCompletion(my_line, open_quote);
+		}
+		else if(match_count > 1 && !ret_val && my_matches != NULL) {
+			trieCollect(node, &my_word, my_matches);
+		}
+		free(my_word.text);
+		return match_count;
+	}
+
+	// Vars and files are listed, then cut down to what they have in common
+	if(var_word) {
+		typed = my_word.text + 1;
+		ret_val = collectVarMatches(typed, &file_matches);
+	}
+	else {
+		typed = strrchr(my_word.text, '/');
+		typed = typed == NULL ? my_word.text : typed + 1;
+		ret_val = collectFileMatches(my_word.text, &file_matches);
+	}
+	match_count = file_matches.token_count;
+	if(ret_val == -1 || match_count == 0) {
+		freeMatches(&file_matches);
+		free(my_word.text);
+		return ret_val == -1 ? -1 : 0;
+	}
+
+	typed_len = strlen(typed);
+	common_len = strlen(file_matches.tokens[0]);
+	for(int i = 1; i < match_count; i++) {
+		size_t same = 0;
+		while(same < common_len && file_matches.tokens[i][same] == file_matches.tokens[0][same]) {
+			same++;
+		}
+		common_len = same;
+	}
+	if(common_len > typed_len) {
+		insertCompletion(my_line, file_matches.tokens[0] + typed_len, common_len - typed_len, open_quote);
+	}
+
+	// A lone match is finished off, dirs are left open for the next part
+	if(match_count == 1 && file_matches.tokens[0][common_len - 1] != '/') {
+		finishCompletion(my_line, open_quote);
+	}
+	if(match_count > 1 && common_len == typed_len && my_matches != NULL) {
+		*my_matches = file_matches;
+	}
+	else {
+		freeMatches(&file_matches);
+	}
+	free(my_word.text);
+	return match_count;
+}
+
+int scanEditWord(struct EditLine* my_line, struct EditLine* my_word, char* open_quote, int* var_word) {
+	char my_char;
+	int first_word = 1;
+
+	// Quotes and backslashes are read the way the lexer reads them, up to the cursor
+	*open_quote = '\0';
+	*var_word = 0;
+	if(setEditLine(my_word, "", 0) == -1) {
+		return -1;
+	}
+	for(size_t i = 0; i < my_line->pos; i++) {
+		my_char = my_line->text[i];
+		if(*open_quote == '\'') {
+			if(my_char == '\'') {
+				*open_quote = '\0';
+				continue;
+			}
+		}
+		else if(*open_quote == '"') {
+			if(my_char == '"') {
+				*open_quote = '\0';
+				continue;
+			}
+			if(my_char == '\\' && i + 1 < my_line->pos && strchr("$\"\\`", my_line->text[i + 1]) != NULL) {
+				my_char = my_line->text[++i];
+			}
+			else if(my_char == '$' && my_word->len == 0) {
+				*var_word = 1;
+			}
+		}
+		else if(my_char == ' ' || my_char == '\t') {
+			first_word &= my_word->len == 0 && !*var_word;
+			my_word->len = 0;
+			my_word->pos = 0;
+			*var_word = 0;
+			continue;
+		}
+		else if(my_char == '\'' || my_char == '"') {
+			*open_quote = my_char;
+			continue;
+		}
+		else if(my_char == '\\') {
+			if(i + 1 == my_line->pos) {
+				continue;
+			}
+			my_char = my_line->text[++i];
+		}
+		else if(my_char == '$' && my_word->len == 0) {
+			*var_word = 1;
+		}
+		if(insertEditText(my_word, &my_char, 1) == -1) {
+			return -1;
+		}
+	}
+
+	// Words before this one were started by any other char, even a quote
+	for(size_t i = 0; first_word && i < my_line->pos; i++) {
+		if(my_line->text[i] == ' ' || my_line->text[i] == '\t') {
+			for(size_t j = i; j < my_line->pos; j++) {
+				if(my_line->text[j] != ' ' && my_line->text[j] != '\t') {
+					first_word = 0;
+					break;
+				}
+			}
+			break;
+		}
+	}
+	return first_word;
+}
+
+int insertCompletion(struct EditLine* my_line, const char* my_text, size_t text_len, char open_quote) {
+	const char* special_chars = open_quote == '"' ? "$\"\\`" : COMPLETE_SPECIAL;
+
+	// Escaped the way the quote the word is in needs, so the lexer reads back the same name
+	for(size_t i = 0; i < text_len; i++) {
+		int ret_val;
+		if(open_quote == '\'') {
+			ret_val = my_text[i] == '\'' ? insertEditText(my_line, "'\\''", 4) : insertEditText(my_line, my_text + i, 1);
+		}
+		else if(strchr(special_chars, my_text[i]) != NULL) {
+			ret_val = insertEditText(my_line, "\\", 1) == -1 ? -1 : insertEditText(my_line, my_text + i, 1);
+		}
+		else {
+			ret_val = insertEditText(my_line, my_text + i, 1);
+		}
+		if(ret_val == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int finishCompletion(struct EditLine* my_line, char open_quote) {
+	if(open_quote != '\0' && insertEditText(my_line, &open_quote, 1) == -1) {
+		return -1;
+	}
+	return insertEditText(my_line, " ", 1);
+}
+
+int collectFileMatches(char* my_word, TokenArr* my_matches) {
+	struct DirCache* my_cache;
+	char* base_name = strrchr(my_word, '/');
+	char* dir_path;
+	size_t base_len;
+	int ret_val = 0;
+
+	// The dir part is listed through the glob cache
+	if(base_name == NULL) {
+		dir_path = strdup(".");
+		base_name = my_word;
+	}
+	else {
+		base_name++;
+		dir_path = strndup(my_word, base_name - my_word);
+	}
+	if(dir_path == NULL) {
+		return -1;
+	}
+	my_cache = getDirCache(dir_path);
+	free(dir_path);
+	if(my_cache == NULL) {
+		return 0;
+	}
+
+	// Hidden files only match once a . is typed
+	base_len = strlen(base_name);
+	for(int i = 0; i < my_cache->entry_count && ret_val == 0; i++) {
+		char* entry = my_cache->entries[i].name;
+		if(strncmp(entry, base_name, base_len) != 0 || (entry[0] == '.' && base_name[0] != '.')) {
+			continue;
+		}
+		if(my_cache->entries[i].type & GLOB_DIR) {
+			char* dir_name = joinPath(entry, "");
+			ret_val = dir_name == NULL ? -1 : addGlobMatch(my_matches, dir_name);
+			free(dir_name);
+		}
+		else {
+			ret_val = addGlobMatch(my_matches, entry);
+		}
+	}
+	return ret_val;
+}
+
+int collectVarMatches(char* var_prefix, TokenArr* my_matches) {
+	struct ShellVar* var_ptr;
+	size_t prefix_len = strlen(var_prefix);
+	char* name_end;
+	int unique_count = 0;
+
+	for(char** env_ptr = environ; *env_ptr != NULL; env_ptr++) {
+		name_end = strchr(*env_ptr, '=');
+		if(name_end == NULL || strncmp(*env_ptr, var_prefix, prefix_len) != 0) {
+			continue;
+		}
+		char* var_name = strndup(*env_ptr, name_end - *env_ptr);
+		if(var_name == NULL || addGlobMatch(my_matches, var_name) == -1) {
+			free(var_name);
+			return -1;
+		}
+		free(var_name);
+	}
+	for(var_ptr = shellLinkedListHead; var_ptr != NULL; var_ptr = var_ptr->next_var) {
+		if(strncmp(var_ptr->var_name, var_prefix, prefix_len) == 0 && addGlobMatch(my_matches, var_ptr->var_name) == -1) {
+			return -1;
+		}
+	}
+
+	// A name set in both env and the shell is one match
+	if(my_matches->token_count > 1) {
+		qsort(my_matches->tokens, my_matches->token_count, sizeof(char*), cmpStrings);
+	}
+	for(int i = 0; i < my_matches->token_count; i++) {
+		if(unique_count > 0 && strcmp(my_matches->tokens[i], my_matches->tokens[unique_count - 1]) == 0) {
+			free(my_matches->tokens[i]);
+			continue;
+		}
+		my_matches->tokens[unique_count++] = my_matches->tokens[i];
+	}
+	my_matches->token_count = unique_count;
+	return 0;
+}
+
+int insertEditText(struct EditLine* my_line, const char* my_text, size_t text_len) {
+	if(growEditLine(my_line, my_line->len + text_len) == -1) {
+		return -1;
+	}
+	memmove(my_line->text + my_line->pos + text_len, my_line->text + my_line->pos, my_line->len - my_line->pos);
+	memcpy(my_line->text + my_line->pos, my_text, text_len);
+	my_line->pos += text_len;
+	my_line->len += text_len;
+	my_line->text[my_line->len] = '\0';
+	return 0;
+}
+
+int refreshCommandTrie() {
+	int command_count = sizeof(COMMAND_ARR) / sizeof(char*);
+	char* path_env = getenv("PATH");
+	char* dir_start;
+	char* dir_end;
+	char* dir_path;
+	struct stat dir_stat;
+	struct DirCache* my_cache;
+	struct timespec now;
+	int stale;
+	int dir_count = 0;
+
+	if(path_env == NULL) {
+		path_env = "";
+	}
+	stale = cmdTrie == NULL || strcmp(cmd_trie_path, path_env) != 0;
+
+	// Only a stat per PATH dir when nothing changed
+	for(dir_start = path_env; !stale && *dir_start != '\0'; dir_start = dir_end + (*dir_end == ':')) {
+		dir_end = strchrnul(dir_start, ':');
+		if(dir_end == dir_start) {
+			continue;
+		}
+		dir_path = strndup(dir_start, dir_end - dir_start);
+		if(dir_path == NULL) {
+			return -1;
+		}
+		if(stat(dir_path, &dir_stat) == -1) {
+			dir_stat.st_mtim.tv_sec = 0;
+			dir_stat.st_mtim.tv_nsec = 0;
+		}
+		free(dir_path);
+
+		// Like the glob cache, a dir changed in the second it was read is read again
+		stale = dir_stat.st_mtim.tv_sec != cmd_trie_mtimes[dir_count].tv_sec 
+			|| dir_stat.st_mtim.tv_nsec != cmd_trie_mtimes[dir_count].tv_nsec
+			|| dir_stat.st_mtim.tv_sec >= cmd_trie_time;
+		dir_count++;
+	}
+	if(!stale) {
+		return 0;
+	}
+
+	freeCompletion();
+	clock_gettime(CLOCK_REALTIME, &now);
+	cmd_trie_time = now.tv_sec;
+	cmd_trie_path = strdup(path_env);
+	cmdTrie = calloc(1, sizeof(struct TrieNode));
+	cmd_trie_mtimes = malloc((strlen(path_env) / 2 + 1) * sizeof(struct timespec));
+	if(cmd_trie_path == NULL || cmdTrie == NULL || cmd_trie_mtimes == NULL) {
+		freeCompletion();
+		return -1;
+	}
+	for(int i = 0; i < command_count; i++) {
+		if(trieInsert(cmdTrie, COMMAND_ARR[i]) == -1) {
+			freeCompletion();
+			return -1;
+		}
+	}
+
+	for(dir_start = path_env; *dir_start != '\0'; dir_start = dir_end + (*dir_end == ':')) {
+		dir_end = strchrnul(dir_start, ':');
+		if(dir_end == dir_start) {
+			continue;
+		}
+		dir_path = strndup(dir_start, dir_end - dir_start);
+		if(dir_path == NULL) {
+			freeCompletion();
+			return -1;
+		}
+		if(stat(dir_path, &dir_stat) == -1) {
+			dir_stat.st_mtim.tv_sec = 0;
+			dir_stat.st_mtim.tv_nsec = 0;
+		}
+		cmd_trie_mtimes[cmd_trie_dirs++] = dir_stat.st_mtim;
+
+		// Listings come from the glob cache, only files we can run are added
+		my_cache = getDirCache(dir_path);
+		for(int i = 0; my_cache != NULL && i < my_cache->entry_count; i++) {
+			if(my_cache->entries[i].type & GLOB_DIR) {
+				continue;
+			}
+			char* full_path = joinPath(dir_path, my_cache->entries[i].name);
+			if(full_path != NULL && access(full_path, X_OK) == 0 && trieInsert(cmdTrie, my_cache->entries[i].name) == -1) {
+				free(full_path);
+				free(dir_path);
+				freeCompletion();
+				return -1;
+			}
+			free(full_path);
+		}
+		free(dir_path);
+	}
+	return 0;
+}
+
+int trieInsert(struct TrieNode* root, const char* my_word) {
+	struct TrieNode* node = root;
+	struct TrieNode** child_ptr;
+	struct TrieNode* existing = trieFind(root, my_word, strlen(my_word));
+
+	// Counts are per word, so a repeat changes nothing
+	if(existing != NULL && existing->is_word) {
+		return 0;
+	}
+	root->word_count++;
+	for(const char* char_ptr = my_word; *char_ptr != '\0'; char_ptr++) {
+		child_ptr = &node->first_child;
+		while(*child_ptr != NULL && (unsigned char)(*child_ptr)->node_char < (unsigned char)*char_ptr) {
+			child_ptr = &(*child_ptr)->next_sibling;
+		}
+		if(*child_ptr == NULL || (*child_ptr)->node_char != *char_ptr) {
+			struct TrieNode* new_node = calloc(1, sizeof(struct TrieNode));
+			if(new_node == NULL) {
+				return -1;
+			}
+			new_node->node_char = *char_ptr;
+			new_node->next_sibling = *child_ptr;
+			*child_ptr = new_node;
+		}
+		node = *child_ptr;
+		node->word_count++;
+	}
+	node->is_word = 1;
+	return 0;
+}
+
+struct TrieNode* trieFind(struct TrieNode* root, const char* my_prefix, size_t prefix_len) {
+	struct TrieNode* node = root;
+	for(size_t i = 0; node != NULL && i < prefix_len; i++) {
+		node = node->first_child;
+		while(node != NULL && node->node_char != my_prefix[i]) {
+			node = node->next_sibling;
+		}
+	}
+	return node;
+}
+
+int trieCollect(struct TrieNode* node, struct EditLine* my_word, TokenArr* my_matches) {
+	size_t word_len = my_word->len;
+	if(node->is_word && addGlobMatch(my_matches, my_word->text) == -1) {
+		return -1;
+	}
+
+	// Children are sorted so matches come out sorted
+	for(struct TrieNode* child = node->first_child; child != NULL; child = child->next_sibling) {
+		my_word->pos = word_len;
+		my_word->len = word_len;
+		if(insertEditText(my_word, &child->node_char, 1) == -1 || trieCollect(child, my_word, my_matches) == -1) {
+			return -1;
+		}
+	}
+	my_word->len = word_len;
+	my_word->pos = word_len;
+	my_word->text[word_len] = '\0';
+	return 0;
+}
+
+void freeTrie(struct TrieNode* node) {
+	struct TrieNode* next_sibling;
+	while(node != NULL) {
+		next_sibling = node->next_sibling;
+		freeTrie(node->first_child);
+		free(node);
+		node = next_sibling;
+	}
+}
+
+void freeCompletion() {
+	freeTrie(cmdTrie);
+	cmdTrie = NULL;
+	free(cmd_trie_path);
+	cmd_trie_path = NULL;
+	free(cmd_trie_mtimes);
+	cmd_trie_mtimes = NULL;
+	cmd_trie_dirs = 0;
+}
+
+void* poolAlloc(struct NodePool* my_pool) {
+	struct PoolSlab* my_slab;
+	void* my_obj;
+
+	// Carve a new slab into free objects once the free list runs out
+	if(my_pool->free_list == NULL) {
+		my_slab = malloc(sizeof(struct PoolSlab) + POOL_SLAB_OBJS * my_pool->obj_size);
+		if(my_slab == NULL) {
+			return NULL;
+		}
+		my_slab->next_slab = my_pool->slabs;
+		my_pool->slabs = my_slab;
+		my_pool->slab_count++;
+		for(int i = POOL_SLAB_OBJS - 1; i >= 0; i--) {
+			my_obj = my_slab->slab_objs + i * my_pool->obj_size;
+			*(void**)my_obj = my_pool->free_list;
+			my_pool->free_list = my_obj;
+		}
+	}
+	my_obj = my_pool->free_list;
+	my_pool->free_list = *(void**)my_obj;
+	my_pool->live_count++;
+	if(my_pool->live_count > my_pool->peak_count) {
+		my_pool->peak_count = my_pool->live_count;
+	}
+	return my_obj;
+}
+
+void poolFree(struct NodePool* my_pool, void* my_obj) {
+	if(my_obj == NULL) {
+		return;
+	}
+#ifdef WSH_DEBUG
+	// Stale pointers into freed nodes read garbage instead of old values
+	memset(my_obj, 0xdd, my_pool->obj_size);
+#endif
+	*(void**)my_obj = my_pool->free_list;
+	my_pool->free_list = my_obj;
+	my_pool->live_count--;
+}
+
+void freePool(struct NodePool* my_pool) {
+	struct PoolSlab* next_slab;
+	while(my_pool->slabs != NULL) {
+		next_slab = my_pool->slabs->next_slab;
+		free(my_pool->slabs);
+		my_pool->slabs = next_slab;
+	}
+	my_pool->free_list = NULL;
+	my_pool->slab_count = 0;
+	my_pool->live_count = 0;
+}
+
+size_t reportLeaks() {
+	int pool_count = sizeof(NODE_POOLS) / sizeof(struct NodePool*);
+	size_t leaked = 0;
+	for(int i = 0; i < pool_count; i++) {
+		if(NODE_POOLS[i]->live_count > 0) {
+			fprintf(stderr, "Leak: %zu %s objects (%zu bytes) still live at exit\n", NODE_POOLS[i]->live_count, 
+				NODE_POOLS[i]->pool_name, NODE_POOLS[i]->live_count * NODE_POOLS[i]->obj_size);
+			leaked += NODE_POOLS[i]->live_count;
+		}
+	}
+	return leaked;
+}
+
+int growEditLine(struct EditLine* my_line, size_t need) {
+	if(need + 1 > my_line->cap) {
+		size_t new_cap = my_line->cap * 2 > need + 1 ? my_line->cap * 2 : need + 64;
+		char* alloc_ret = realloc(my_line->text, new_cap);
+		if(alloc_ret == NULL) {
+			return -1;
+		}
+		my_line->text = alloc_ret;
+		my_line->cap = new_cap;
+	}
+	return 0;
+}
+
+int setEditLine(struct EditLine* my_line, const char* my_text, size_t text_len) {
+	if(growEditLine(my_line, text_len) == -1) {
+		return -1;
+	}
+	memmove(my_line->text, my_text, text_len);
+	my_line->text[text_len] = '\0';
+	my_line->len = text_len;
+	my_line->pos = text_len;
+	return 0;
+}
+
+int checkBuiltIn(char* my_command) {
+	int commands_size = (sizeof(COMMAND_ARR)/sizeof(char*));
+	for(int i = 0; i < commands_size;i++) {
+		if(strcmp(my_command, COMMAND_ARR[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+unsigned long hashVarName(char* var_name) {
+	unsigned long hash = 14695981039346656037UL; // FNV-1a offset basis
+	while(*var_name != '\0') {
+		hash ^= (unsigned char)*var_name++;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+char* getShellVar(char* var_name) {
+	struct ShellVar* my_var = findShellVar(var_name);
+	if(my_var != NULL) {
+		return my_var->var_val;
+	}
+	return "";
+}
+
+struct ShellVar* findShellVar(char* var_name) {
+	struct ShellVar* var_ptr;
+	if(varBucketCount == 0) {
+		return NULL;
+	}
+
+	// Only walk the vars that share a bucket
+	var_ptr = varBuckets[hashVarName(var_name) & (varBucketCount - 1)];
+	while(var_ptr != NULL) {
+		if(strcmp(var_ptr->var_name,var_name) == 0){
+			return var_ptr;
+		}
+		var_ptr = var_ptr->next_bucket;
+	}
+	return NULL; // Var not found
+}
+
+int growVarBuckets() {
+	size_t new_count = varBucketCount == 0 ? 64 : varBucketCount * 2;
+	struct ShellVar** new_buckets = calloc(new_count, sizeof(struct ShellVar*));
+	struct ShellVar* var_ptr;
+	size_t bucket;
+	if(new_buckets == NULL) {
+		return -1;
+	}
+
+	// Rehash in list order
+	for(var_ptr = shellLinkedListHead; var_ptr != NULL; var_ptr = var_ptr->next_var) {
+		bucket = hashVarName(var_ptr->var_name) & (new_count - 1);
+		var_ptr->next_bucket = new_buckets[bucket];
+		new_buckets[bucket] = var_ptr;
+	}
+	free(varBuckets);
+	varBuckets = new_buckets;
+	varBucketCount = new_count;
+	return 0;
+}
+
+int tokenCmp(TokenArr* arr1, TokenArr* arr2) {
+
+	// Compare they're same size
+	if(arr1->token_count != arr2->token_count) {
+		return 0;
+	}
+
+	// Compare each token
+	for(int i = 0; i < arr1->token_count;i++) {
+		if(strcmp(arr1->tokens[i],arr2->tokens[i]) != 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+TokenArr* copyTokenArr(TokenArr* my_tokens) {
+	char error_message[] = "Error copying token arr";
+	TokenArr* my_copy;
+
+	// Allocating copy
+	my_copy = poolAlloc(&tokenArrPool);
+	if(my_copy == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		return NULL;
+	}
+	my_copy->token_count = 0;
+
+	// Allocating copy's tokens arr
+	my_copy->tokens = malloc((my_tokens->token_count + 1) * sizeof(char*));
+	if(my_copy->tokens == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		poolFree(&tokenArrPool, my_copy);
+		return NULL;
+	}
+
+	// Copy values over, a partial copy is freed up to what was copied
+	for(int i = 0;i < my_tokens->token_count;i++) {
+		my_copy->tokens[i] = strdup(my_tokens->tokens[i]);
+		if(my_copy->tokens[i] == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			freeTokenArr(my_copy);
+			return NULL;
+		}
+		my_copy->token_count++;
+	}
+	my_copy->tokens[my_copy->token_count] = NULL; // Terminating null when used as args
+	return my_copy;
+}
+
+int addHistEntry(TokenArr* my_tokens) { 
+	char error_message[] = "Error adding command to history";
+
+	// Adding first entry
+	if(histSize == 0) {
+		histHead = poolAlloc(&histEntryPool);
+		histTail = histHead;
+		if(histHead == NULL || histTail == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+
+		// Create a copy of the tokens at head entry
+		histHead->entry_tokens = copyTokenArr(my_tokens);
+		if(histHead->entry_tokens == NULL) {
+			poolFree(&histEntryPool, histHead);
+			histHead = NULL;
+			histTail = NULL;
+			return -1;
+		}
+		histHead->next_entry = NULL;
+		histHead->prev_entry = NULL;
+		histSize++;
+		if(indexHistEntry(histHead) == -1) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+	}
+
+	// >= 1 Entry
+	else if(tokenCmp(histHead->entry_tokens, my_tokens) != 1){
+		struct HistEntry* command_ptr;
+		command_ptr = poolAlloc(&histEntryPool);
+		if(command_ptr == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+		command_ptr->entry_tokens = copyTokenArr(my_tokens);
+		if(command_ptr->entry_tokens == NULL) {
+			poolFree(&histEntryPool, command_ptr);
+			return -1;
+		}
+		command_ptr->next_entry = histHead;
+		histHead->prev_entry = command_ptr;
+		command_ptr->prev_entry = NULL;
+		histHead = command_ptr;
+		histSize++;
+		if(indexHistEntry(histHead) == -1) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+	}
+
+	// Remove any entries over limit 
+	while(histSize > histLimit) {
+		removeHistEntry();
+	}
+	return 0;
+}
+
+struct HistEntry* getHistEntry(int index) {
+	index = index-1;
+	struct HistEntry* ret_val;
+	ret_val = histHead;
+	for(int i = 0; i < index;i++) {
+		ret_val = ret_val->next_entry;
+	}
+	return ret_val;
+}
+
+struct TrigramPosting* findPosting(uint32_t trigram, int create) {
+	size_t bucket = (uint32_t)(trigram * 2654435761u) >> (32 - TRIGRAM_BUCKET_BITS);
+	struct TrigramPosting* my_posting;
+
+	if(trigramBuckets == NULL) {
+		return NULL;
+	}
+	for(my_posting = trigramBuckets[bucket]; my_posting != NULL; my_posting = my_posting->next_posting) {
+		if(my_posting->trigram == trigram) {
+			return my_posting;
+		}
+	}
+	if(!create) {
+		return NULL;
+	}
+	my_posting = calloc(1, sizeof(struct TrigramPosting));
+	if(my_posting == NULL) {
+		return NULL;
+	}
+	my_posting->trigram = trigram;
+	my_posting->next_posting = trigramBuckets[bucket];
+	trigramBuckets[bucket] = my_posting;
+	return my_posting;
+}
+
+char* joinTokens(TokenArr* my_tokens) {
+	char* joined;
+	size_t line_len = 0;
+
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		line_len += strlen(my_tokens->tokens[i]) + 1;
+	}
+	joined = malloc(line_len + 1);
+	if(joined == NULL) {
+		return NULL;
+	}
+	line_len = 0;
+	joined[0] = '\0';
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		line_len += sprintf(joined + line_len, i == 0 ? "%s" : " %s", my_tokens->tokens[i]);
+	}
+	return joined;
+}
+
+int indexHistEntry(struct HistEntry* my_entry) {
+	// Typed lines keep their quoting so recalling one runs the same thing,
+	// anything else is joined the way history prints it
+	if(hist_line != NULL && func_depth == 0 && source_depth == 0) {
+		my_entry->entry_line = strdup(hist_line);
+	}
+	else {
+		my_entry->entry_line = joinTokens(my_entry->entry_tokens);
+	}
+	if(my_entry->entry_line == NULL) {
+		return -1;
+	}
+	my_entry->entry_seq = histNextSeq++;
+
+	// Removed entries leave a gap at the front, reuse it before growing
+	if(histBySeqLen == histBySeqCap) {
+		if(histBySeqStart > 0 && histBySeqStart >= histBySeqLen / 2) {
+			memmove(histBySeq, histBySeq + histBySeqStart, (histBySeqLen - histBySeqStart) * sizeof(struct HistEntry*));
+			histBySeqLen -= histBySeqStart;
+			histBySeqStart = 0;
+		}
+		else {
+			struct HistEntry** alloc_ret = realloc(histBySeq, (histBySeqCap * 2 + 64) * sizeof(struct HistEntry*));
+			if(alloc_ret == NULL) {
+				return -1;
+			}
+			histBySeq = alloc_ret;
+			histBySeqCap = histBySeqCap * 2 + 64;
+		}
+	}
+	histBySeq[histBySeqLen++] = my_entry;
+
+	// The trigrams wait until the first search, scripts never need them
+	if(trigramBuckets == NULL) {
+		return 0;
+	}
+	return addTrigrams(my_entry);
+}
+
+int addTrigrams(struct HistEntry* my_entry) {
+	struct TrigramPosting* my_posting;
+	size_t line_len = strlen(my_entry->entry_line);
+
+	// Seqs only grow so every posting list stays sorted
+	for(size_t i = 0; i + 2 < line_len; i++) {
+		my_posting = findPosting(TRIGRAM(my_entry->entry_line + i), 1);
+		if(my_posting == NULL) {
+			return -1;
+		}
+		if(my_posting->len > my_posting->start && my_posting->seqs[my_posting->len - 1] == my_entry->entry_seq) {
+			continue; // Trigram repeats in this line
+		}
+		if(my_posting->len == my_posting->cap) {
+			if(my_posting->start > 0) {
+				memmove(my_posting->seqs, my_posting->seqs + my_posting->start, 
+					(my_posting->len - my_posting->start) * sizeof(unsigned int));
+				my_posting->len -= my_posting->start;
+				my_posting->start = 0;
+			}
+			else {
+				unsigned int* alloc_ret = realloc(my_posting->seqs, (my_posting->cap * 2 + 4) * sizeof(unsigned int));
+				if(alloc_ret == NULL) {
+					return -1;
+				}
+				my_posting->seqs = alloc_ret;
+				my_posting->cap = my_posting->cap * 2 + 4;
+			}
+		}
+		my_posting->seqs[my_posting->len++] = my_entry->entry_seq;
+	}
+	return 0;
+}
+
+void unindexHistEntry(struct HistEntry* my_entry) {
+	struct TrigramPosting* my_posting;
+	size_t line_len;
+
+	// The oldest entry is always first in each of its posting lists
+	if(my_entry->entry_line != NULL) {
+		line_len = strlen(my_entry->entry_line);
+		for(size_t i = 0; i + 2 < line_len; i++) {
+			my_posting = findPosting(TRIGRAM(my_entry->entry_line + i), 0);
+			if(my_posting != NULL && my_posting->start < my_posting->len 
+				&& my_posting->seqs[my_posting->start] == my_entry->entry_seq) {
+				my_posting->start++;
+				if(my_posting->start == my_posting->len) {
+					my_posting->start = 0;
+					my_posting->len = 0;
+				}
+			}
+		}
+	}
+	if(histBySeqStart < histBySeqLen && histBySeq[histBySeqStart] == my_entry) {
+		histBySeqStart++;
+	}
+	free(my_entry->entry_line);
+	my_entry->entry_line = NULL;
+}
+
+int buildTrigramIndex() {
+	trigramBuckets = calloc(TRIGRAM_BUCKETS, sizeof(struct TrigramPosting*));
+	if(trigramBuckets == NULL) {
+		fprintf(stderr, "Error building history index\n");
+		return -1;
+	}
+
+	// histBySeq is oldest first, so posting lists come out sorted
+	for(size_t i = histBySeqStart; i < histBySeqLen; i++) {
+		if(addTrigrams(histBySeq[i]) == -1) {
+			fprintf(stderr, "Error building history index\n");
+			freeTrigramIndex();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void freeTrigramIndex() {
+	if(trigramBuckets == NULL) {
+		return;
+	}
+	for(int i = 0; i < TRIGRAM_BUCKETS; i++) {
+		while(trigramBuckets[i] != NULL) {
+			struct TrigramPosting* next_posting = trigramBuckets[i]->next_posting;
+			free(trigramBuckets[i]->seqs);
+			free(trigramBuckets[i]);
+			trigramBuckets[i] = next_posting;
+		}
+	}
+	free(trigramBuckets);
+	trigramBuckets = NULL;
+}
+
+struct HistEntry* histEntryBySeq(unsigned int seq) {
+	unsigned int oldest_seq;
+	if(histBySeqStart == histBySeqLen) {
+		return NULL;
+	}
+	oldest_seq = histBySeq[histBySeqStart]->entry_seq;
+	if(seq < oldest_seq || seq - oldest_seq >= histBySeqLen - histBySeqStart) {
+		return NULL;
+	}
+	return histBySeq[histBySeqStart + (seq - oldest_seq)];
+}
+
+struct HistEntry* searchHistory(char* query, unsigned int before_seq) {
+	struct TrigramPosting* rarest = NULL;
+	struct TrigramPosting* my_posting;
+	struct HistEntry* my_entry;
+	size_t query_len = strlen(query);
+	size_t low;
+	size_t high;
+
+	if(query_len == 0) {
+		return NULL;
+	}
+
+	// Short queries have no trigram, so check entries newest first
+	if(query_len < 3) {
+		for(size_t i = histBySeqLen; i > histBySeqStart; i--) {
+			my_entry = histBySeq[i - 1];
+			if(my_entry->entry_seq < before_seq && my_entry->entry_line != NULL 
+				&& strstr(my_entry->entry_line, query) != NULL) {
+				return my_entry;
+			}
+		}
+		return NULL;
+	}
+
+	// Index the whole history on the first search
+	if(trigramBuckets == NULL && buildTrigramIndex() == -1) {
+		return NULL;
+	}
+
+	// Every match holds all of the query's trigrams, so the rarest one bounds the work
+	for(size_t i = 0; i + 2 < query_len; i++) {
+		my_posting = findPosting(TRIGRAM(query + i), 0);
+		if(my_posting == NULL || my_posting->start == my_posting->len) {
+			return NULL;
+		}
+		if(rarest == NULL || my_posting->len - my_posting->start < rarest->len - rarest->start) {
+			rarest = my_posting;
+		}
+	}
+
+	// Find where before_seq would go, then check candidates newest first
+	low = rarest->start;
+	high = rarest->len;
+	while(low < high) {
+		size_t mid = low + (high - low) / 2;
+		if(rarest->seqs[mid] < before_seq) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	while(low > rarest->start) {
+		low--;
+		my_entry = histEntryBySeq(rarest->seqs[low]);
+		if(my_entry != NULL && my_entry->entry_line != NULL && strstr(my_entry->entry_line, query) != NULL) {
+			return my_entry;
+		}
+	}
+	return NULL;
+}
+
+void freeTokenArr(TokenArr* my_tokens) {
+	for(int i = 0;i < my_tokens->token_count;i++) {
+		free(my_tokens->tokens[i]);
+	}
+	free(my_tokens->tokens);
+	poolFree(&tokenArrPool, my_tokens);
+}
+
+void removeHistEntry() {
+	struct HistEntry* hist_ptr = histTail;
+	unindexHistEntry(hist_ptr);
+	freeTokenArr(hist_ptr->entry_tokens);
+	histTail = hist_ptr->prev_entry;
+	poolFree(&histEntryPool, histTail->next_entry);
+	histTail->next_entry = NULL;
+	histSize--;
+}
+
+void freeHistory() {
+	struct HistEntry* next_entry_ptr;
+	struct HistEntry* current_entry_ptr;
+	current_entry_ptr = histHead;
+	while(current_entry_ptr != NULL) {
+		next_entry_ptr = current_entry_ptr->next_entry;
+		freeTokenArr(current_entry_ptr->entry_tokens);
+		free(current_entry_ptr->entry_line);
+		poolFree(&histEntryPool, current_entry_ptr);
+		current_entry_ptr = next_entry_ptr;
+	}
+	histHead = NULL;
+	histTail = NULL;
+	histSize = 0;
+
+	// The search index goes with the entries
+	freeTrigramIndex();
+	free(histBySeq);
+	histBySeq = NULL;
+	histBySeqStart = 0;
+	histBySeqLen = 0;
+	histBySeqCap = 0;
+}
+
+void freeShellVars() {
+	struct ShellVar* next_entry_ptr;
+	struct ShellVar* current_entry_ptr;
+	current_entry_ptr = shellLinkedListHead;
+	while(current_entry_ptr != NULL) {
+		next_entry_ptr = current_entry_ptr->next_var;
+		free(current_entry_ptr->var_name);
+		free(current_entry_ptr->var_val);
+		poolFree(&shellVarPool, current_entry_ptr);
+		current_entry_ptr = next_entry_ptr;
+	}
+	shellLinkedListHead = NULL;
+	shellLinkedListTail = NULL;
+	free(varBuckets);
+	varBuckets = NULL;
+	varBucketCount = 0;
+	varCount = 0;
+}
+
+char* getPath(TokenArr* my_tokens) {
+	char error_message[] = "Error getting path";
+	char* command_cpy;
+	char* path_env;
+	char* dir_start;
+	char* dir_end;
+	char* full_dir_ptr;
+	size_t command_len;
+	size_t dir_len;
+	command_cpy = strdup(my_tokens->tokens[0]);
+	if(command_cpy == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		return NULL;
+	}
+	
+	// Check if in wd
+	if(access(command_cpy, X_OK) == 0) {
+		return command_cpy;
+	}
+
+	path_env = getenv("PATH");
+	if(path_env == NULL) {
+		free(command_cpy);
+		return NULL;
+	}
+
+	// Sized for the longest dir in PATH so it's only allocated once
+	command_len = strlen(command_cpy);
+	full_dir_ptr = malloc(strlen(path_env) + command_len + 2);
+	if(full_dir_ptr == NULL) {
+		fprintf(stderr, "%s\n", error_message);
+		free(command_cpy);
+		return NULL;
+	}
+
+	// Walk PATH in place, an empty entry is skipped like strtok would
+	for(dir_start = path_env; *dir_start != '\0'; dir_start = dir_end + (*dir_end == ':')) {
+		dir_end = strchrnul(dir_start, ':');
+		dir_len = dir_end - dir_start;
+		if(dir_len == 0) {
+			continue;
+		}
+
+		// Concat for full path
+		memcpy(full_dir_ptr, dir_start, dir_len);
+		full_dir_ptr[dir_len] = '/';
+		memcpy(full_dir_ptr + dir_len + 1, command_cpy, command_len + 1);
+		
+		// Check for exec access
+		if(access(full_dir_ptr, X_OK) == 0) {
+			free(command_cpy);
+			return full_dir_ptr;
+		}
+	}
+	free(full_dir_ptr);
+	free(command_cpy);
+	return NULL; // No path found
+}
+
+char* getRedirect(char* my_token) {
+	// Quoted < and > are part of a word
+	if(findUnquoted(my_token, "&>>") != NULL) {
+		return "&>>";
+	}
+	else if (findUnquoted(my_token, "&>") != NULL) {
+		return "&>";
+	}
+	else if(findUnquoted(my_token, ">>") != NULL) {
+		return ">>";
+	}
+	else if(findUnquoted(my_token, ">") != NULL) {
+		return ">";
+	}
+	else if(findUnquoted(my_token, "<") != NULL) {
+		return "<";
+	}
+	else {
+		return NULL;
+	}
+}
+
+int outputAppend(char* lhs, char* rhs) {
+	int lhs_file = atoi(lhs);
+	int ret_val;
+	int rhs_file = open(rhs, O_WRONLY | O_CREAT | O_APPEND, 
+	S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+
+	// Error checking
+	if(lhs_file < 0 || rhs_file == -1) {
+		return -1;
+	}
+
+	// Redirect lhs to rhs
+	original_desc = lhs_file;
+	new_desc = dup(original_desc);
+	ret_val = dup2(rhs_file, lhs_file);
+
+	// The lhs fd now holds the file so the opened fd isn't needed
+	if(rhs_file != lhs_file) {
+		close(rhs_file);
+	}
+	return ret_val;
+}
+
+int inputRedirect(char* lhs, char* rhs) {
+	int lhs_file = atoi(lhs);
+	int ret_val;
+	int rhs_file = open(rhs, O_RDONLY);	
+
+	// Error checking
+	if(rhs_file == -1 || lhs_file < 0) {
+		return -1;
+	}
+
+	// Redirect rhs as input to lhs
+	original_desc = lhs_file;
+	new_desc = dup(original_desc);
+	ret_val = dup2(rhs_file, lhs_file);
+
+	// The lhs fd now holds the file so the opened fd isn't needed
+	if(rhs_file != lhs_file) {
+		close(rhs_file);
+	}
+	return ret_val;
+}
+
+int outputRedirect(char* lhs, char* rhs) {
+	int lhs_file = atoi(lhs);
+	int ret_val;
+	int rhs_file = open(rhs, O_WRONLY | O_TRUNC | O_CREAT,
+	 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+
+	// Error checking
+	if(lhs_file < 0 || rhs_file == -1) {
+		return -1;
+	}
+
+	// Redirect lhs to rhs
+	original_desc = lhs_file;
+	new_desc = dup(original_desc);
+	ret_val = dup2(rhs_file, lhs_file);
+
+	// The lhs fd now holds the file so the opened fd isn't needed
+	if(rhs_file != lhs_file) {
+		close(rhs_file);
+	}
+	return ret_val;
+}
+
+int outputErrRedirect(char* rhs) {
+	int ret_val;
+	int rhs_file = open(rhs, O_WRONLY| O_TRUNC | O_CREAT,
+		 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+
+	if(rhs_file == -1) {
+		return -1;
+	}
+
+	// Redirect stdout to rhs
+	original_desc = 1;
+	new_desc = dup(original_desc);
+	ret_val = dup2(rhs_file, 1);
+	if(ret_val == -1) {
+		close(rhs_file);
+		return -1;
+	}
+
+	// Redirect stderr to rhs
+	second_original_desc = 2;
+	second_new_desc = dup(second_original_desc);
+	ret_val = dup2(rhs_file, 2);
+	if(rhs_file != 1 && rhs_file != 2) {
+		close(rhs_file);
+	}
+	if(ret_val == -1) {
+		return -1;
+	}
+	return 0;	 
+}
+
+int outputErrAppend(char* rhs) {
+	int ret_val;
+		int rhs_file = open(rhs, O_WRONLY| O_APPEND | O_CREAT,
+			 S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP );
+	
+	if(rhs_file == -1) {
+		return -1;
+	}
+
+	// Redirect stdout to rhs
+	original_desc = 1;
+	new_desc = dup(original_desc);
+	ret_val = dup2(rhs_file, 1);
+	if(ret_val == -1) {
+		close(rhs_file);
+		return -1;
+	}
+
+	// Redirect stderr to rhs
+	second_original_desc = 2;
+	second_new_desc = dup(second_original_desc);
+	ret_val = dup2(rhs_file, 2);
+	if(rhs_file != 1 && rhs_file != 2) {
+		close(rhs_file);
+	}
+	if(ret_val == -1) {
+		return -1;
+	}
+	return 0;	  
+}
+
+void restoreFileDescs() {
+	fflush(stdout); // Builtin output still buffered belongs to the redirect
+	if(original_desc != -1 && new_desc != -1) {
+		dropRedirectBuffers();
+		dup2(new_desc, original_desc);
+		close(new_desc);
+		original_desc = -1;
+		new_desc = -1;
+	}
+	if(second_original_desc != -1 && second_new_desc != -1) {
+		dup2(second_new_desc, second_original_desc);
+		close(second_new_desc);
+		second_original_desc = -1;
+		second_new_desc = -1;
+	}
+}
+
+int parseRedirect(char* my_redirect, char* token_copy, char** lhs, char** rhs) {
+	*lhs = NULL;
+	*rhs = NULL;
+
+	// Two token redirections
+	if(strcmp(my_redirect, "<") == 0 || strcmp(my_redirect, ">") == 0 || strcmp(my_redirect, ">>") == 0) {
+		if(token_copy[0] == '>') {
+			*lhs = "1";
+			*rhs = strtok(token_copy, my_redirect);
+		}
+		else if(token_copy[0] == '<') {
+			*lhs = "0";
+			*rhs = strtok(token_copy, my_redirect);
+		}
+		else {
+			*lhs = strtok(token_copy, my_redirect);
+			*rhs = strtok(NULL, my_redirect);
+		}
+		return (*lhs == NULL || *rhs == NULL) ? -1 : 0;
+	} 
+
+	// One token redirection
+	else if(strcmp(my_redirect, "&>") == 0 || strcmp(my_redirect, "&>>") == 0) {
+
+		// No tokens on LHS
+		if(token_copy[0] != '&') {
+			return -1;
+		}
+		*rhs = strtok(token_copy, my_redirect);	
+		return *rhs == NULL ? -1 : 0; // Check for strtok error
+	} 
+	return -1;
+}
+
+int isTeeRedirect(char* my_token) {
+	return my_token[0] == '|' && my_token[1] == '>';
+}
+
+int addTeeFile(struct TeeStage* my_tee, char* my_token) {
+	int append = my_token[2] == '>';
+	char* file_path = my_token + 2 + append;
+	int file_fd;
+
+	dequoteString(file_path);
+	if(file_path[0] == '\0') {
+		fprintf(stderr, "Error, |> needs a file\n");
+		return -1;
+	}
+	if(my_tee->file_count == TEE_MAX_FILES) {
+		fprintf(stderr, "Error, at most %d |> files\n", TEE_MAX_FILES);
+		return -1;
+	}
+
+	// splice can't write to O_APPEND files so appends seek to the end instead
+	file_fd = open(file_path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 
+		S_IRUSR | S_IWUSR | S_IWGRP | S_IRGRP);
+	if(file_fd == -1 || (append && lseek(file_fd, 0, SEEK_END) == -1)) {
+		fprintf(stderr, "Error opening %s\n", file_path);
+		if(file_fd != -1) {
+			close(file_fd);
+		}
+		return -1;
+	}
+
+	// Tokens are stripped from the end so files are stored in reverse
+	memmove(my_tee->file_fds + 1, my_tee->file_fds, my_tee->file_count * sizeof(int));
+	my_tee->file_fds[0] = file_fd;
+	my_tee->file_count++;
+	return 0;
+}
+
+int startTee(struct TeeStage* my_tee) {
+	int cmd_pipe[2];
+
+	my_tee->in_fd = -1;
+	my_tee->out_fd = -1;
+	my_tee->saved_stdout = -1;
+	my_tee->side_pipe[0] = -1;
+	my_tee->side_pipe[1] = -1;
+	if(posix_memalign((void**)&my_tee->buf, TEE_BUF_ALIGN, TEE_PIPE_SIZE) != 0) {
+		my_tee->buf = NULL;
+		fprintf(stderr, "Error allocating tee buffer\n");
+		return -1;
+	}
+
+	// Big pipes so the command rarely waits on the writer
+	fflush(stdout);
+	if(pipe2(cmd_pipe, O_CLOEXEC) == -1) {
+		fprintf(stderr, "Error making tee pipes\n");
+		return -1;
+	}
+	my_tee->in_fd = cmd_pipe[0]; // Each fd goes in my_tee once made so freeTee closes it
+	if(pipe2(my_tee->side_pipe, O_CLOEXEC) == -1) {
+		fprintf(stderr, "Error making tee pipes\n");
+		close(cmd_pipe[1]);
+		return -1;
+	}
+	fcntl(cmd_pipe[0], F_SETPIPE_SZ, TEE_PIPE_SIZE);
+	fcntl(my_tee->side_pipe[0], F_SETPIPE_SZ, TEE_PIPE_SIZE);
+	my_tee->out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	my_tee->saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	if(my_tee->out_fd == -1 || my_tee->saved_stdout == -1 || dup2(cmd_pipe[1], STDOUT_FILENO) == -1) {
+		fprintf(stderr, "Error starting tee\n");
+		close(cmd_pipe[1]);
+		return -1;
+	}
+	close(cmd_pipe[1]);
+	if(my_tee->detached) {
+		__atomic_add_fetch(&tee_writers, 1, __ATOMIC_RELEASE);
+	}
+	if(pthread_create(&my_tee->writer, NULL, teeWriter, my_tee) != 0) {
+		fprintf(stderr, "Error starting tee writer\n");
+		dup2(my_tee->saved_stdout, STDOUT_FILENO);
+		if(my_tee->detached) {
+			__atomic_sub_fetch(&tee_writers, 1, __ATOMIC_RELEASE);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+void stopTee(struct TeeStage* my_tee) {
+	pthread_t writer = my_tee->writer;
+	int saved_stdout = my_tee->saved_stdout;
+	int detached = my_tee->detached;
+
+	// A & job's writer can free the stage as soon as the pipe is let go
+	my_tee->saved_stdout = -1;
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	if(detached) {
+		pthread_detach(writer);
+		return;
+	}
+	pthread_join(writer, NULL);
+	freeTee(my_tee);
+}
+
+void* teeWriter(void* tee_arg) {
+	struct TeeStage* my_tee = tee_arg;
+	ssize_t chunk_len;
+	int copied;
+
+	while(1) {
+		// Waits for data, tee only copies it so the chunk stays for the other targets
+		chunk_len = tee(my_tee->in_fd, my_tee->side_pipe[1], TEE_PIPE_SIZE, 0);
+		if(chunk_len == -1 && errno == EINTR) {
+			continue;
+		}
+		if(chunk_len <= 0) {
+			break;
+		}
+		drainPipe(my_tee->side_pipe[0], my_tee->file_fds[0], chunk_len, my_tee->buf);
+
+		// Later files get their own tee of the chunk, a short one falls back to a copy in buf
+		copied = 0;
+		for(int i = 1; i < my_tee->file_count; i++) {
+			ssize_t tee_len = copied ? 0 : tee(my_tee->in_fd, my_tee->side_pipe[1], chunk_len, 0);
+			if(tee_len == chunk_len) {
+				drainPipe(my_tee->side_pipe[0], my_tee->file_fds[i], chunk_len, my_tee->buf);
+				continue;
+			}
+			if(tee_len > 0) {
+				drainPipe(my_tee->side_pipe[0], -1, tee_len, my_tee->buf);
+			}
+			if(!copied) {
+				drainPipe(my_tee->in_fd, -1, chunk_len, my_tee->buf);
+				copied = 1;
+			}
+			drainPipe(-1, my_tee->file_fds[i], chunk_len, my_tee->buf);
+		}
+
+		// The chunk only leaves the pipe once every file has it
+		drainPipe(copied ? -1 : my_tee->in_fd, my_tee->out_fd, chunk_len, my_tee->buf);
+	}
+	if(my_tee->detached) {
+		freeTee(my_tee);
+		pthread_mutex_lock(&tee_writers_lock);
+		if(__atomic_sub_fetch(&tee_writers, 1, __ATOMIC_RELEASE) == 0) {
+			pthread_cond_broadcast(&tee_writers_done);
+		}
+		pthread_mutex_unlock(&tee_writers_lock);
+	}
+	return NULL;
+}
+
+void waitTeeWriters() {
+	pthread_mutex_lock(&tee_writers_lock);
+	while(__atomic_load_n(&tee_writers, __ATOMIC_ACQUIRE) > 0) {
+		pthread_cond_wait(&tee_writers_done, &tee_writers_lock);
+	}
+	pthread_mutex_unlock(&tee_writers_lock);
+}
+
+int drainPipe(int pipe_fd, int out_fd, size_t len, char* buf) {
+	size_t moved = 0;
+	ssize_t move_len;
+
+	// Straight from the pipe's pages to out_fd without a copy through the thread
+	while(pipe_fd != -1 && out_fd != -1 && moved < len) {
+		move_len = splice(pipe_fd, NULL, out_fd, NULL, len - moved, SPLICE_F_MOVE);
+		if(move_len <= 0) {
+			if(move_len == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		moved += move_len;
+	}
+
+	// What splice can't take goes through buf, with pipe_fd -1 it is already there
+	while(moved < len) {
+		move_len = len - moved;
+		if(pipe_fd != -1) {
+			move_len = read(pipe_fd, buf + moved, len - moved);
+			if(move_len <= 0) {
+				return -1;
+			}
+		}
+		for(size_t written = 0; out_fd != -1 && written < (size_t)move_len;) {
+			ssize_t write_len = write(out_fd, buf + moved + written, move_len - written);
+			if(write_len <= 0) {
+				out_fd = -1; // Keep draining so the command never blocks on a full pipe
+				break;
+			}
+			written += write_len;
+		}
+		moved += move_len;
+	}
+	return 0;
+}
+
+void freeTee(struct TeeStage* my_tee) {
+	if(my_tee == NULL) {
+		return;
+	}
+	int stage_fds[] = {my_tee->in_fd, my_tee->out_fd, my_tee->saved_stdout, my_tee->side_pipe[0], my_tee->side_pipe[1]};
+	for(size_t i = 0; i < sizeof(stage_fds) / sizeof(int); i++) {
+		if(stage_fds[i] > 0) {
+			close(stage_fds[i]);
+		}
+	}
+	for(int i = 0; i < my_tee->file_count; i++) {
+		close(my_tee->file_fds[i]);
+	}
+	free(my_tee->buf);
+	free(my_tee);
+}
+
+int performRedirect(char* my_redirect, char* my_token) {
+	int ret_val = 0;
+	char* lhs;
+	char* rhs;
+	char* token_copy;
+	token_copy = strdup(my_token);
+	if(token_copy == NULL) {
+		return -1;
+	}
+
+	if(parseRedirect(my_redirect, token_copy, &lhs, &rhs) == -1) {
+		free(token_copy);
+		return -1;
+	}
+	dequoteString(rhs); // File names can be quoted
+
+	// Checking different redirs
+	if(strcmp(my_redirect,"<") == 0) {
+		ret_val = inputRedirect(lhs,rhs);
+	}
+	else if(strcmp(my_redirect, ">") == 0) {
+		ret_val = outputRedirect(lhs, rhs);
+	}
+	else if(strcmp(my_redirect, ">>") == 0) {
+		ret_val = outputAppend(lhs, rhs);
+	}
+	else if(strcmp(my_redirect, "&>") == 0) {
+		ret_val = outputErrRedirect(rhs);
+	}
+	else {
+		ret_val =  outputErrAppend(rhs);
+	}
+	free(token_copy);
+	return ret_val;
+}
+
+int runCommand(TokenArr* my_tokens) {
+	char* my_command = my_tokens->tokens[0];
+	char* path_val;
+	int fork_val;
+	int stopped;
+	int ret_val;
+	int built_in_val;
+	struct ShellFunc* my_func = findShellFunc(funcBuckets, my_command);
+
+	// Functions come before builtins and PATH
+	if(my_func != NULL) {
+		return background_flag ? backgroundShellFunc(my_func, my_tokens) : callShellFunc(my_func, my_tokens);
+	}
+	built_in_val = checkBuiltIn(my_command);
+
+	// du flags the builtin doesn't have are left to the du on PATH
+	if(built_in_val == DU) {
+		int walk_mode;
+		int human_sizes;
+		if(parseDuFlags(my_tokens, &walk_mode, &human_sizes) == -1) {
+			built_in_val = -1;
+		}
+	}
+	switch(built_in_val) {
+
+		// Non built in command
+		case -1: 
+	
+			path_val = getPath(my_tokens);
+			if(path_val == NULL) {
+				fprintf(stderr, "Not a valid command\n");
+				return -1;
+			}
+
+			// Nothing in the script runs after this so the command can take over the shell
+			if(tail_exec && func_depth == 0 && source_depth == 0 && child_timeout_ms < 0 && !profile_on 
+				&& __atomic_load_n(&tee_writers, __ATOMIC_ACQUIRE) == 0) {
+				execInPlace(path_val, my_tokens); // Forks as usual if this fails
+			}
+
+			fflush(stdout); // Builtin output comes before the child's
+			if(readBuffers != NULL) {
+				syncReadBuffers();
+			}
+			fork_val = fork();
+			spawn_count += fork_val > 0;
+
+			// Parent
+			if(fork_val > 0) { 
+				addHistEntry(my_tokens);
+				free(path_val);
+
+				// Set in both processes so neither can race the other
+				if(job_control) {
+					setpgid(fork_val, fork_val);
+				}
+				if(background_flag) {
+					return addBgJob(fork_val, my_tokens, JOB_RUNNING);
+				}
+				giveTerminal(fork_val);
+				ret_val = waitChild(fork_val, &stopped);
+				giveTerminal(shell_pgid);
+				if(stopped) {
+					addBgJob(fork_val, my_tokens, JOB_STOPPED);
+				}
+				return ret_val;
+			}
+			
+			 // Child
+			else if(fork_val == 0) {
+				// The shell blocks SIGCHLD for its signalfd
+				if(epoll_fd != -1) {
+					sigprocmask(SIG_SETMASK, &shell_orig_mask, NULL);
+				}
+				setupChildJob();
+				if(applyChildLimits() == -1) {
+					fprintf(stderr, "Error applying ulimit settings\n");
+					_exit(126);
+				}
+				if(applyChildSched() == -1) {
+					fprintf(stderr, "Error applying scheduling settings\n");
+					_exit(126);
+				}
+				execve(path_val, my_tokens->tokens, environ);
+				
+				// Never fall back into a second copy of the shell
+				fprintf(stderr, "Error executing %s\n", path_val);
+				_exit(127);
+			}
+
+			// ERROR
+			else { 
+				fprintf(stderr, "Error executing in child\n");
+				return -1;
+			}
+			break;
+			
+		case EXIT: // exit
+
+			// Checking for zero flags or parameters
+			if(my_tokens->token_count > 1) {
+				fprintf(stderr, "Error, exit should be used with no parameters\n");
+				return -1;
+			}
+			else {
+				exit_requested = 1; // Exits once the line's tokens are freed
+				return exit_global;
+			}
+			break;
+			
+		case LS: // ls
+		
+			// Only -R takes a param
+			if(my_tokens->token_count > 1 && strcmp(my_tokens->tokens[1], "-R") == 0 && my_tokens->token_count <= 3) {
+				return wshWalk(my_tokens->token_count == 3 ? my_tokens->tokens[2] : NULL, WALK_LIST, 0);
+			}
+			if(my_tokens->token_count > 1) {
+				fprintf(stderr, "Error, ls should be used with no parameters\n");
+				return -1;
+			}
+			else{
+				return wshLs();
+			}
+			break;
+		case CD: // cd
+
+			// Checking for exactly one arg
+			if(my_tokens->token_count != 2) {
+				fprintf(stderr, "Error, cd should be used with a single argument\n");
+				return -1;
+			}
+			else {
+				return wshCd(my_tokens->tokens[1]);
+			}
+			break;
+			
+		case PWD: // pwd
+			if(my_tokens->token_count > 2 || (my_tokens->token_count == 2 
+				&& strcmp(my_tokens->tokens[1], "-P") != 0 && strcmp(my_tokens->tokens[1], "-L") != 0)) {
+				fprintf(stderr, "Error, pwd should be of form pwd [-L|-P]\n");
+				return -1;
+			}
+			return wshPwd(my_tokens->token_count == 2 && strcmp(my_tokens->tokens[1], "-P") == 0);
+
+		case EXPORT:
+		case LOCAL: 
+			// Always uses form export/local x=(y)
+			if(my_tokens->token_count != 2) {
+				fprintf(stderr, "Error, command should be of form export/local VAR=value\n");
+				return -1;
+			}
+			if(my_tokens->tokens[1][0] == '=') {
+				fprintf(stderr, "Error, can't have empty lhs in var assignment\n");
+				return -1;
+			}
+		
+			char* var_name;
+			char* var_val;
+			
+			// Split at the first unquoted = so values can hold more
+			var_name = my_tokens->tokens[1];
+			var_val = findUnquoted(var_name, "=");
+			if(var_val == NULL) {
+				var_val = "";
+			}
+			else {
+				*var_val++ = '\0';
+			}
+
+			// Putting these values into a token arr, every failure frees it whole
+			char* name_val[] = {var_name, var_val, NULL};
+			TokenArr name_val_arr = {2, name_val};
+			TokenArr* var_toks = copyTokenArr(&name_val_arr);
+			if(var_toks == NULL) {
+				fprintf(stderr, "Error, Failed to assign var\n");
+				return -1;
+			}
+
+			// Substituting any vars
+			if(substituteShellVars(var_toks) == -1) {
+				fprintf(stderr, "Error, Failed to assign var\n");
+				freeTokenArr(var_toks);
+				return -1;
+			}
+
+			// Reassign the tokens
+			var_name = var_toks->tokens[0];
+			var_val = var_toks->tokens[1];
+			dequoteString(var_name);
+			dequoteString(var_val);
+
+			if(built_in_val == LOCAL) {
+				ret_val = wshLocal(var_name, var_val);
+			}	
+			else {
+				ret_val = wshExport(var_name, var_val);
+			}
+			freeTokenArr(var_toks);
+			return ret_val;
+			break;	
+				
+		case VARS: // vars
+
+			// Checking vars is run on its own
+			if(my_tokens->token_count != 1) {
+				fprintf(stderr, "Invalid user of vars\n");
+				return -1;
+			}
+			else {
+				return wshVars();
+			}
+			break;	
+
+		case HISTORY: // history
+
+			// Prints list of previous commands
+			if(my_tokens->token_count == 1) {
+				return wshGetHist();
+			}
+
+			// Case where size is set
+			else if(my_tokens->token_count == 3) {
+
+				// Fail is second token isnt 'set'
+				if(strcmp(my_tokens->tokens[1],"set") !=0) {
+					fprintf(stderr, "Invalid input for history\n");
+					return -1;
+				}
+				else {
+				int my_val;
+					my_val = atoi(my_tokens->tokens[2]);
+					
+					// History size cant be <=0 also handles atoi error
+					if(my_val <= 0 ) { 
+						fprintf(stderr, "Invalid input for history\n");
+						return -1;
+					}
+					else {
+						return wshSetHist(my_val);
+					}
+				}
+			}
+			else if(my_tokens->token_count == 2) {
+				int my_val;
+				my_val = atoi(my_tokens->tokens[1]);
+
+				// Check size is > 0 and atoi retval is good
+				if(my_val <=0 || my_val > histSize) {
+					fprintf(stderr, "Invalid input for history\n");
+					return -1;
+				}
+				else {
+					struct HistEntry* my_entry = getHistEntry(my_val);
+					char* saved_line = hist_line;
+
+					// The new entry keeps the recalled entry's line, it is copied before the old one can go
+					hist_line = my_entry->entry_line;
+					if(!profile_on) {
+						ret_val = runCommand(my_entry->entry_tokens);
+						hist_line = saved_line;
+						return ret_val;
+					}
+
+					// Recalls are kept apart by the command they ran
+					char frame_label[strlen(my_entry->entry_line) + 10];
+					sprintf(frame_label, "history: %s", my_entry->entry_line);
+					profileEnter(frame_label, NULL, NULL);
+					ret_val = runCommand(my_entry->entry_tokens);
+					profileLeave();
+					hist_line = saved_line;
+					return ret_val;
+				}
+			}
+			break;
+
+		case SET: // set
+
+			// Only errexit is supported
+			if(my_tokens->token_count != 2) {
+				fprintf(stderr, "Error, set should be used as set -e or set +e\n");
+				return -1;
+			}
+			return wshSet(my_tokens->tokens[1]);
+
+		case TIMEOUT: // timeout
+
+			// Needs a time and a command to run
+			if(my_tokens->token_count < 3) {
+				fprintf(stderr, "Error, timeout should be used as timeout SECS command\n");
+				return -1;
+			}
+			else {
+				char* end_ptr;
+				double secs = strtod(my_tokens->tokens[1], &end_ptr);
+				if(*end_ptr != '\0' || end_ptr == my_tokens->tokens[1] || secs <= 0) {
+					fprintf(stderr, "Error, invalid timeout %s\n", my_tokens->tokens[1]);
+					return -1;
+				}
+				return wshTimeout((long)(secs * 1000), my_tokens);
+			}
+			break;
+
+		case ULIMIT: // ulimit
+
+			if(my_tokens->token_count == 1) {
+				return wshUlimit(0, NULL);
+			}
+			else if(my_tokens->token_count <= 3 && my_tokens->tokens[1][0] == '-' 
+				&& strlen(my_tokens->tokens[1]) == 2) {
+				return wshUlimit(my_tokens->tokens[1][1], my_tokens->tokens[2]);
+			}
+			else {
+				fprintf(stderr, "Error, ulimit should be used as ulimit [-t|-v|-n [value]]\n");
+				return -1;
+			}
+			break;
+
+		case CPUS: // cpus
+
+			// Needs a cpu list and a command to run
+			if(my_tokens->token_count < 3) {
+				fprintf(stderr, "Error, cpus should be used as cpus LIST command\n");
+				return -1;
+			}
+			return wshCpus(my_tokens->tokens[1], my_tokens);
+
+		case NICE: // nice
+
+			// Uses the form nice [-n N | -N | N] command, like coreutils the default is 10
+			if(my_tokens->token_count < 2) {
+				fprintf(stderr, "Error, nice should be used as nice [-n N] command\n");
+				return -1;
+			}
+			else {
+				char* nice_arg = NULL;
+				int shift = 2;
+				if(strcmp(my_tokens->tokens[1], "-n") == 0) {
+					nice_arg = my_tokens->token_count > 2 ? my_tokens->tokens[2] : NULL;
+					shift = 3;
+				}
+				else if(my_tokens->tokens[1][0] == '-') {
+					// -N raises by N and --N lowers by N
+					nice_arg = my_tokens->tokens[1] + 1;
+				}
+				else if(isdigit((unsigned char)my_tokens->tokens[1][0])) {
+					nice_arg = my_tokens->tokens[1];
+				}
+				else {
+					return wshNice(10, 1, my_tokens);
+				}
+
+				char* end_ptr;
+				long nice_val = nice_arg == NULL ? 0 : strtol(nice_arg, &end_ptr, 10);
+				if(nice_arg == NULL || *end_ptr != '\0' || end_ptr == nice_arg || nice_val < -40 || nice_val > 40) {
+					fprintf(stderr, "Error, invalid nice value %s\n", nice_arg == NULL ? "" : nice_arg);
+					return -1;
+				}
+				if(my_tokens->token_count <= shift) {
+					fprintf(stderr, "Error, nice should be used as nice [-n N] command\n");
+					return -1;
+				}
+				return wshNice((int)nice_val, shift, my_tokens);
+			}
+			break;
+
+		case IONICE: // ionice
+
+			// Uses the form ionice -c CLASS [-n LEVEL] command
+			if(my_tokens->token_count < 4 || strcmp(my_tokens->tokens[1], "-c") != 0) {
+				fprintf(stderr, "Error, ionice should be used as ionice -c CLASS [-n LEVEL] command\n");
+				return -1;
+			}
+			else {
+				int io_class = atoi(my_tokens->tokens[2]);
+				int io_level = 0;
+				int shift = 3;
+				if(strcmp(my_tokens->tokens[3], "-n") == 0) {
+					if(my_tokens->token_count < 6) {
+						fprintf(stderr, "Error, ionice should be used as ionice -c CLASS [-n LEVEL] command\n");
+						return -1;
+					}
+					io_level = atoi(my_tokens->tokens[4]);
+					shift = 5;
+				}
+
+				// Classes are realtime, best-effort and idle
+				if(io_class < 1 || io_class > 3 || io_level < 0 || io_level > 7) {
+					fprintf(stderr, "Error, invalid ionice class or level\n");
+					return -1;
+				}
+				return wshIonice(io_class, io_level, shift, my_tokens);
+			}
+			break;
+
+		case JOBS: // jobs
+
+			// Checking for zero flags or parameters
+			if(my_tokens->token_count > 1) {
+				fprintf(stderr, "Error, jobs should be used with no parameters\n");
+				return -1;
+			}
+			return wshJobs();
+
+		case FG: // fg
+		case BG: // bg
+
+			// Takes an optional job such as %1
+			if(my_tokens->token_count > 2) {
+				fprintf(stderr, "Error, %s should be used as %s [%%job]\n", my_command, my_command);
+				return -1;
+			}
+			else {
+				char* job_arg = my_tokens->token_count == 2 ? my_tokens->tokens[1] : NULL;
+				return built_in_val == FG ? wshFg(job_arg) : wshBg(job_arg);
+			}
+			break;
+
+		case MEM: // mem
+
+			// Checking for zero flags or parameters
+			if(my_tokens->token_count > 1) {
+				fprintf(stderr, "Error, mem should be used with no parameters\n");
+				return -1;
+			}
+			return wshMem();
+
+		case SOURCE: // source
+		case SOURCE_DOT: // .
+
+			// Checking for exactly one file
+			if(my_tokens->token_count != 2) {
+				fprintf(stderr, "Error, %s should be used as %s FILE\n", my_command, my_command);
+				return -1;
+			}
+			return wshSource(my_tokens->tokens[1]);
+
+		case ALIAS: // alias
+			return wshAlias(my_tokens);
+
+		case EACH: // each
+			return wshEach(my_tokens);
+
+		case LET: // let
+			return wshLet(my_tokens);
+
+		case READ: // read
+			return wshRead(my_tokens);
+
+		case STATE: // state
+			return wshState(my_tokens);
+
+		case EXEC: // exec
+			return wshExec(my_tokens);
+
+		case DU: // du
+			return wshDu(my_tokens);
+
+		case UNALIAS: // unalias
+
+			// Checking for exactly one name
+			if(my_tokens->token_count != 2) {
+				fprintf(stderr, "Error, unalias should be used as unalias NAME\n");
+				return -1;
+			}
+			return wshUnalias(my_tokens->tokens[1]);
+	}
+	return 0;
+}
+
+int wshLocal(char* var_name, char* var_val) {
+	char error_message[] = "Error adding shell var";
+	struct ShellVar* shell_var_ptr;
+	size_t bucket;
+	size_t val_len;
+	shell_var_ptr = findShellVar(var_name);
+
+	// Var isn't set yet so append it to keep the added order
+	if(shell_var_ptr == NULL) {
+
+		// Keep chains short by growing at an average of two vars a bucket
+		if(varCount >= varBucketCount * 2 && growVarBuckets() == -1) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+
+		shell_var_ptr = poolAlloc(&shellVarPool);
+		if(shell_var_ptr == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+		shell_var_ptr->var_name = strdup(var_name);
+		if(shell_var_ptr->var_name == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			poolFree(&shellVarPool, shell_var_ptr);
+			return -1;
+		}
+		shell_var_ptr->var_val = NULL;
+		shell_var_ptr->next_var = NULL;
+		if(shellLinkedListHead == NULL) {
+			shellLinkedListHead = shell_var_ptr;
+		}
+		else {
+			shellLinkedListTail->next_var = shell_var_ptr;
+		}
+		shellLinkedListTail = shell_var_ptr; // Set new tail
+		bucket = hashVarName(var_name) & (varBucketCount - 1);
+		shell_var_ptr->next_bucket = varBuckets[bucket];
+		varBuckets[bucket] = shell_var_ptr;
+		varCount++;
+	}
+	
+	// Copy val into the var, reusing its buffer when the new val fits
+	val_len = strlen(var_val);
+	if(shell_var_ptr->var_val == NULL || val_len > strlen(shell_var_ptr->var_val)) {
+		char* alloc_ret = realloc(shell_var_ptr->var_val, val_len + 1);
+		if(alloc_ret == NULL) {
+			fprintf(stderr, "%s\n", error_message);
+			return -1;
+		}
+		shell_var_ptr->var_val = alloc_ret;
+	}
+	memcpy(shell_var_ptr->var_val, var_val, val_len + 1);
+	shell_var_ptr->num_valid = 0;
+	return 0;	
+}
+
+int wshSet(char* my_option) {
+	if(strcmp(my_option, "-e") == 0) {
+		errexit_flag = 1;
+	}
+	else if(strcmp(my_option, "+e") == 0) {
+		errexit_flag = 0;
+	}
+	else {
+		fprintf(stderr, "Error, unknown set option %s\n", my_option);
+		return -1;
+	}
+	return 0;
+}
+
+int wshTimeout(long timeout_ms, TokenArr* my_tokens) {
+	int ret_val;
+
+	// Only applies to the external command this runs
+	child_timeout_ms = timeout_ms;
+	ret_val = runShifted(my_tokens, 2);
+	child_timeout_ms = -1;
+	return ret_val;
+}
+
+int wshCpus(char* cpu_list, TokenArr* my_tokens) {
+	int ret_val;
+	struct ChildSched saved_sched = childSched;
+
+	if(parseCpuList(cpu_list, &childSched.cpus) == -1) {
+		fprintf(stderr, "Error, invalid cpu list %s\n", cpu_list);
+		childSched = saved_sched;
+		return -1;
+	}
+	childSched.cpus_set = 1;
+	ret_val = runShifted(my_tokens, 2);
+	childSched = saved_sched;
+	return ret_val;
+}
+
+int wshNice(int nice_val, int shift, TokenArr* my_tokens) {
+	int ret_val;
+	struct ChildSched saved_sched = childSched;
+
+	childSched.nice_val = nice_val;
+	childSched.nice_set = 1;
+	ret_val = runShifted(my_tokens, shift);
+	childSched = saved_sched;
+	return ret_val;
+}
+
+int wshIonice(int io_class, int io_level, int shift, TokenArr* my_tokens) {
+	int ret_val;
+	struct ChildSched saved_sched = childSched;
+
+	childSched.ioprio = (io_class << IOPRIO_CLASS_SHIFT) | io_level;
+	childSched.ioprio_set = 1;
+	ret_val = runShifted(my_tokens, shift);
+	childSched = saved_sched;
+	return ret_val;
+}
+
+int wshJobs() {
+	struct BgJob* my_job;
+
+	// Oldest first, the list is newest first
+	for(int job_id = 1; job_id < nextJobId; job_id++) {
+		for(my_job = bgJobHead; my_job != NULL; my_job = my_job->next_job) {
+			if(my_job->job_id == job_id) {
+				printJob(my_job, my_job->job_state == JOB_STOPPED ? "Stopped" : "Running");
+			}
+		}
+	}
+	return 0;
+}
+
+int wshFg(char* job_arg) {
+	struct BgJob* my_job = findJob(job_arg);
+	int stopped;
+	int ret_val;
+	if(my_job == NULL) {
+		fprintf(stderr, "Error, no such job %s\n", job_arg == NULL ? "current" : job_arg);
+		return -1;
+	}
+
+	// Show what's being resumed
+	for(int i = 0; i < my_job->job_tokens->token_count; i++) {
+		printf(i == 0 ? "%s" : " %s", my_job->job_tokens->tokens[i]);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	giveTerminal(my_job->job_pgid);
+	if(signalJob(my_job, SIGCONT) == -1 && errno != ESRCH) {
+		giveTerminal(shell_pgid);
+		fprintf(stderr, "Error continuing job\n");
+		return -1;
+	}
+	my_job->job_state = JOB_RUNNING;
+	ret_val = waitChild(my_job->job_pid, &stopped);
+	giveTerminal(shell_pgid);
+
+	// Stopped again so it stays in the list
+	if(stopped) {
+		my_job->job_state = JOB_STOPPED;
+		printf("\n");
+		printJob(my_job, "Stopped");
+		return ret_val;
+	}
+	removeJob(my_job);
+	return ret_val;
+}
+
+int wshBg(char* job_arg) {
+	struct BgJob* my_job = findJob(job_arg);
+	if(my_job == NULL) {
+		fprintf(stderr, "Error, no such job %s\n", job_arg == NULL ? "current" : job_arg);
+		return -1;
+	}
+	if(signalJob(my_job, SIGCONT) == -1) {
+		fprintf(stderr, "Error continuing job\n");
+		return -1;
+	}
+	my_job->job_state = JOB_RUNNING;
+	printJob(my_job, "Running");
+	return 0;
+}
+
+int wshSource(char* file_path) {
+	struct SourceFile* my_file;
+	TokenArr* line_tokens;
+	char frame_label[PATH_MAX + 16];
+	int saved_descs[4];
+
+	if(source_depth >= SOURCE_MAX_DEPTH) {
+		fprintf(stderr, "Error, source nested more than %d deep\n", SOURCE_MAX_DEPTH);
+		return -1;
+	}
+	my_file = getSourceFile(file_path);
+	if(my_file == NULL) {
+		return -1;
+	}
+
+	// Lines get their own redirects, the source's own is put back after
+	stashFileDescs(saved_descs);
+	my_file->use_count++;
+	source_depth++;
+	for(int i = 0; i < my_file->line_count && !exit_requested; i++) {
+		if(my_file->lines[i] == NULL) {
+			exit_global = -1;
+			continue;
+		}
+
+		// The list runner changes its tokens so the cached line is copied
+		line_tokens = copyTokenArr(my_file->lines[i]);
+		if(line_tokens == NULL) {
+			exit_global = -1;
+			continue;
+		}
+		if(profile_on) {
+			snprintf(frame_label, sizeof(frame_label), "%s:%d", file_path, my_file->line_nums[i]);
+			profileEnter(frame_label, NULL, my_file->lines[i]);
+		}
+		exit_global = runLine(line_tokens);
+		if(profile_on) {
+			profileLeave();
+		}
+		freeTokenArr(line_tokens);
+	}
+	source_depth--;
+
+	// A function can't carry on into the file that sourced this one
+	if(pendingFunc != NULL) {
+		fprintf(stderr, "Error, function %s has no closing }\n", pendingFunc->func_name);
+		freeTokenArr(pendingFunc->func_body);
+		free(pendingFunc->func_name);
+		free(pendingFunc);
+		pendingFunc = NULL;
+		exit_global = -1;
+	}
+	my_file->use_count--;
+	if(my_file->stale && my_file->use_count == 0) {
+		freeSourceFile(my_file);
+	}
+	unstashFileDescs(saved_descs);
+	return exit_global;
+}
+
+void stashFileDescs(int* saved_descs) {
+	saved_descs[0] = original_desc;
+	saved_descs[1] = new_desc;
+	saved_descs[2] = second_original_desc;
+	saved_descs[3] = second_new_desc;
+	original_desc = -1;
+	new_desc = -1;
+	second_original_desc = -1;
+	second_new_desc = -1;
+}
+
+void unstashFileDescs(int* saved_descs) {
+	original_desc = saved_descs[0];
+	new_desc = saved_descs[1];
+	second_original_desc = saved_descs[2];
+	second_new_desc = saved_descs[3];
+}
+
+struct SourceFile* getSourceFile(char* file_path) {
+	struct SourceFile** file_ptr;
+	struct SourceFile* my_file;
+	struct stat file_stat;
+	struct timespec now;
+	FILE* src_stream;
+
+	src_stream = fopen(file_path, "r");
+	if(src_stream == NULL || fstat(fileno(src_stream), &file_stat) == -1) {
+		fprintf(stderr, "Error opening %s\n", file_path);
+		if(src_stream != NULL) {
+			fclose(src_stream);
+		}
+		return NULL;
+	}
+
+	// Keyed by inode so the same file reached by another path still hits
+	for(file_ptr = &sourceCache; *file_ptr != NULL; file_ptr = &(*file_ptr)->next_file) {
+		my_file = *file_ptr;
+		if(my_file->file_ino != file_stat.st_ino || my_file->file_dev != file_stat.st_dev) {
+			continue;
+		}
+		if(my_file->file_mtime.tv_sec == file_stat.st_mtim.tv_sec 
+			&& my_file->file_mtime.tv_nsec == file_stat.st_mtim.tv_nsec 
+			&& my_file->file_size == file_stat.st_size
+			&& my_file->file_mtime.tv_sec < my_file->parse_time) {
+			fclose(src_stream);
+			return my_file;
+		}
+
+		// Changed, a run still using the old lines frees them when it finishes
+		*file_ptr = my_file->next_file;
+		if(my_file->use_count > 0) {
+			my_file->stale = 1;
+		}
+		else {
+			freeSourceFile(my_file);
+		}
+		break;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	my_file = parseSourceFile(src_stream);
+	fclose(src_stream);
+	if(my_file == NULL) {
+		fprintf(stderr, "Error reading %s\n", file_path);
+		return NULL;
+	}
+	my_file->file_dev = file_stat.st_dev;
+	my_file->file_ino = file_stat.st_ino;
+	my_file->file_mtime = file_stat.st_mtim;
+	my_file->file_size = file_stat.st_size;
+
+	// A file written in the same second as the read could change again unseen
+	my_file->parse_time = now.tv_sec;
+	my_file->next_file = sourceCache;
+	sourceCache = my_file;
+	return my_file;
+}
+
+struct SourceFile* parseSourceFile(FILE* src_stream) {
+	struct SourceFile* my_file;
+	TokenArr* line_tokens;
+	char* src_line = NULL;
+	size_t src_cap = 0;
+	ssize_t src_len;
+	int lines_cap = 0;
+	int line_num = 0;
+
+	my_file = calloc(1, sizeof(struct SourceFile));
+	if(my_file == NULL) {
+		return NULL;
+	}
+	while((src_len = getline(&src_line, &src_cap, src_stream)) != -1) {
+		line_num++;
+		if(src_len > 0 && src_line[src_len - 1] == '\n') {
+			src_line[src_len - 1] = '\0';
+		}
+
+		// Errors are reported now, the line just fails each time it runs
+		line_tokens = tokenizeString(src_line);
+		if(line_tokens != NULL && (line_tokens->token_count == 0 || line_tokens->tokens[0][0] == '#')) {
+			freeTokenArr(line_tokens);
+			continue; // Blank and comment lines are dropped
+		}
+		if(my_file->line_count == lines_cap) {
+			TokenArr** alloc_ret = realloc(my_file->lines, (lines_cap * 2 + 16) * sizeof(TokenArr*));
+			int* nums_ret = alloc_ret == NULL ? NULL : realloc(my_file->line_nums, (lines_cap * 2 + 16) * sizeof(int));
+			if(alloc_ret != NULL) {
+				my_file->lines = alloc_ret;
+			}
+			if(nums_ret == NULL) {
+				if(line_tokens != NULL) {
+					freeTokenArr(line_tokens);
 				}
-				else {
-				int my_val;
-					my_val = atoi(my_tokens->tokens[2]);
-					
-					// History size cant be <=0 also handles atoi error
-					if(my_val <= 0 ) { 
-						fprintf(stderr, "Invalid input for history\n");
-						return -1;
-					}
-					else {
-						return wshSetHist(my_val);
+				free(src_line);
+				freeSourceFile(my_file);
+				return NULL;
+			}
+			my_file->line_nums = nums_ret;
+			lines_cap = lines_cap * 2 + 16;
+		}
+		my_file->line_nums[my_file->line_count] = line_num; // For the profiler
+		my_file->lines[my_file->line_count++] = line_tokens;
+	}
+	free(src_line);
+	return my_file;
+}
+
+void freeSourceFile(struct SourceFile* my_file) {
+	for(int i = 0; i < my_file->line_count; i++) {
+		if(my_file->lines[i] != NULL) {
+			freeTokenArr(my_file->lines[i]);
+		}
+	}
+	free(my_file->lines);
+	free(my_file->line_nums);
+	free(my_file);
+}
+
+void freeSourceCache() {
+	while(sourceCache != NULL) {
+		struct SourceFile* next_file = sourceCache->next_file;
+		freeSourceFile(sourceCache);
+		sourceCache = next_file;
+	}
+}
+
+int wshEach(TokenArr* my_tokens) {
+	TokenArr template_tokens = {0, NULL};
+	TokenArr my_items = {0, NULL};
+	struct EachJob* my_jobs = NULL;
+	struct pollfd* poll_fds = NULL;
+	int* running_jobs = NULL;
+	char* path_val = NULL;
+	char** job_args;
+	char* end_ptr;
+	cpu_set_t my_cpus;
+	long max_jobs = 0;
+	int keep_order = 0;
+	int arg = 1;
+	int items_start;
+	size_t running = 0;
+	int next_item = 0;
+	int next_print = 0;
+	int failed = 0;
+	int ret_val = -1;
+
+	// Options come before the template
+	while(arg < my_tokens->token_count && my_tokens->tokens[arg][0] == '-') {
+		if(strcmp(my_tokens->tokens[arg], "-k") == 0) {
+			keep_order = 1;
+			arg++;
+		}
+		else if(strcmp(my_tokens->tokens[arg], "-j") == 0 && arg + 1 < my_tokens->token_count) {
+			max_jobs = strtol(my_tokens->tokens[arg + 1], &end_ptr, 10);
+			if(*end_ptr != '\0' || max_jobs < 1) {
+				fprintf(stderr, "Error, -j needs a positive number\n");
+				return -1;
+			}
+			arg += 2;
+		}
+		else {
+			break;
+		}
+	}
+	for(items_start = arg; items_start < my_tokens->token_count; items_start++) {
+		if(strcmp(my_tokens->tokens[items_start], ":::") == 0) {
+			break;
+		}
+	}
+	if(items_start == arg) {
+		fprintf(stderr, "Error, each should be used as each [-j N] [-k] cmd args... [::: items...]\n");
+		return -1;
+	}
+
+	// Default to one job per cpu this shell may run on
+	if(max_jobs == 0) {
+		max_jobs = sched_getaffinity(0, sizeof(my_cpus), &my_cpus) == 0 ? CPU_COUNT(&my_cpus) : 1;
+	}
+
+	// The command is looked up once for every job
+	template_tokens.tokens = my_tokens->tokens + arg;
+	template_tokens.token_count = items_start - arg;
+	path_val = getPath(&template_tokens);
+	if(path_val == NULL) {
+		fprintf(stderr, "Not a valid command\n");
+		return -1;
+	}
+	if(items_start < my_tokens->token_count) {
+		my_items.tokens = my_tokens->tokens + items_start + 1;
+		my_items.token_count = my_tokens->token_count - items_start - 1;
+	}
+	else if(readEachItems(&my_items) == -1) {
+		free(path_val);
+		return -1;
+	}
+	if(my_items.token_count == 0) {
+		ret_val = 0;
+		goto each_done;
+	}
+	if(max_jobs > my_items.token_count) {
+		max_jobs = my_items.token_count;
+	}
+	my_jobs = calloc(my_items.token_count, sizeof(struct EachJob));
+	poll_fds = malloc(max_jobs * sizeof(struct pollfd));
+	running_jobs = malloc(max_jobs * sizeof(int));
+	if(my_jobs == NULL || poll_fds == NULL || running_jobs == NULL) {
+		fprintf(stderr, "Error allocating each jobs\n");
+		goto each_done;
+	}
+
+	fflush(stdout); // Output so far comes before the jobs'
+	ret_val = 0;
+	while(next_item < my_items.token_count || running > 0) {
+
+		// Fill free slots, with -k only while the oldest unprinted job is close by
+		while(ret_val == 0 && running < (size_t)max_jobs && next_item < my_items.token_count 
+			&& (!keep_order || next_item < next_print + max_jobs * EACH_KEEP_WINDOW)) {
+			job_args = buildEachArgs(template_tokens.tokens, template_tokens.token_count, my_items.tokens[next_item]);
+			if(job_args == NULL || startEachJob(&my_jobs[next_item], path_val, job_args) == -1) {
+				ret_val = -1; // Stop starting jobs but wait on the running ones
+			}
+			else {
+				running_jobs[running++] = next_item++;
+			}
+			if(job_args != NULL) {
+				for(int i = 0; job_args[i] != NULL; i++) {
+					free(job_args[i]);
+				}
+				free(job_args);
+			}
+		}
+		if(running == 0) {
+			break;
+		}
+
+		// Each job's pidfd turns readable when it exits
+		for(size_t i = 0; i < running; i++) {
+			poll_fds[i].fd = my_jobs[running_jobs[i]].pid_fd;
+			poll_fds[i].events = POLLIN;
+		}
+		if(poll(poll_fds, running, -1) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error waiting on each jobs\n");
+			ret_val = -1;
+		}
+		for(size_t i = running; i-- > 0;) {
+			struct EachJob* my_job = &my_jobs[running_jobs[i]];
+			if(ret_val == 0 && !(poll_fds[i].revents & POLLIN)) {
+				continue;
+			}
+			while(waitpid(my_job->job_pid, &my_job->job_status, 0) == -1 && errno == EINTR) {
+			}
+			close(my_job->pid_fd);
+			my_job->job_status = decodeStatus(my_job->job_status);
+			my_job->job_done = 1;
+			failed += my_job->job_status != 0;
+			running_jobs[i] = running_jobs[--running];
+			if(!keep_order) {
+				printEachJob(my_job);
+			}
+		}
+		while(keep_order && next_print < next_item && my_jobs[next_print].job_done) {
+			printEachJob(&my_jobs[next_print++]);
+		}
+	}
+	if(ret_val == 0) {
+		ret_val = failed > 101 ? 101 : failed;
+	}
+
+each_done:
+	if(items_start == my_tokens->token_count) {
+		for(int i = 0; i < my_items.token_count; i++) {
+			free(my_items.tokens[i]);
+		}
+		free(my_items.tokens);
+	}
+	free(running_jobs);
+	free(poll_fds);
+	free(my_jobs);
+	free(path_val);
+	return ret_val;
+}
+
+int readEachItems(TokenArr* my_items) {
+	char* read_buf = NULL;
+	size_t read_len = 0;
+	size_t read_cap = 0;
+	ssize_t read_ret;
+	char* line_start;
+	char* line_end;
+
+	// When the shell reads its lines from stdin, the rest of stdin is in its reader
+	if(epoll_fd != -1 && !(original_desc == STDIN_FILENO && new_desc != -1)) {
+		while(readShellLine(&line_start) != -1) {
+			if(*line_start != '\0' && addGlobMatch(my_items, line_start) == -1) {
+				fprintf(stderr, "Error reading each items\n");
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// Read fd 0 directly so no stdio buffer holds back input from the shell
+	if(readBuffers != NULL) {
+		syncReadBuffers();
+	}
+	do {
+		if(read_len == read_cap) {
+			char* alloc_ret = realloc(read_buf, read_cap * 2 + 4096);
+			if(alloc_ret == NULL) {
+				fprintf(stderr, "Error reading each items\n");
+				free(read_buf);
+				return -1;
+			}
+			read_buf = alloc_ret;
+			read_cap = read_cap * 2 + 4096;
+		}
+		read_ret = read(STDIN_FILENO, read_buf + read_len, read_cap - read_len);
+		if(read_ret > 0) {
+			read_len += read_ret;
+		}
+	} while(read_ret > 0 || (read_ret == -1 && errno == EINTR));
+
+	for(line_start = read_buf; line_start < read_buf + read_len; line_start = line_end + 1) {
+		line_end = memchr(line_start, '\n', read_buf + read_len - line_start);
+		if(line_end == NULL) {
+			line_end = read_buf + read_len;
+		}
+		*line_end = '\0'; // The buffer always has room past the last byte read or a newline here
+		if(line_end > line_start && addGlobMatch(my_items, line_start) == -1) {
+			fprintf(stderr, "Error reading each items\n");
+			free(read_buf);
+			return -1;
+		}
+	}
+	free(read_buf);
+	return 0;
+}
+
+char** buildEachArgs(char** template_tokens, int template_count, char* my_item) {
+	size_t item_len = strlen(my_item);
+	int has_slot = 0;
+	char** job_args;
+	char* slot_ptr;
+
+	for(int i = 0; i < template_count; i++) {
+		has_slot |= strstr(template_tokens[i], "{}") != NULL;
+	}
+	job_args = calloc(template_count + 2, sizeof(char*));
+	if(job_args == NULL) {
+		fprintf(stderr, "Error building each args\n");
+		return NULL;
+	}
+
+	// Every {} in a token becomes the item
+	for(int i = 0; i < template_count; i++) {
+		size_t slot_count = 0;
+		for(slot_ptr = strstr(template_tokens[i], "{}"); slot_ptr != NULL; slot_ptr = strstr(slot_ptr + 2, "{}")) {
+			slot_count++;
+		}
+		job_args[i] = malloc(strlen(template_tokens[i]) + slot_count * item_len + 1);
+		if(job_args[i] == NULL) {
+			break;
+		}
+		char* write_ptr = job_args[i];
+		char* read_ptr = template_tokens[i];
+		while((slot_ptr = strstr(read_ptr, "{}")) != NULL) {
+			memcpy(write_ptr, read_ptr, slot_ptr - read_ptr);
+			write_ptr += slot_ptr - read_ptr;
+			memcpy(write_ptr, my_item, item_len);
+			write_ptr += item_len;
+			read_ptr = slot_ptr + 2;
+		}
+		strcpy(write_ptr, read_ptr);
+	}
+	if(!has_slot && template_count > 0 && job_args[template_count - 1] != NULL) {
+		job_args[template_count] = strdup(my_item);
+	}
+	if(job_args[template_count - 1] == NULL || (!has_slot && job_args[template_count] == NULL)) {
+		fprintf(stderr, "Error building each args\n");
+		for(int i = 0; i <= template_count; i++) {
+			free(job_args[i]);
+		}
+		free(job_args);
+		return NULL;
+	}
+	return job_args;
+}
+
+int startEachJob(struct EachJob* my_job, char* path_val, char** job_args) {
+	my_job->out_fd = memfd_create("each-out", MFD_CLOEXEC);
+	my_job->err_fd = memfd_create("each-err", MFD_CLOEXEC);
+	if(my_job->out_fd == -1 || my_job->err_fd == -1) {
+		fprintf(stderr, "Error creating each output\n");
+		if(my_job->out_fd != -1) {
+			close(my_job->out_fd);
+		}
+		if(my_job->err_fd != -1) {
+			close(my_job->err_fd);
+		}
+		return -1;
+	}
+	my_job->job_pid = fork();
+	spawn_count += my_job->job_pid > 0;
+	if(my_job->job_pid == 0) {
+		int null_fd = open("/dev/null", O_RDONLY);
+		if(epoll_fd != -1) {
+			sigprocmask(SIG_SETMASK, &shell_orig_mask, NULL);
+		}
+
+		// Jobs stay in the shell's group so Ctrl-C reaches all of them
+		if(job_control) {
+			for(size_t i = 0; i < sizeof(JOB_SIGNALS) / sizeof(int); i++) {
+				signal(JOB_SIGNALS[i], SIG_DFL);
+			}
+		}
+		if(null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1 || dup2(my_job->out_fd, STDOUT_FILENO) == -1 
+			|| dup2(my_job->err_fd, STDERR_FILENO) == -1) {
+			_exit(126);
+		}
+		if(applyChildLimits() == -1 || applyChildSched() == -1) {
+			fprintf(stderr, "Error applying child settings\n");
+			_exit(126);
+		}
+		execve(path_val, job_args, environ);
+		fprintf(stderr, "Error executing %s\n", path_val);
+		_exit(127);
+	}
+	my_job->pid_fd = my_job->job_pid == -1 ? -1 : syscall(SYS_pidfd_open, my_job->job_pid, 0);
+	if(my_job->pid_fd == -1) {
+		fprintf(stderr, "Error starting each job\n");
+		if(my_job->job_pid > 0) {
+			waitpid(my_job->job_pid, NULL, 0);
+		}
+		close(my_job->out_fd);
+		close(my_job->err_fd);
+		return -1;
+	}
+	return 0;
+}
+
+void printEachJob(struct EachJob* my_job) {
+	int job_fds[2] = {my_job->out_fd, my_job->err_fd};
+	int print_fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+	char copy_buf[4096];
+
+	// memfds can be sent straight to the output, fall back to copying
+	for(int i = 0; i < 2; i++) {
+		off_t job_len = lseek(job_fds[i], 0, SEEK_END);
+		off_t sent = 0;
+		while(sent < job_len) {
+			ssize_t send_ret = sendfile(print_fds[i], job_fds[i], &sent, job_len - sent);
+			if(send_ret <= 0) {
+				break;
+			}
+		}
+		lseek(job_fds[i], sent, SEEK_SET);
+		while(sent < job_len) {
+			ssize_t read_ret = read(job_fds[i], copy_buf, sizeof(copy_buf));
+			if(read_ret <= 0 || write(print_fds[i], copy_buf, read_ret) != read_ret) {
+				break;
+			}
+			sent += read_ret;
+		}
+		close(job_fds[i]);
+	}
+}
+
+int wshRead(TokenArr* my_tokens) {
+	struct ReadBuffer* my_buffer;
+	char* my_line;
+	char empty_line[1] = "";
+	ssize_t line_len;
+	int read_fd = STDIN_FILENO;
+	int arg = 1;
+	int ret_val = 0;
+
+	// Lines are always taken raw so -r is only accepted
+	for(; arg < my_tokens->token_count && my_tokens->tokens[arg][0] == '-'; arg++) {
+		if(strcmp(my_tokens->tokens[arg], "-u") == 0 && arg + 1 < my_tokens->token_count) {
+			char* fd_end;
+			read_fd = strtol(my_tokens->tokens[++arg], &fd_end, 10);
+			if(*fd_end != '\0' || read_fd < 0) {
+				fprintf(stderr, "Error, %s is not an fd\n", my_tokens->tokens[arg]);
+				return -1;
+			}
+		}
+		else if(strcmp(my_tokens->tokens[arg], "-r") != 0) {
+			fprintf(stderr, "Error, read should be of form read [-r] [-u FD] [VAR...]\n");
+			return -1;
+		}
+	}
+
+	// When the shell reads its lines from stdin, the next ones are already in its reader
+	if(read_fd == STDIN_FILENO && epoll_fd != -1 && !(original_desc == STDIN_FILENO && new_desc != -1)) {
+		line_len = readShellLine(&my_line);
+		if(line_len == -1) {
+			my_line = empty_line;
+			ret_val = 1;
+		}
+	}
+	else {
+		my_buffer = getReadBuffer(read_fd);
+		if(my_buffer == NULL) {
+			return -1;
+		}
+
+		// The vars are still cleared at EOF
+		line_len = readBufferLine(my_buffer, &my_line);
+		if(line_len == -1) {
+			my_line = empty_line;
+			ret_val = 1;
+		}
+	}
+	if(arg == my_tokens->token_count) {
+		return wshLocal("REPLY", my_line) == -1 ? -1 : ret_val;
+	}
+
+	// Split in place, the buffer isn't read again until the next read
+	for(; arg < my_tokens->token_count; arg++) {
+		char* field_end;
+		my_line += strspn(my_line, " \t");
+		if(arg == my_tokens->token_count - 1) {
+			field_end = my_line + strlen(my_line);
+			while(field_end > my_line && (field_end[-1] == ' ' || field_end[-1] == '\t')) {
+				field_end--;
+			}
+		}
+		else {
+			field_end = my_line + strcspn(my_line, " \t");
+		}
+		char end_char = *field_end;
+		*field_end = '\0';
+		if(wshLocal(my_tokens->tokens[arg], my_line) == -1) {
+			return -1;
+		}
+		*field_end = end_char;
+		my_line = field_end;
+	}
+	return ret_val;
+}
+
+ssize_t readShellLine(char** my_line) {
+	char* newline;
+	size_t line_len;
+
+	while(1) {
+		newline = reader_len > reader_start ? memchr(reader_buf + reader_start, '\n', reader_len - reader_start) : NULL;
+		if(newline != NULL || (reader_eof && reader_len > reader_start)) {
+			line_len = newline != NULL ? (size_t)(newline - reader_buf) - reader_start : reader_len - reader_start;
+			*my_line = reader_buf + reader_start;
+			(*my_line)[line_len] = '\0';
+			reader_start += line_len + (newline != NULL);
+			reader_scan = reader_start;
+			return line_len;
+		}
+		if(reader_eof || fillReader() == -1) {
+			return -1;
+		}
+	}
+}
+
+struct ReadBuffer* getReadBuffer(int read_fd) {
+	struct ReadBuffer* my_buffer;
+	struct stat fd_stat;
+	int redirected;
+
+	if(fstat(read_fd, &fd_stat) == -1) {
+		fprintf(stderr, "Error, fd %d is not open\n", read_fd);
+		return NULL;
+	}
+
+	// A redirected fd is a fresh open of the file so it shares no buffer
+	redirected = read_fd == original_desc && new_desc != -1;
+	for(my_buffer = readBuffers; my_buffer != NULL; my_buffer = my_buffer->next_buffer) {
+		if(redirected && my_buffer->is_redirect && my_buffer->read_fd == read_fd) {
+			return my_buffer;
+		}
+		if(!redirected && !my_buffer->is_redirect && my_buffer->read_fd == read_fd) {
+			if(my_buffer->file_dev != fd_stat.st_dev || my_buffer->file_ino != fd_stat.st_ino) {
+				my_buffer->file_dev = fd_stat.st_dev;
+				my_buffer->file_ino = fd_stat.st_ino;
+				my_buffer->buf_start = 0;
+				my_buffer->buf_end = 0;
+			}
+			return my_buffer;
+		}
+	}
+
+	my_buffer = calloc(1, sizeof(struct ReadBuffer));
+	if(my_buffer == NULL || (my_buffer->buf = malloc(READ_BUF_SIZE)) == NULL) {
+		fprintf(stderr, "Error allocating read buffer\n");
+		free(my_buffer);
+		return NULL;
+	}
+	my_buffer->buf_cap = READ_BUF_SIZE;
+	my_buffer->file_dev = fd_stat.st_dev;
+	my_buffer->file_ino = fd_stat.st_ino;
+	my_buffer->read_fd = read_fd;
+	my_buffer->is_redirect = redirected;
+	my_buffer->next_buffer = readBuffers;
+	readBuffers = my_buffer;
+	return my_buffer;
+}
+
+ssize_t readBufferLine(struct ReadBuffer* my_buffer, char** my_line) {
+	char* line_end;
+	ssize_t read_len;
+
+	while(1) {
+		line_end = memchr(my_buffer->buf + my_buffer->buf_start, '\n', my_buffer->buf_end - my_buffer->buf_start);
+		if(line_end != NULL) {
+			break;
+		}
+
+		// Move what is left to the front, growing only for a line longer than the buffer
+		if(my_buffer->buf_start > 0) {
+			memmove(my_buffer->buf, my_buffer->buf + my_buffer->buf_start, my_buffer->buf_end - my_buffer->buf_start);
+			my_buffer->buf_end -= my_buffer->buf_start;
+			my_buffer->buf_start = 0;
+		}
+		if(my_buffer->buf_end + 1 >= my_buffer->buf_cap) {
+			char* alloc_ret = realloc(my_buffer->buf, my_buffer->buf_cap * 2);
+			if(alloc_ret == NULL) {
+				fprintf(stderr, "Error growing read buffer\n");
+				return -1;
+			}
+			my_buffer->buf = alloc_ret;
+			my_buffer->buf_cap *= 2;
+		}
+		do {
+			read_len = read(my_buffer->read_fd, my_buffer->buf + my_buffer->buf_end, my_buffer->buf_cap - my_buffer->buf_end - 1);
+		} while(read_len == -1 && errno == EINTR);
+
+		// A last line with no newline is still a line
+		if(read_len <= 0) {
+			if(my_buffer->buf_end == my_buffer->buf_start) {
+				return -1;
+			}
+			line_end = my_buffer->buf + my_buffer->buf_end;
+			my_buffer->buf_end++;
+			break;
+		}
+		my_buffer->buf_end += read_len;
+	}
+	*line_end = '\0';
+	*my_line = my_buffer->buf + my_buffer->buf_start;
+	my_buffer->buf_start = line_end + 1 - my_buffer->buf;
+	return line_end - *my_line;
+}
+
+void syncReadBuffers() {
+	for(struct ReadBuffer* my_buffer = readBuffers; my_buffer != NULL; my_buffer = my_buffer->next_buffer) {
+		if(!my_buffer->is_redirect && my_buffer->buf_end > my_buffer->buf_start 
+			&& lseek(my_buffer->read_fd, -(off_t)(my_buffer->buf_end - my_buffer->buf_start), SEEK_CUR) != -1) {
+			my_buffer->buf_start = 0;
+			my_buffer->buf_end = 0;
+		}
+	}
+}
+
+void removeReadBuffer(struct ReadBuffer* my_buffer) {
+	struct ReadBuffer** buffer_ptr = &readBuffers;
+	while(*buffer_ptr != my_buffer) {
+		buffer_ptr = &(*buffer_ptr)->next_buffer;
+	}
+	*buffer_ptr = my_buffer->next_buffer;
+	free(my_buffer->buf);
+	free(my_buffer);
+}
+
+void dropRedirectBuffers() {
+	struct ReadBuffer* my_buffer = readBuffers;
+	struct ReadBuffer* next_buffer;
+	for(; my_buffer != NULL; my_buffer = next_buffer) {
+		next_buffer = my_buffer->next_buffer;
+		if(my_buffer->is_redirect) {
+			removeReadBuffer(my_buffer);
+		}
+	}
+}
+
+void freeReadBuffers() {
+	while(readBuffers != NULL) {
+		removeReadBuffer(readBuffers);
+	}
+}
+
+int wshExec(TokenArr* my_tokens) {
+	TokenArr exec_tokens = {my_tokens->token_count - 1, my_tokens->tokens + 1};
+	char* path_val;
+
+	// exec with only a redirect keeps it for the rest of the shell
+	if(my_tokens->token_count == 1) {
+		if(new_desc != -1) {
+			close(new_desc);
+			original_desc = -1;
+			new_desc = -1;
+		}
+		if(second_new_desc != -1) {
+			close(second_new_desc);
+			second_original_desc = -1;
+			second_new_desc = -1;
+		}
+		return 0;
+	}
+	path_val = getPath(&exec_tokens);
+	if(path_val == NULL) {
+		fprintf(stderr, "Not a valid command\n");
+		return -1;
+	}
+	execInPlace(path_val, &exec_tokens);
+	free(path_val);
+	return -1;
+}
+
+int execInPlace(char* path_val, TokenArr* my_tokens) {
+	int signal_count = sizeof(JOB_SIGNALS) / sizeof(int);
+	int limit_count = sizeof(shellLimits) / sizeof(struct ShellLimit);
+	struct rlimit saved_limits[sizeof(shellLimits) / sizeof(struct ShellLimit)];
+	cpu_set_t saved_cpus;
+	int saved_nice;
+	int saved_ioprio;
+	struct stat path_stat;
+	sigset_t saved_mask;
+
+	// Most failures are caught here, before anything is changed on the shell
+	if(stat(path_val, &path_stat) == -1 || !S_ISREG(path_stat.st_mode) || access(path_val, X_OK) == -1) {
+		return -1;
+	}
+
+	// The copies a redirect saved to restore from must not reach the program
+	if(new_desc != -1) {
+		fcntl(new_desc, F_SETFD, FD_CLOEXEC);
+	}
+	if(second_new_desc != -1) {
+		fcntl(second_new_desc, F_SETFD, FD_CLOEXEC);
+	}
+	if(readBuffers != NULL) {
+		syncReadBuffers();
+	}
+	if(profile_on && getpid() == profile_pid) {
+		writeProfile();
+	}
+	fflush(stdout);
+	fflush(stderr);
+
+	// Saved so a failed execve can leave the shell as it was
+	for(int i = 0; i < limit_count; i++) {
+		getrlimit(shellLimits[i].resource, &saved_limits[i]);
+	}
+	sched_getaffinity(0, sizeof(cpu_set_t), &saved_cpus);
+	saved_nice = getpriority(PRIO_PROCESS, 0);
+	saved_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+	// Undo what the shell set up for itself, the same as a forked child
+	if(applyChildLimits() == -1 || applyChildSched() == -1) {
+		fprintf(stderr, "Error applying limits to exec %s\n", path_val);
+		restoreShellSched(saved_limits, &saved_cpus, saved_nice, saved_ioprio);
+		return -1;
+	}
+	sigprocmask(SIG_SETMASK, epoll_fd != -1 ? &shell_orig_mask : NULL, &saved_mask);
+	if(job_control) {
+		for(int i = 0; i < signal_count; i++) {
+			signal(JOB_SIGNALS[i], SIG_DFL);
+		}
+	}
+	execve(path_val, my_tokens->tokens, environ);
+
+	// Still the shell, so put its signals and settings back
+	fprintf(stderr, "Error executing %s\n", path_val);
+	sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+	if(job_control) {
+		for(int i = 0; i < signal_count; i++) {
+			signal(JOB_SIGNALS[i], SIG_IGN);
+		}
+	}
+	restoreShellSched(saved_limits, &saved_cpus, saved_nice, saved_ioprio);
+	return -1;
+}
+
+void restoreShellSched(struct rlimit* saved_limits, cpu_set_t* saved_cpus, int saved_nice, int saved_ioprio) {
+	int limit_count = sizeof(shellLimits) / sizeof(struct ShellLimit);
+
+	// Only the soft limits were lowered so they can always go back
+	for(int i = 0; i < limit_count; i++) {
+		if(shellLimits[i].is_set) {
+			setrlimit(shellLimits[i].resource, &saved_limits[i]);
+		}
+	}
+	if(childSched.cpus_set) {
+		sched_setaffinity(0, sizeof(cpu_set_t), saved_cpus);
+	}
+
+	// Lowering niceness or leaving the idle class can need privilege, the
+	// fork that follows must not add the same setting to the shell's again
+	if(childSched.nice_set && setpriority(PRIO_PROCESS, 0, saved_nice) == -1) {
+		childSched.nice_set = 0;
+	}
+	if(childSched.ioprio_set && (saved_ioprio == -1 || syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved_ioprio) == -1)) {
+		childSched.ioprio_set = 0;
+	}
+}
+
+int wshState(TokenArr* my_tokens) {
+	if(my_tokens->token_count != 3) {
+		fprintf(stderr, "Error, state should be of form state save/load FILE\n");
+		return -1;
+	}
+	if(strcmp(my_tokens->tokens[1], "save") == 0) {
+		return saveState(my_tokens->tokens[2]);
+	}
+	if(strcmp(my_tokens->tokens[1], "load") == 0) {
+		return loadState(my_tokens->tokens[2]);
+	}
+	fprintf(stderr, "Error, state should be of form state save/load FILE\n");
+	return -1;
+}
+
+int appendState(char** state_buf, size_t* state_len, size_t* state_cap, const void* my_data, size_t data_len) {
+	if(*state_len + data_len > *state_cap) {
+		size_t new_cap = *state_cap * 2 + data_len + 4096;
+		char* alloc_ret = realloc(*state_buf, new_cap);
+		if(alloc_ret == NULL) {
+			return -1;
+		}
+		*state_buf = alloc_ret;
+		*state_cap = new_cap;
+	}
+	memcpy(*state_buf + *state_len, my_data, data_len);
+	*state_len += data_len;
+	return 0;
+}
+
+int saveState(char* file_path) {
+	struct StateHeader my_header = {STATE_MAGIC, STATE_VERSION, 0, 0, 0, 0, 0};
+	char* cwd_path = getCwd();
+	char* state_buf = NULL;
+	size_t state_len = 0;
+	size_t state_cap = 0;
+	int ret_val = 0;
+	int state_fd;
+
+	if(cwd_path == NULL) {
+		fprintf(stderr, "Error getting cwd\n");
+		return -1;
+	}
+
+	// The header is filled in once the counts are known
+	ret_val |= appendState(&state_buf, &state_len, &state_cap, &my_header, sizeof(my_header));
+	ret_val |= appendState(&state_buf, &state_len, &state_cap, cwd_path, strlen(cwd_path) + 1);
+	for(struct ShellVar* var_ptr = shellLinkedListHead; var_ptr != NULL; var_ptr = var_ptr->next_var) {
+		ret_val |= appendState(&state_buf, &state_len, &state_cap, var_ptr->var_name, strlen(var_ptr->var_name) + 1);
+		ret_val |= appendState(&state_buf, &state_len, &state_cap, var_ptr->var_val, strlen(var_ptr->var_val) + 1);
+		my_header.var_count++;
+	}
+	for(char** env_ptr = environ; *env_ptr != NULL; env_ptr++) {
+		ret_val |= appendState(&state_buf, &state_len, &state_cap, *env_ptr, strlen(*env_ptr) + 1);
+		my_header.env_count++;
+	}
+	for(struct HistEntry* hist_ptr = histTail; hist_ptr != NULL; hist_ptr = hist_ptr->prev_entry) {
+		uint32_t token_count = hist_ptr->entry_tokens->token_count;
+		ret_val |= appendState(&state_buf, &state_len, &state_cap, &token_count, sizeof(token_count));
+		for(int i = 0; i < hist_ptr->entry_tokens->token_count; i++) {
+			char* my_token = hist_ptr->entry_tokens->tokens[i];
+			ret_val |= appendState(&state_buf, &state_len, &state_cap, my_token, strlen(my_token) + 1);
+		}
+		my_header.hist_count++;
+	}
+	if(ret_val != 0) {
+		fprintf(stderr, "Error building state\n");
+		free(state_buf);
+		return -1;
+	}
+	my_header.hist_limit = histLimit;
+	my_header.data_len = state_len - sizeof(my_header);
+	memcpy(state_buf, &my_header, sizeof(my_header));
+
+	// A reader never sees a half written file
+	char tmp_path[strlen(file_path) + 8];
+	sprintf(tmp_path, "%s.XXXXXX", file_path);
+	state_fd = mkstemp(tmp_path);
+	if(state_fd == -1) {
+		fprintf(stderr, "Error writing state %s\n", file_path);
+		free(state_buf);
+		return -1;
+	}
+	for(size_t written = 0; written < state_len;) {
+		ssize_t write_len = write(state_fd, state_buf + written, state_len - written);
+		if(write_len <= 0) {
+			ret_val = -1;
+			break;
+		}
+		written += write_len;
+	}
+	if(close(state_fd) == -1 || ret_val == -1 || rename(tmp_path, file_path) == -1) {
+		fprintf(stderr, "Error writing state %s\n", file_path);
+		unlink(tmp_path);
+		ret_val = -1;
+	}
+	free(state_buf);
+	return ret_val;
+}
+
+char* nextStateString(char** cursor, char* state_end) {
+	char* my_str = *cursor;
+	char* str_end = memchr(my_str, '\0', state_end - my_str);
+	if(str_end == NULL) {
+		return NULL;
+	}
+	*cursor = str_end + 1;
+	return my_str;
+}
+
+int loadState(char* file_path) {
+	struct StateHeader my_header;
+	struct stat state_stat;
+	char* state_map;
+	char* state_end;
+	char* cursor;
+	char* cwd_path;
+	char* hist_start;
+	char** entry_tokens = NULL;
+	uint32_t max_tokens = 0;
+	int ret_val = 0;
+	int state_fd;
+
+	state_fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if(state_fd == -1 || fstat(state_fd, &state_stat) == -1 || (size_t)state_stat.st_size < sizeof(my_header)) {
+		fprintf(stderr, "Error, %s is not a state file\n", file_path);
+		if(state_fd != -1) {
+			close(state_fd);
+		}
+		return -1;
+	}
+	state_map = mmap(NULL, state_stat.st_size, PROT_READ, MAP_PRIVATE, state_fd, 0);
+	close(state_fd);
+	if(state_map == MAP_FAILED) {
+		fprintf(stderr, "Error mapping %s\n", file_path);
+		return -1;
+	}
+	state_end = state_map + state_stat.st_size;
+	memcpy(&my_header, state_map, sizeof(my_header));
+	if(memcmp(my_header.magic, STATE_MAGIC, 4) != 0 || my_header.version != STATE_VERSION 
+		|| my_header.data_len != state_stat.st_size - sizeof(my_header)) {
+		fprintf(stderr, "Error, %s is not a version %d state file\n", file_path, STATE_VERSION);
+		munmap(state_map, state_stat.st_size);
+		return -1;
+	}
+
+	// Check every string first so a bad file changes nothing
+	cursor = state_map + sizeof(my_header);
+	cwd_path = nextStateString(&cursor, state_end);
+	for(uint64_t i = 0; i < my_header.var_count * 2ULL + my_header.env_count && cwd_path != NULL; i++) {
+		if(nextStateString(&cursor, state_end) == NULL) {
+			cwd_path = NULL;
+		}
+	}
+	hist_start = cursor;
+	for(uint32_t i = 0; i < my_header.hist_count && cwd_path != NULL; i++) {
+		uint32_t token_count;
+		if(state_end - cursor < (ptrdiff_t)sizeof(token_count)) {
+			cwd_path = NULL;
+			break;
+		}
+		memcpy(&token_count, cursor, sizeof(token_count));
+		cursor += sizeof(token_count);
+		if(token_count == 0 || token_count > (size_t)(state_end - cursor)) {
+			cwd_path = NULL;
+			break;
+		}
+		max_tokens = token_count > max_tokens ? token_count : max_tokens;
+		for(uint32_t j = 0; j < token_count && cwd_path != NULL; j++) {
+			if(nextStateString(&cursor, state_end) == NULL) {
+				cwd_path = NULL;
+			}
+		}
+	}
+	if(cwd_path == NULL || cursor != state_end || my_header.hist_limit == 0 
+		|| (entry_tokens = malloc((max_tokens + 1) * sizeof(char*))) == NULL) {
+		fprintf(stderr, "Error, state file %s is damaged\n", file_path);
+		munmap(state_map, state_stat.st_size);
+		return -1;
+	}
+	if(wshCd(cwd_path) == -1) {
+		free(entry_tokens);
+		munmap(state_map, state_stat.st_size);
+		return -1;
+	}
+
+	// The values are copied out so the map can go once they are set
+	cursor = state_map + sizeof(my_header);
+	nextStateString(&cursor, state_end);
+	for(uint32_t i = 0; i < my_header.var_count; i++) {
+		char* var_name = nextStateString(&cursor, state_end);
+		char* var_val = nextStateString(&cursor, state_end);
+		ret_val |= wshLocal(var_name, var_val);
+	}
+	for(uint32_t i = 0; i < my_header.env_count; i++) {
+		char* env_str = nextStateString(&cursor, state_end);
+		char* env_val = strchr(env_str, '=');
+		if(env_val != NULL && env_val != env_str) {
+			char env_name[env_val - env_str + 1];
+			memcpy(env_name, env_str, env_val - env_str);
+			env_name[env_val - env_str] = '\0';
+			ret_val |= wshExport(env_name, env_val + 1);
+		}
+	}
+
+	// History is replaced, oldest entry first so the newest ends up as 1
+	freeHistory();
+	edit_hist = NULL;
+	search_match = NULL;
+	histLimit = my_header.hist_limit;
+	cursor = hist_start;
+	for(uint32_t i = 0; i < my_header.hist_count; i++) {
+		TokenArr hist_tokens = {0, entry_tokens};
+		uint32_t token_count;
+		memcpy(&token_count, cursor, sizeof(token_count));
+		cursor += sizeof(token_count);
+		for(uint32_t j = 0; j < token_count; j++) {
+			entry_tokens[hist_tokens.token_count++] = nextStateString(&cursor, state_end);
+		}
+		entry_tokens[token_count] = NULL;
+		ret_val |= addHistEntry(&hist_tokens);
+	}
+	free(entry_tokens);
+	munmap(state_map, state_stat.st_size);
+	return ret_val == 0 ? 0 : -1;
+}
+
+struct ShellFunc* findShellFunc(struct ShellFunc** func_buckets, char* func_name) {
+	struct ShellFunc* my_func = func_buckets[hashVarName(func_name) % FUNC_BUCKETS];
+	while(my_func != NULL && strcmp(my_func->func_name, func_name) != 0) {
+		my_func = my_func->next_func;
+	}
+	return my_func;
+}
+
+int setShellFunc(struct ShellFunc** func_buckets, char* func_name, TokenArr* func_body) {
+	size_t bucket = hashVarName(func_name) % FUNC_BUCKETS;
+	struct ShellFunc* my_func = findShellFunc(func_buckets, func_name);
+
+	// Redefining only swaps the body, a running call has its own copy
+	if(my_func != NULL) {
+		freeTokenArr(my_func->func_body);
+		my_func->func_body = func_body;
+		return 0;
+	}
+	my_func = malloc(sizeof(struct ShellFunc));
+	if(my_func == NULL || (my_func->func_name = strdup(func_name)) == NULL) {
+		fprintf(stderr, "Error defining %s\n", func_name);
+		free(my_func);
+		freeTokenArr(func_body);
+		return -1;
+	}
+	my_func->func_body = func_body;
+	my_func->next_func = func_buckets[bucket];
+	func_buckets[bucket] = my_func;
+	return 0;
+}
+
+void freeShellFuncs(struct ShellFunc** func_buckets) {
+	for(int i = 0; i < FUNC_BUCKETS; i++) {
+		while(func_buckets[i] != NULL) {
+			struct ShellFunc* next_func = func_buckets[i]->next_func;
+			freeTokenArr(func_buckets[i]->func_body);
+			free(func_buckets[i]->func_name);
+			free(func_buckets[i]);
+			func_buckets[i] = next_func;
+		}
+	}
+}
+
+int isFuncStart(TokenArr* my_tokens) {
+	char* first_token = my_tokens->tokens[0];
+	size_t name_len = strlen(first_token);
+
+	if(my_tokens->token_count < 2 || strcmp(my_tokens->tokens[1], "{") != 0 
+		|| name_len < 3 || strcmp(first_token + name_len - 2, "()") != 0) {
+		return 0;
+	}
+
+	// Names are the same as var names
+	if(isdigit((unsigned char)first_token[0])) {
+		return 0;
+	}
+	for(size_t i = 0; i < name_len - 2; i++) {
+		if(!isalnum((unsigned char)first_token[i]) && first_token[i] != '_') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int defineFunction(TokenArr* my_tokens) {
+	pendingFunc = calloc(1, sizeof(struct ShellFunc));
+	if(pendingFunc == NULL) {
+		fprintf(stderr, "Error defining function\n");
+		return -1;
+	}
+	pendingFunc->func_name = strndup(my_tokens->tokens[0], strlen(my_tokens->tokens[0]) - 2);
+	pendingFunc->func_body = poolAlloc(&tokenArrPool);
+	if(pendingFunc->func_body != NULL) {
+		pendingFunc->func_body->token_count = 0;
+		pendingFunc->func_body->tokens = calloc(1, sizeof(char*));
+	}
+	if(pendingFunc->func_name == NULL || pendingFunc->func_body == NULL || pendingFunc->func_body->tokens == NULL) {
+		fprintf(stderr, "Error defining function\n");
+		if(pendingFunc->func_body != NULL) {
+			poolFree(&tokenArrPool, pendingFunc->func_body);
+		}
+		free(pendingFunc->func_name);
+		free(pendingFunc);
+		pendingFunc = NULL;
+		return -1;
+	}
+	return addFuncLine(my_tokens, 2); // Skip NAME() {
+}
+
+int addFuncLine(TokenArr* my_tokens, int start) {
+	TokenArr* func_body = pendingFunc->func_body;
+	int end = my_tokens->token_count;
+	int closed = end > start && strcmp(my_tokens->tokens[end - 1], "}") == 0;
+	char** alloc_ret;
+	char* add_token;
+
+	if(closed) {
+		end--;
+	}
+
+	// Lines are joined with ; and runs of ; are squeezed to one
+	alloc_ret = realloc(func_body->tokens, (func_body->token_count + end - start + 2) * sizeof(char*));
+	if(alloc_ret == NULL) {
+		fprintf(stderr, "Error defining %s\n", pendingFunc->func_name);
+		return -1;
+	}
+	func_body->tokens = alloc_ret;
+	for(int i = start - 1; i < end; i++) {
+		add_token = i < start ? ";" : my_tokens->tokens[i];
+		if(strcmp(add_token, ";") == 0 && (func_body->token_count == 0 
+			|| strcmp(func_body->tokens[func_body->token_count - 1], ";") == 0)) {
+			continue;
+		}
+		func_body->tokens[func_body->token_count] = strdup(add_token);
+		if(func_body->tokens[func_body->token_count] == NULL) {
+			fprintf(stderr, "Error defining %s\n", pendingFunc->func_name);
+			return -1;
+		}
+		func_body->token_count++;
+	}
+	func_body->tokens[func_body->token_count] = NULL;
+	if(!closed) {
+		return 0;
+	}
+
+	// A trailing ; would leave an empty command at the end
+	if(func_body->token_count > 0 && strcmp(func_body->tokens[func_body->token_count - 1], ";") == 0) {
+		free(func_body->tokens[--func_body->token_count]);
+		func_body->tokens[func_body->token_count] = NULL;
+	}
+	int ret_val = setShellFunc(funcBuckets, pendingFunc->func_name, func_body);
+	free(pendingFunc->func_name);
+	free(pendingFunc);
+	pendingFunc = NULL;
+	return ret_val;
+}
+
+int callShellFunc(struct ShellFunc* my_func, TokenArr* my_tokens) {
+	TokenArr* saved_args = funcArgs;
+	TokenArr* body_copy;
+	int saved_descs[4];
+	int ret_val;
+
+	if(func_depth >= FUNC_MAX_DEPTH) {
+		fprintf(stderr, "Error, functions nested more than %d deep\n", FUNC_MAX_DEPTH);
+		return -1;
+	}
+	if(my_func->func_body->token_count == 0) {
+		return 0;
+	}
+
+	// Running a list changes its tokens so the body is copied, never retokenized
+	body_copy = copyTokenArr(my_func->func_body);
+	if(body_copy == NULL) {
+		return -1;
+	}
+	stashFileDescs(saved_descs);
+	funcArgs = my_tokens;
+	func_depth++;
+	if(profile_on) {
+		char frame_label[strlen(my_func->func_name) + 3];
+		sprintf(frame_label, "%s()", my_func->func_name);
+		profileEnter(frame_label, NULL, NULL);
+	}
+	ret_val = runCommandList(body_copy);
+	if(profile_on) {
+		profileLeave();
+	}
+	func_depth--;
+	funcArgs = saved_args;
+	unstashFileDescs(saved_descs);
+	freeTokenArr(body_copy);
+	return ret_val;
+}
+
+int backgroundShellFunc(struct ShellFunc* my_func, TokenArr* my_tokens) {
+	pid_t fork_val;
+	int ret_val;
+
+	fflush(stdout);
+	if(readBuffers != NULL) {
+		syncReadBuffers();
+	}
+	fork_val = fork();
+	if(fork_val == -1) {
+		fprintf(stderr, "Error forking for %s &\n", my_func->func_name);
+		return -1;
+	}
+	if(fork_val > 0) {
+		spawn_count++;
+		if(job_control) {
+			setpgid(fork_val, fork_val);
+		}
+		return addBgJob(fork_val, my_tokens, JOB_RUNNING);
+	}
+
+	// The copy runs the body like a script, its commands stay in the job's group
+	setupChildJob();
+	freeEventLoop();
+	editor_on = 0;
+	job_control = 0;
+	freeJobs(0); // The shell's jobs aren't this copy's children
+	background_flag = 0;
+	tail_exec = 0;
+	ret_val = callShellFunc(my_func, my_tokens);
+	fflush(stdout);
+	waitTeeWriters();
+	_exit(ret_val & 0xFF);
+}
+
+int expandAliases(TokenArr* my_tokens) {
+	struct ShellFunc* my_alias;
+	char* last_alias;
+	char** new_tokens;
+
+	for(int i = 0; i < my_tokens->token_count; i++) {
+		if(i > 0 && !isListOperator(my_tokens->tokens[i - 1])) {
+			continue;
+		}
+
+		// The spliced in command word is checked again, but an alias naming itself stops
+		last_alias = NULL;
+		for(int depth = 0; depth < ALIAS_MAX_DEPTH && i < my_tokens->token_count; depth++) {
+			my_alias = findShellFunc(aliasBuckets, my_tokens->tokens[i]);
+			if(my_alias == NULL || (last_alias != NULL && strcmp(last_alias, my_alias->func_name) == 0)) {
+				break;
+			}
+			int alias_count = my_alias->func_body->token_count;
+			new_tokens = malloc((my_tokens->token_count + alias_count) * sizeof(char*));
+			if(new_tokens == NULL) {
+				fprintf(stderr, "Error expanding alias %s\n", my_alias->func_name);
+				return -1;
+			}
+			memcpy(new_tokens, my_tokens->tokens, i * sizeof(char*));
+			for(int j = 0; j < alias_count; j++) {
+				new_tokens[i + j] = strdup(my_alias->func_body->tokens[j]);
+				if(new_tokens[i + j] == NULL) {
+					fprintf(stderr, "Error expanding alias %s\n", my_alias->func_name);
+					while(j--) {
+						free(new_tokens[i + j]);
 					}
+					free(new_tokens);
+					return -1;
 				}
 			}
-			else if(my_tokens->token_count == 2) {
-				int my_val;
-				my_val = atoi(my_tokens->tokens[1]);
 
-				// Check size is > 0 and atoi retval is good
-				if(my_val <=0 || my_val > histSize) {
-					fprintf(stderr, "Invalid input for history\n");
-					return -1;
-				}
-				else {
-					struct HistEntry* my_entry = getHistEntry(my_val);
-					return runCommand(my_entry->entry_tokens);
-				}
-			}
+			// Moves the terminating NULL too
+			memcpy(new_tokens + i + alias_count, my_tokens->tokens + i + 1, (my_tokens->token_count - i) * sizeof(char*));
+			free(my_tokens->tokens[i]);
+			free(my_tokens->tokens);
+			my_tokens->tokens = new_tokens;
+			my_tokens->token_count += alias_count - 1;
+			last_alias = my_alias->func_name;
+		}
+	}
+	return 0;
+}
+
+void printAlias(struct ShellFunc* my_alias) {
+	printf("alias %s='", my_alias->func_name);
+	for(int i = 0; i < my_alias->func_body->token_count; i++) {
+		printf(i == 0 ? "%s" : " %s", my_alias->func_body->tokens[i]);
+	}
+	printf("'\n");
+}
+
+int wshAlias(TokenArr* my_tokens) {
+	struct ShellFunc* my_alias;
+	TokenArr* alias_tokens;
+	char* equals_ptr;
+	int ret_val = 0;
+
+	// No args lists every alias sorted by name
+	if(my_tokens->token_count == 1) {
+		struct ShellFunc** alias_list = NULL;
+		int alias_count = 0;
+		for(int i = 0; i < FUNC_BUCKETS; i++) {
+			for(my_alias = aliasBuckets[i]; my_alias != NULL; my_alias = my_alias->next_func) {
+				struct ShellFunc** alloc_ret = realloc(alias_list, (alias_count + 1) * sizeof(struct ShellFunc*));
+				if(alloc_ret == NULL) {
+					fprintf(stderr, "Error listing aliases\n");
+					free(alias_list);
+					return -1;
+				}
+				alias_list = alloc_ret;
+				alias_list[alias_count++] = my_alias;
+			}
+		}
+		qsort(alias_list, alias_count, sizeof(struct ShellFunc*), cmpShellFuncs);
+		for(int i = 0; i < alias_count; i++) {
+			printAlias(alias_list[i]);
+		}
+		free(alias_list);
+		return 0;
+	}
+
+	for(int i = 1; i < my_tokens->token_count; i++) {
+		equals_ptr = strchr(my_tokens->tokens[i], '=');
+
+		// NAME prints the alias
+		if(equals_ptr == NULL) {
+			my_alias = findShellFunc(aliasBuckets, my_tokens->tokens[i]);
+			if(my_alias == NULL) {
+				fprintf(stderr, "Error, %s is not an alias\n", my_tokens->tokens[i]);
+				ret_val = -1;
+				continue;
+			}
+			printAlias(my_alias);
+			continue;
+		}
+
+		// NAME=VALUE tokenizes VALUE now so using the alias never does
+		*equals_ptr = '\0';
+		if(my_tokens->tokens[i][0] == '\0') {
+			fprintf(stderr, "Error, alias needs a name\n");
+			ret_val = -1;
+			continue;
+		}
+		alias_tokens = tokenizeString(equals_ptr + 1);
+		if(alias_tokens == NULL || setShellFunc(aliasBuckets, my_tokens->tokens[i], alias_tokens) == -1) {
+			ret_val = -1;
+		}
+	}
+	return ret_val;
+}
+
+int cmpShellFuncs(const void* lhs, const void* rhs) {
+	return strcmp((*(struct ShellFunc* const*)lhs)->func_name, (*(struct ShellFunc* const*)rhs)->func_name);
+}
+
+int wshUnalias(char* alias_name) {
+	struct ShellFunc** alias_ptr = &aliasBuckets[hashVarName(alias_name) % FUNC_BUCKETS];
+	struct ShellFunc* my_alias;
+	for(; *alias_ptr != NULL; alias_ptr = &(*alias_ptr)->next_func) {
+		if(strcmp((*alias_ptr)->func_name, alias_name) == 0) {
+			my_alias = *alias_ptr;
+			*alias_ptr = my_alias->next_func;
+			freeTokenArr(my_alias->func_body);
+			free(my_alias->func_name);
+			free(my_alias);
+			return 0;
+		}
+	}
+	fprintf(stderr, "Error, %s is not an alias\n", alias_name);
+	return -1;
+}
+
+int wshMem() {
+	int pool_count = sizeof(NODE_POOLS) / sizeof(struct NodePool*);
+	struct mallinfo2 heap_info = mallinfo2();
+	struct NodePool* my_pool;
+
+	printf("%-10s %8s %8s %8s %12s %12s\n", "pool", "live", "peak", "slabs", "live bytes", "slab bytes");
+	for(int i = 0; i < pool_count; i++) {
+		my_pool = NODE_POOLS[i];
+		printf("%-10s %8zu %8zu %8zu %12zu %12zu\n", my_pool->pool_name, my_pool->live_count, my_pool->peak_count, 
+			my_pool->slab_count, my_pool->live_count * my_pool->obj_size, 
+			my_pool->slab_count * (sizeof(struct PoolSlab) + POOL_SLAB_OBJS * my_pool->obj_size));
 	}
+
+	// Strings and arrays still come straight from malloc
+	printf("heap in use: %zu bytes, free in heap: %zu bytes\n", heap_info.uordblks, heap_info.fordblks);
 	return 0;
 }
 
-int wshLocal(char* var_name, char* var_val) {
-	char error_message[] = "Error adding shell var";
-	struct ShellVar* shell_var_ptr;
-	int var_loc;
-	var_loc = findShellVar(var_name);
-	
-	// If the linked list is empty/has no entries
-	if(shellLinkedListHead == NULL) {
+int wshUlimit(char my_flag, char* my_val) {
+	int limit_count = sizeof(shellLimits) / sizeof(struct ShellLimit);
+	struct ShellLimit* my_limit = NULL;
+	struct rlimit hard_limit;
+	char* end_ptr;
+	unsigned long long new_val;
 
-		// Allocating head and tail
-		shellLinkedListHead = malloc(sizeof(struct ShellVar));
-		if(shellLinkedListHead == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			return -1;
+	// Print all settings
+	if(my_flag == 0) {
+		for(int i = 0; i < limit_count; i++) {
+			printf("-%c: %s ", shellLimits[i].flag, shellLimits[i].desc);
+			if(shellLimits[i].is_set) {
+				printf("%llu\n", (unsigned long long)(shellLimits[i].value / shellLimits[i].unit));
+			}
+			else {
+				printf("unlimited\n");
+			}
 		}
-		shellLinkedListTail = shellLinkedListHead;
-		shellLinkedListHead->next_var = NULL;
-		shell_var_ptr = shellLinkedListHead; // New ptr is to head
+		return 0;
 	}
 
-	// If var is in the Linked List
-	else if(var_loc != -1) {
-		shell_var_ptr = shellLinkedListHead;
-		for(int i = 0;i < var_loc;i++) {
-			shell_var_ptr = shell_var_ptr->next_var;
+	for(int i = 0; i < limit_count; i++) {
+		if(shellLimits[i].flag == my_flag) {
+			my_limit = &shellLimits[i];
 		}
 	}
-	// If there is a head to the Linked List
-	else {
-	
-		shell_var_ptr = shellLinkedListTail;
-		
-		// Allocate next ShellVar in linked list
-		shell_var_ptr->next_var = malloc(sizeof(struct ShellVar));
-		if(shell_var_ptr == NULL) {
-			fprintf(stderr, "%s\n", error_message);
-			return -1;
+	if(my_limit == NULL) {
+		fprintf(stderr, "Error, unknown ulimit option -%c\n", my_flag);
+		return -1;
+	}
+
+	// Print one setting
+	if(my_val == NULL) {
+		if(my_limit->is_set) {
+			printf("%llu\n", (unsigned long long)(my_limit->value / my_limit->unit));
+		}
+		else {
+			printf("unlimited\n");
 		}
+		return 0;
+	}
 
-		shell_var_ptr = shell_var_ptr->next_var; // Point to new var
-		shell_var_ptr->next_var = NULL; // Set new vars next var to null
-		shellLinkedListTail = shell_var_ptr; // Set new tail
+	if(strcmp(my_val, "unlimited") == 0) {
+		my_limit->is_set = 0;
+		return 0;
 	}
-	
-	// Copy vals into new var
-	if(strcpy(shell_var_ptr->var_name, var_name) == NULL || strcpy(shell_var_ptr->var_val, var_val) == NULL) {
-		fprintf(stderr, "%s\n", error_message);
+	new_val = strtoull(my_val, &end_ptr, 10);
+	if(*end_ptr != '\0' || end_ptr == my_val) {
+		fprintf(stderr, "Error, invalid ulimit value %s\n", my_val);
 		return -1;
 	}
-	return 0;	
+
+	// Children can't raise their soft limit past the hard limit
+	if(getrlimit(my_limit->resource, &hard_limit) == -1 
+		|| (hard_limit.rlim_max != RLIM_INFINITY && new_val * my_limit->unit > hard_limit.rlim_max)) {
+		fprintf(stderr, "Error, ulimit value %s is over the hard limit\n", my_val);
+		return -1;
+	}
+	my_limit->value = new_val * my_limit->unit;
+	my_limit->is_set = 1;
+	return 0;
 }
 
 int wshSetHist(int new_limit) {
@@ -948,8 +6921,39 @@ int wshVars() {
 }
 
 void wshExit() {
+	// An & job's output is only all copied once its writer is done
+	fflush(stdout);
+	waitTeeWriters();
+	// A forked child that exits through here must not write the profile
+	if(profile_on && getpid() == profile_pid) {
+		writeProfile();
+	}
+	if(profile_on) {
+		freeProfile();
+	}
+	freeJobs(1);
+	freeEventLoop();
+	free(line_buf);
 	freeHistory();
 	freeShellVars();
+	freeDirCache();
+	freeCompletion();
+	freeSourceCache();
+	freeReadBuffers();
+	freeShellFuncs(funcBuckets);
+	freeShellFuncs(aliasBuckets);
+	if(pendingFunc != NULL) {
+		freeTokenArr(pendingFunc->func_body);
+		free(pendingFunc->func_name);
+		free(pendingFunc);
+		pendingFunc = NULL;
+	}
+#ifdef WSH_DEBUG
+	reportLeaks();
+#endif
+	for(size_t i = 0; i < sizeof(NODE_POOLS) / sizeof(struct NodePool*); i++) {
+		freePool(NODE_POOLS[i]);
+	}
 	exit(exit_global);
 }
 
@@ -979,14 +6983,586 @@ int wshLs() {
 	return 0;
 }
 
+int wshDu(TokenArr* my_tokens) {
+	int walk_mode;
+	int human_sizes;
+	int arg = parseDuFlags(my_tokens, &walk_mode, &human_sizes);
+	int ret_val = 0;
+
+	if(arg == my_tokens->token_count) {
+		return wshWalk(NULL, walk_mode, human_sizes);
+	}
+
+	// Each path is its own walk, one failing doesn't stop the rest
+	for(; arg < my_tokens->token_count; arg++) {
+		if(wshWalk(my_tokens->tokens[arg], walk_mode, human_sizes) == -1) {
+			ret_val = -1;
+		}
+	}
+	return ret_val;
+}
+
+int parseDuFlags(TokenArr* my_tokens, int* walk_mode, int* human_sizes) {
+	int arg;
+
+	*walk_mode = WALK_DU;
+	*human_sizes = 0;
+	for(arg = 1; arg < my_tokens->token_count && my_tokens->tokens[arg][0] == '-' && my_tokens->tokens[arg][1] != '\0'; arg++) {
+		if(strcmp(my_tokens->tokens[arg], "--") == 0) {
+			return arg + 1;
+		}
+
+		// Flags can be grouped as in -sh, and the last of -h and -k wins
+		for(char* my_flag = my_tokens->tokens[arg] + 1; *my_flag != '\0'; my_flag++) {
+			if(*my_flag == 's') {
+				*walk_mode = WALK_DU_TOTAL;
+			}
+			else if(*my_flag == 'h' || *my_flag == 'k') {
+				*human_sizes = *my_flag == 'h';
+			}
+			else {
+				return -1;
+			}
+		}
+	}
+	return arg;
+}
+
+void printDuSize(long long size_kb, char* print_path, int human_sizes) {
+	const char size_units[] = "KMGTPE";
+	long long unit_kb = 1;
+	long long size_whole;
+	long long size_tenths;
+	int unit;
+
+	if(!human_sizes || size_kb == 0) {
+		printf("%lld\t%s\n", size_kb, print_path);
+		return;
+	}
+
+	// Rounded up like du -h, with one decimal below 10
+	for(unit = 0; ; unit++, unit_kb *= 1024) {
+		size_whole = (size_kb + unit_kb - 1) / unit_kb;
+		if(size_whole < 1024 || size_units[unit + 1] == '\0') {
+			break;
+		}
+	}
+	size_tenths = (size_kb * 10 + unit_kb - 1) / unit_kb;
+	if(size_tenths < 100) {
+		printf("%lld.%lld%c\t%s\n", size_tenths / 10, size_tenths % 10, size_units[unit], print_path);
+	}
+	else {
+		printf("%lld%c\t%s\n", size_whole, size_units[unit], print_path);
+	}
+}
+
+int wshWalk(char* root_path, int walk_mode, int human_sizes) {
+	struct DirWalk* my_walk;
+	struct WalkWorker workers[WALK_MAX_THREADS];
+	struct WalkDir* root_dir;
+	struct statx root_stat;
+	cpu_set_t my_cpus;
+	long long root_blocks = 0;
+	int had_error = 0;
+
+	my_walk = calloc(1, sizeof(struct DirWalk));
+	root_dir = calloc(1, sizeof(struct WalkDir));
+	if(my_walk == NULL || root_dir == NULL || (root_dir->dir_path = strdup(".")) == NULL) {
+		fprintf(stderr, "Error allocating walk\n");
+		free(my_walk);
+		free(root_dir);
+		return -1;
+	}
+
+	// Every dir is opened from the root's fd so no path is looked up twice
+	my_walk->root_fd = open(root_path == NULL ? "." : root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(my_walk->root_fd == -1) {
+		fprintf(stderr, "Error, could not open directory %s\n", root_path == NULL ? "." : root_path);
+		freeWalkDir(root_dir);
+		free(my_walk);
+		return -1;
+	}
+	if(walk_mode != WALK_LIST && statx(my_walk->root_fd, "", AT_EMPTY_PATH, STATX_BLOCKS, &root_stat) == 0) {
+		root_blocks = root_stat.stx_blocks;
+	}
+
+	// One worker per cpu the shell may run on
+	my_walk->walk_mode = walk_mode;
+	my_walk->worker_count = sched_getaffinity(0, sizeof(my_cpus), &my_cpus) == 0 ? CPU_COUNT(&my_cpus) : 1;
+	if(my_walk->worker_count > WALK_MAX_THREADS) {
+		my_walk->worker_count = WALK_MAX_THREADS;
+	}
+	for(int i = 0; i < my_walk->worker_count; i++) {
+		pthread_mutex_init(&my_walk->queues[i].queue_lock, NULL);
+	}
+	pthread_mutex_init(&my_walk->idle_lock, NULL);
+	pthread_cond_init(&my_walk->work_ready, NULL);
+	pushWalkDir(my_walk, 0, root_dir);
+	for(int i = 0; i < my_walk->worker_count; i++) {
+		workers[i].my_walk = my_walk;
+		workers[i].worker_index = i;
+		if(i > 0 && pthread_create(&workers[i].worker_thread, NULL, walkWorker, &workers[i]) != 0) {
+			my_walk->worker_count = i; // The rest steal from the queue that isn't served
+			break;
+		}
+	}
+	walkWorker(&workers[0]);
+	for(int i = 1; i < my_walk->worker_count; i++) {
+		pthread_join(workers[i].worker_thread, NULL);
+	}
+
+	// Printing happens on one thread once the tree is read so the order never changes
+	root_blocks += printWalkDir(root_dir, root_path == NULL ? "." : root_path, walk_mode, human_sizes, &had_error);
+	if(walk_mode != WALK_LIST) {
+		printDuSize((root_blocks + 1) / 2, root_path == NULL ? "." : root_path, human_sizes);
+	}
+	for(int i = 0; i < WALK_MAX_THREADS; i++) {
+		if(i < my_walk->worker_count) {
+			pthread_mutex_destroy(&my_walk->queues[i].queue_lock);
+		}
+		free(my_walk->queues[i].dirs);
+	}
+	pthread_mutex_destroy(&my_walk->idle_lock);
+	pthread_cond_destroy(&my_walk->work_ready);
+	close(my_walk->root_fd);
+	freeWalkDir(root_dir);
+	free(my_walk);
+	return had_error ? -1 : 0;
+}
+
+void* walkWorker(void* worker_arg) {
+	struct WalkWorker* my_worker = worker_arg;
+	struct DirWalk* my_walk = my_worker->my_walk;
+	struct WalkDir* my_dir;
+
+	while(1) {
+		my_dir = findWalkDir(my_walk, my_worker->worker_index);
+
+		// Out of work, so sleep until a dir is pushed or the walk ends. A dir being
+		// read can still queue more, so only stop once none are pending
+		if(my_dir == NULL) {
+			pthread_mutex_lock(&my_walk->idle_lock);
+			__atomic_add_fetch(&my_walk->idle_count, 1, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&my_walk->pending, __ATOMIC_SEQ_CST) != 0 
+				&& (my_dir = findWalkDir(my_walk, my_worker->worker_index)) == NULL) {
+				pthread_cond_wait(&my_walk->work_ready, &my_walk->idle_lock);
+			}
+			__atomic_sub_fetch(&my_walk->idle_count, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&my_walk->idle_lock);
+			if(my_dir == NULL) {
+				break;
+			}
+		}
+		readWalkDir(my_walk, my_dir, my_worker->worker_index);
+		if(__atomic_sub_fetch(&my_walk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+			pthread_mutex_lock(&my_walk->idle_lock);
+			pthread_cond_broadcast(&my_walk->work_ready);
+			pthread_mutex_unlock(&my_walk->idle_lock);
+		}
+	}
+	return NULL;
+}
+
+struct WalkDir* findWalkDir(struct DirWalk* my_walk, int worker_index) {
+	struct WalkDir* my_dir = takeWalkDir(&my_walk->queues[worker_index], 0);
+
+	// Steal starting from the next worker
+	for(int i = 1; my_dir == NULL && i < my_walk->worker_count; i++) {
+		my_dir = takeWalkDir(&my_walk->queues[(worker_index + i) % my_walk->worker_count], 1);
+	}
+	return my_dir;
+}
+
+int pushWalkDir(struct DirWalk* my_walk, int worker_index, struct WalkDir* my_dir) {
+	struct WalkQueue* my_queue = &my_walk->queues[worker_index];
+
+	pthread_mutex_lock(&my_queue->queue_lock);
+	if(my_queue->queue_tail == my_queue->queue_cap) {
+		// Slide the live dirs down before growing
+		size_t live_count = my_queue->queue_tail - my_queue->queue_head;
+		if(my_queue->queue_head > 0 && live_count < my_queue->queue_cap / 2) {
+			memmove(my_queue->dirs, my_queue->dirs + my_queue->queue_head, live_count * sizeof(struct WalkDir*));
+		}
+		else {
+			struct WalkDir** alloc_ret = realloc(my_queue->dirs, (my_queue->queue_cap * 2 + 64) * sizeof(struct WalkDir*));
+			if(alloc_ret == NULL) {
+				pthread_mutex_unlock(&my_queue->queue_lock);
+				return -1;
+			}
+			my_queue->dirs = alloc_ret;
+			my_queue->queue_cap = my_queue->queue_cap * 2 + 64;
+			memmove(my_queue->dirs, my_queue->dirs + my_queue->queue_head, live_count * sizeof(struct WalkDir*));
+		}
+		my_queue->queue_head = 0;
+		my_queue->queue_tail = live_count;
+	}
+	__atomic_add_fetch(&my_walk->pending, 1, __ATOMIC_SEQ_CST);
+	my_queue->dirs[my_queue->queue_tail++] = my_dir;
+	pthread_mutex_unlock(&my_queue->queue_lock);
+
+	// Only a sleeping worker needs waking, one that goes idle later finds the dir itself
+	if(__atomic_load_n(&my_walk->idle_count, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&my_walk->idle_lock);
+		pthread_cond_signal(&my_walk->work_ready);
+		pthread_mutex_unlock(&my_walk->idle_lock);
+	}
+	return 0;
+}
+
+struct WalkDir* takeWalkDir(struct WalkQueue* my_queue, int steal) {
+	struct WalkDir* my_dir = NULL;
+
+	pthread_mutex_lock(&my_queue->queue_lock);
+	if(my_queue->queue_head < my_queue->queue_tail) {
+		my_dir = steal ? my_queue->dirs[my_queue->queue_head++] : my_queue->dirs[--my_queue->queue_tail];
+	}
+	pthread_mutex_unlock(&my_queue->queue_lock);
+	return my_dir;
+}
+
+int cmpWalkEntries(const void* lhs, const void* rhs) {
+	return strcmp(((struct WalkEntry*)lhs)->entry_name, ((struct WalkEntry*)rhs)->entry_name);
+}
+
+void readWalkDir(struct DirWalk* my_walk, struct WalkDir* my_dir, int worker_index) {
+	char dents_buf[WALK_DENTS_SIZE] __attribute__((aligned(8)));
+	size_t names_len = 0;
+	size_t names_cap = 0;
+	int entries_cap = 0;
+	ssize_t dents_len;
+	int dir_fd;
+
+	dir_fd = openat(my_walk->root_fd, my_dir->dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(dir_fd == -1) {
+		my_dir->walk_error = 1;
+		return;
+	}
+
+	// Names are packed into one buffer, entries hold offsets until it stops moving
+	while((dents_len = getdents64(dir_fd, dents_buf, sizeof(dents_buf))) > 0) {
+		for(ssize_t pos = 0; pos < dents_len;) {
+			struct dirent64* my_dent = (struct dirent64*)(dents_buf + pos);
+			size_t name_len = strlen(my_dent->d_name);
+			pos += my_dent->d_reclen;
+			if(strcmp(my_dent->d_name, ".") == 0 || strcmp(my_dent->d_name, "..") == 0 
+				|| (my_walk->walk_mode == WALK_LIST && my_dent->d_name[0] == '.')) {
+				continue;
+			}
+			if(my_dir->entry_count == entries_cap) {
+				struct WalkEntry* alloc_ret = realloc(my_dir->entries, (entries_cap * 2 + 16) * sizeof(struct WalkEntry));
+				if(alloc_ret == NULL) {
+					my_dir->walk_error = 1;
+					break;
+				}
+				my_dir->entries = alloc_ret;
+				entries_cap = entries_cap * 2 + 16;
+			}
+			if(names_len + name_len + 1 > names_cap) {
+				char* alloc_ret = realloc(my_dir->names, names_cap * 2 + name_len + 1024);
+				if(alloc_ret == NULL) {
+					my_dir->walk_error = 1;
+					break;
+				}
+				my_dir->names = alloc_ret;
+				names_cap = names_cap * 2 + name_len + 1024;
+			}
+			struct WalkEntry* my_entry = &my_dir->entries[my_dir->entry_count++];
+			memcpy(my_dir->names + names_len, my_dent->d_name, name_len + 1);
+			my_entry->entry_name = (char*)names_len;
+			my_entry->is_dir = my_dent->d_type == DT_DIR;
+			my_entry->entry_blocks = 0;
+			my_entry->subdir = NULL;
+			names_len += name_len + 1;
+
+			// statx is only needed for sizes and for filesystems that don't give a type
+			if(my_walk->walk_mode != WALK_LIST || my_dent->d_type == DT_UNKNOWN) {
+				struct statx entry_stat;
+				if(statx(dir_fd, my_dent->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_BLOCKS, &entry_stat) == 0) {
+					my_entry->is_dir = S_ISDIR(entry_stat.stx_mode);
+					my_entry->entry_blocks = entry_stat.stx_blocks;
+				}
+			}
+		}
+	}
+	if(dents_len == -1) {
+		my_dir->walk_error = 1;
+	}
+	close(dir_fd);
+	for(int i = 0; i < my_dir->entry_count; i++) {
+		my_dir->entries[i].entry_name = my_dir->names + (size_t)my_dir->entries[i].entry_name;
+	}
+	qsort(my_dir->entries, my_dir->entry_count, sizeof(struct WalkEntry), cmpWalkEntries);
+
+	// Subdirs go on this worker's queue for others to steal
+	for(int i = 0; i < my_dir->entry_count; i++) {
+		struct WalkEntry* my_entry = &my_dir->entries[i];
+		struct WalkDir* subdir;
+		if(!my_entry->is_dir) {
+			continue;
+		}
+		subdir = calloc(1, sizeof(struct WalkDir));
+		if(subdir == NULL) {
+			my_dir->walk_error = 1;
+			continue;
+		}
+		subdir->dir_path = strcmp(my_dir->dir_path, ".") == 0 ? strdup(my_entry->entry_name) : joinPath(my_dir->dir_path, my_entry->entry_name);
+		if(subdir->dir_path == NULL || pushWalkDir(my_walk, worker_index, subdir) == -1) {
+			free(subdir->dir_path);
+			free(subdir);
+			my_dir->walk_error = 1;
+			continue;
+		}
+		my_entry->subdir = subdir;
+	}
+}
+
+long long printWalkDir(struct WalkDir* my_dir, char* print_path, int walk_mode, int human_sizes, int* had_error) {
+	long long dir_blocks = 0;
+	size_t path_len = strlen(print_path);
+
+	if(my_dir->walk_error) {
+		fprintf(stderr, "Error reading directory %s\n", print_path);
+		*had_error = 1;
+	}
+	for(int i = 0; i < my_dir->entry_count; i++) {
+		struct WalkEntry* my_entry = &my_dir->entries[i];
+		char entry_path[path_len + strlen(my_entry->entry_name) + 2];
+
+		// ls -R paths are shown from the dir it was given, without a leading ./
+		if(walk_mode == WALK_LIST && strcmp(print_path, ".") == 0) {
+			strcpy(entry_path, my_entry->entry_name);
+		}
+		else {
+			sprintf(entry_path, "%s%s%s", print_path, print_path[path_len - 1] == '/' ? "" : "/", my_entry->entry_name);
+		}
+		if(walk_mode == WALK_LIST) {
+			printf("%s%s\n", entry_path, my_entry->is_dir ? "/" : "");
+		}
+		dir_blocks += my_entry->entry_blocks;
+		if(my_entry->subdir != NULL) {
+			long long sub_blocks = printWalkDir(my_entry->subdir, entry_path, walk_mode, human_sizes, had_error);
+			dir_blocks += sub_blocks;
+
+			// du lists a dir after everything under it, in KB like du -k
+			if(walk_mode == WALK_DU) {
+				printDuSize((sub_blocks + my_entry->entry_blocks + 1) / 2, entry_path, human_sizes);
+			}
+		}
+	}
+	return dir_blocks;
+}
+
+void freeWalkDir(struct WalkDir* my_dir) {
+	for(int i = 0; i < my_dir->entry_count; i++) {
+		if(my_dir->entries[i].subdir != NULL) {
+			freeWalkDir(my_dir->entries[i].subdir);
+		}
+	}
+	free(my_dir->entries);
+	free(my_dir->names);
+	free(my_dir->dir_path);
+	free(my_dir);
+}
+
 int wshCd(char* new_dir){
-	if(chdir(new_dir) != 0) {
-		printf("Error, could not cd to directory %s\n", new_dir);
+	char* old_cwd = getCwd();
+	char* cd_path = NULL;
+	char* new_cwd;
+	int print_dir = 0;
+
+	// cd - goes back and shows where it went
+	if(strcmp(new_dir, "-") == 0) {
+		new_dir = getenv("OLDPWD");
+		if(new_dir == NULL) {
+			fprintf(stderr, "Error, OLDPWD not set\n");
+			return -1;
+		}
+		print_dir = 1;
+	}
+	else if(new_dir[0] != '/' && strcmp(new_dir, ".") != 0 && strcmp(new_dir, "..") != 0 
+		&& strncmp(new_dir, "./", 2) != 0 && strncmp(new_dir, "../", 3) != 0) {
+		cd_path = findCdPath(new_dir, &print_dir);
+	}
+
+	// The new cwd is worked out from the cached one, so .. leaves a symlinked dir the way it came in
+	new_cwd = cd_path != NULL ? cd_path : (old_cwd != NULL || new_dir[0] == '/' ? normalizePath(old_cwd, new_dir) : NULL);
+	if(new_cwd == NULL || chdir(new_cwd) != 0) {
+		free(new_cwd);
+		new_cwd = NULL;
+
+		// A .. the real tree doesn't have, so fall back to the physical path
+		if(chdir(new_dir) != 0) {
+			printf("Error, could not cd to directory %s\n", new_dir);
+			return -1;
+		}
+		new_cwd = getcwd(NULL, 0);
+		if(new_cwd == NULL) {
+			fprintf(stderr, "Error getting cwd\n");
+			return -1;
+		}
+	}
+	setCwd(new_cwd);
+	if(print_dir) {
+		printf("%s\n", cwd_cache);
+	}
+	return 0;
+}
+
+int wshPwd(int physical) {
+	char* my_cwd;
+
+	// -P always asks the kernel, since the cached path can go through symlinks
+	if(physical) {
+		my_cwd = getcwd(NULL, 0);
+		if(my_cwd == NULL) {
+			fprintf(stderr, "Error getting cwd\n");
+			return -1;
+		}
+		printf("%s\n", my_cwd);
+		free(my_cwd);
+		return 0;
+	}
+	my_cwd = getCwd();
+	if(my_cwd == NULL) {
+		fprintf(stderr, "Error getting cwd\n");
 		return -1;
 	}
+	printf("%s\n", my_cwd);
 	return 0;
 }
 
+char* getCwd() {
+	struct stat env_stat;
+	struct stat dot_stat;
+	char* env_pwd;
+
+	if(!cwd_stale) {
+		return cwd_cache;
+	}
+
+	// An inherited PWD is kept if it is still the same dir, like other shells
+	env_pwd = getenv("PWD");
+	free(cwd_cache);
+	cwd_cache = NULL;
+	if(env_pwd != NULL && env_pwd[0] == '/' && stat(env_pwd, &env_stat) == 0 && stat(".", &dot_stat) == 0 
+		&& env_stat.st_dev == dot_stat.st_dev && env_stat.st_ino == dot_stat.st_ino) {
+		cwd_cache = normalizePath(NULL, env_pwd);
+	}
+	if(cwd_cache == NULL) {
+		cwd_cache = getcwd(NULL, 0);
+		if(cwd_cache == NULL) {
+			return NULL;
+		}
+	}
+	cwd_stale = 0;
+	setenv("PWD", cwd_cache, 1);
+	return cwd_cache;
+}
+
+void setCwd(char* new_cwd) {
+	if(cwd_cache != NULL && !cwd_stale) {
+		setenv("OLDPWD", cwd_cache, 1);
+	}
+	free(cwd_cache);
+	cwd_cache = new_cwd;
+	cwd_stale = 0;
+	setenv("PWD", cwd_cache, 1);
+}
+
+char* normalizePath(char* base_path, char* rel_path) {
+	char* full_path = rel_path[0] == '/' || base_path == NULL ? strdup(rel_path) : joinPath(base_path, rel_path);
+	size_t out_len = 0;
+	char* seg_end;
+
+	if(full_path == NULL) {
+		return NULL;
+	}
+
+	// The path only gets shorter, so it is rewritten in place one name at a time
+	for(char* seg = full_path; *seg != '\0'; seg = seg_end) {
+		size_t seg_len;
+		while(*seg == '/') {
+			seg++;
+		}
+		seg_end = strchrnul(seg, '/');
+		seg_len = seg_end - seg;
+		if(seg_len == 0 || (seg_len == 1 && seg[0] == '.')) {
+			continue;
+		}
+		if(seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+			while(out_len > 0 && full_path[--out_len] != '/') {
+			}
+			continue;
+		}
+		full_path[out_len++] = '/';
+		memmove(full_path + out_len, seg, seg_len);
+		out_len += seg_len;
+	}
+	if(out_len == 0) {
+		full_path[out_len++] = '/';
+	}
+	full_path[out_len] = '\0';
+	return full_path;
+}
+
+char* findCdPath(char* new_dir, int* used_entry) {
+	char* cdpath_env = getenv("CDPATH");
+	struct stat dir_stat;
+
+	if(cdpath_env == NULL || cdpath_env[0] == '\0') {
+		return NULL;
+	}
+
+	// Split again only if CDPATH changed since the last cd
+	if(cdpath_cache == NULL || strcmp(cdpath_cache, cdpath_env) != 0) {
+		char* dir_start;
+		char* dir_end;
+		free(cdpath_cache);
+		free(cdpath_dirs);
+		cdpath_count = 0;
+		cdpath_cache = strdup(cdpath_env);
+		cdpath_dirs = malloc((strlen(cdpath_env) + 1) * sizeof(char*) + strlen(cdpath_env) + 1);
+		if(cdpath_cache == NULL || cdpath_dirs == NULL) {
+			free(cdpath_cache);
+			free(cdpath_dirs);
+			cdpath_cache = NULL;
+			cdpath_dirs = NULL;
+			return NULL;
+		}
+
+		// The dir names live in the same allocation, after the pointers
+		dir_start = strcpy((char*)(cdpath_dirs + strlen(cdpath_env) + 1), cdpath_env);
+		while(1) {
+			dir_end = strchrnul(dir_start, ':');
+			cdpath_dirs[cdpath_count++] = dir_start;
+			if(*dir_end == '\0') {
+				break;
+			}
+			*dir_end = '\0';
+			dir_start = dir_end + 1;
+		}
+	}
+
+	// An empty entry is the cwd, and only other entries are shown when used
+	for(int i = 0; i < cdpath_count; i++) {
+		char try_path[strlen(cdpath_dirs[i]) + strlen(new_dir) + 2];
+		if(cdpath_dirs[i][0] == '\0') {
+			strcpy(try_path, new_dir);
+		}
+		else {
+			sprintf(try_path, "%s%s%s", cdpath_dirs[i], cdpath_dirs[i][strlen(cdpath_dirs[i]) - 1] == '/' ? "" : "/", new_dir);
+		}
+		if(stat(try_path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode)) {
+			*used_entry = cdpath_dirs[i][0] != '\0';
+			if(try_path[0] != '/' && getCwd() == NULL) {
+				return NULL;
+			}
+			return normalizePath(cwd_cache, try_path);
+		}
+	}
+	return NULL;
+}
+
 int wshExport(char* var_name, char* var_val) {
 	int ret_val;
 	ret_val = setenv(var_name, var_val, 1); // Change and overwriting
@@ -999,12 +7575,46 @@ int wshExport(char* var_name, char* var_val) {
 	
 }
 
+#ifndef WSH_NO_MAIN
 int main(int argc, char* argv[]) {
 	FILE* sh_file;
 	wshExport("PATH", "/bin");
 	if(argc == 1) {
+		initEventLoop(); // Falls back to blocking reads on failure
+		initJobControl();
+		initLineEditor();
 		programLoop(stdin);
 	}
+	else if((argc == 3 || argc == 4) && strcmp(argv[1], "--serve") == 0) {
+		return wshServe(argv[2], argc == 4 ? argv[3] : NULL) == -1;
+	}
+	else if(argc >= 3 && (strcmp(argv[1], "--profile") == 0 || strcmp(argv[1], "--profile-top") == 0)) {
+		int arg = 1;
+		for(; arg < argc - 1; arg++) {
+			if(strcmp(argv[arg], "--profile") == 0 && arg + 2 < argc) {
+				profile_path = argv[++arg];
+			}
+			else if(strcmp(argv[arg], "--profile-top") == 0) {
+				profile_top = 1;
+			}
+			else {
+				break;
+			}
+		}
+		if(arg != argc - 1) {
+			fprintf(stderr, "Usage: wsh [--profile FILE] [--profile-top] script\n");
+			return 1;
+		}
+		sh_file = fopen(argv[arg], "r");
+		if(sh_file == NULL) {
+			fprintf(stderr, "Error running shell file\n");
+			return 1;
+		}
+		profile_on = 1;
+		profile_pid = getpid();
+		profile_script = argv[arg];
+		programLoop(sh_file);
+	}
 	else if(argc == 2) {
 		sh_file = fopen(argv[1], "r");
 		if(sh_file != NULL) {
@@ -1018,3 +7628,4 @@ int main(int argc, char* argv[]) {
 		fprintf(stderr, "Wsh can only be run with 0 or 1 params\n");
 	}
 }
+#endif
@@ -1,6 +1,12 @@
 #include <stdio.h>
-#define SHELL_MAX_INPUT 1024
-#define MAX_DIR_SIZE 1024
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stdint.h>
+#include <termios.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #define EXIT 0
 #define LS 1
@@ -9,12 +15,128 @@
 #define LOCAL 4
 #define VARS 5
 #define HISTORY 6
+#define SET 7
+#define TIMEOUT 8
+#define ULIMIT 9
+#define CPUS 10
+#define NICE 11
+#define IONICE 12
+#define JOBS 13
+#define FG 14
+#define BG 15
+#define MEM 16
+#define SOURCE 17
+#define SOURCE_DOT 18
+#define ALIAS 19
+#define UNALIAS 20
+#define EACH 21
+#define LET 22
+#define READ 23
+#define STATE 24
+#define EXEC 25
+#define DU 26
+#define PWD 27
+
+// Nested source calls allowed before giving up on a loop
+#define SOURCE_MAX_DEPTH 64
+
+// wsh --serve protocol, a client sends one SERVE_HELLO byte carrying its
+// stdout, stderr and cwd fds, then the script, and gets back a 4 byte status
+#define SERVE_HELLO 'W'
+#define SERVE_FDS 3
+#define SERVE_BACKLOG 64
+
+// With -k, how many jobs per -j slot can finish before the oldest is printed
+#define EACH_KEEP_WINDOW 4
+
+// Starting size of a read builtin buffer, it doubles for longer lines
+#define READ_BUF_SIZE 65536
+
+// state save files start with the magic and are only loaded by the same version
+#define STATE_MAGIC "WSHS"
+#define STATE_VERSION 1
+
+// |> tee stages, files per command and the size of the pipes and copy buffer
+#define TEE_MAX_FILES 8
+#define TEE_PIPE_SIZE (1 << 20)
+#define TEE_BUF_ALIGN 4096
+
+// ls -R and du walker, most threads it starts and its getdents64 buffer size
+#define WALK_MAX_THREADS 64
+#define WALK_DENTS_SIZE 65536
+#define WALK_LIST 0
+#define WALK_DU 1
+#define WALK_DU_TOTAL 2
+
+// Profiler tables and how many lines --profile-top prints
+#define PROFILE_BUCKETS 4096
+#define PROFILE_TOP 20
+
+// Precedence of the lowest arithmetic binary operator, ||
+#define ARITH_MIN_PREC 1
+
+// Function and alias tables, and how deep calls and alias chains can go
+#define FUNC_BUCKETS 64
+#define FUNC_MAX_DEPTH 100
+#define ALIAS_MAX_DEPTH 16
+
+// States of a job in the job list
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+
+// Marks the next char of a token as quoted, removed before running
+#define CTLESC '\001'
+
+// Marks a $ that was inside double quotes so its value is quoted too
+#define CTLQUOTE '\002'
+
+// Chars the lexer stops at outside quotes
+#define LEX_SPECIAL " \t\n\r'\"\\&|;#$\001\002"
+#define LEX_MAX_SET 16
+
+// Chars a completed name needs a backslash for outside quotes
+#define COMPLETE_SPECIAL " \t\n\r'\"\\$*?[]<>&|;#(){}\001\002"
+
+// Quoted chars that later stages would otherwise treat as special
+#define QUOTED_SPECIAL "$*?[]<>&|;=(){}\\\001\002"
+
+// Glob dir cache sizing and entry type flags
+#define DIR_CACHE_BUCKETS 256
+#define DIR_CACHE_LIMIT 1024
+#define GLOB_DIR 1
+#define GLOB_LINK 2
+
+// History search index sizing
+#define TRIGRAM_BUCKETS 16384
+#define TRIGRAM_BUCKET_BITS 14
+#define TRIGRAM(p) (((uint32_t)(unsigned char)(p)[0] << 16) | ((uint32_t)(unsigned char)(p)[1] << 8) | (unsigned char)(p)[2])
+
+// Line editor keys past the single byte range
+#define KEY_NONE 256
+#define KEY_UP 257
+#define KEY_DOWN 258
+#define KEY_LEFT 259
+#define KEY_RIGHT 260
+#define KEY_HOME 261
+#define KEY_END 262
+#define KEY_DELETE 263
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+// Objects carved out of each slab in a node pool
+#define POOL_SLAB_OBJS 64
+
+// ioprio_set has no glibc wrapper or header
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
 
 // Struct acts as a node in a linked list
 struct ShellVar {
-	char var_name[SHELL_MAX_INPUT];
-	char var_val[SHELL_MAX_INPUT];
+	char* var_name;
+	char* var_val;
 	struct ShellVar* next_var;
+	struct ShellVar* next_bucket; // Next var in the same hash bucket
+	long long var_num; // var_val as a number for arithmetic, only if num_valid
+	int num_valid;
 };
 
 // Struct for tokenized user inputs
@@ -23,12 +145,260 @@ typedef struct {
 	char** tokens;
 } TokenArr;
 
+// A resource limit set by ulimit for child processes
+struct ShellLimit {
+	char flag;
+	int resource;
+	rlim_t unit;
+	const char* desc;
+	int is_set;
+	rlim_t value;
+};
+
+// Scheduling settings applied in the child before execve
+struct ChildSched {
+	int cpus_set;
+	cpu_set_t cpus;
+	int nice_set;
+	int nice_val;
+	int ioprio_set;
+	int ioprio;
+};
+
+// Name and GLOB_ type flags of one cached dir entry
+struct DirEntry {
+	char* name;
+	unsigned char type;
+};
+
+// Sorted listing of one directory, valid while its mtime is unchanged
+struct DirCache {
+	dev_t dir_dev;
+	ino_t dir_ino;
+	struct timespec dir_mtime;
+	time_t scan_time;
+	int entry_count;
+	struct DirEntry* entries;
+	struct DirCache* next_cache;
+};
+
+// Node in the list of background and stopped jobs
+struct BgJob {
+	int job_id;
+	pid_t job_pid;
+	pid_t job_pgid; // 0 when the job shares the shell's group
+	int job_state;
+	TokenArr* job_tokens;
+	struct BgJob* next_job;
+};
+
 struct HistEntry {
 	TokenArr* entry_tokens;
+	char* entry_line; // Line as typed, or tokens joined by spaces. Used for recall and search
+	unsigned int entry_seq; // Increases by one for each entry added
 	struct HistEntry* next_entry;
 	struct HistEntry* prev_entry;
 };
 
+// Seqs of the history entries holding one trigram, oldest first
+struct TrigramPosting {
+	uint32_t trigram;
+	unsigned int* seqs;
+	size_t start; // Seqs before start belonged to removed entries
+	size_t len;
+	size_t cap;
+	struct TrigramPosting* next_posting;
+};
+
+// A block of pool objects, the objects follow the header
+struct PoolSlab {
+	struct PoolSlab* next_slab;
+	_Alignas(max_align_t) unsigned char slab_objs[];
+};
+
+// Free list allocator for one fixed size node type
+struct NodePool {
+	const char* pool_name;
+	size_t obj_size;
+	void* free_list; // Free objects link through their first bytes
+	struct PoolSlab* slabs;
+	size_t slab_count;
+	size_t live_count;
+	size_t peak_count;
+};
+
+// A sourced file's lines, tokenized once and reused while the file is unchanged
+struct SourceFile {
+	dev_t file_dev;
+	ino_t file_ino;
+	struct timespec file_mtime;
+	off_t file_size;
+	time_t parse_time;
+	int use_count; // Running source calls, a stale file is freed once this is 0
+	int stale;
+	int line_count;
+	TokenArr** lines; // NULL for a line that failed to tokenize
+	int* line_nums; // Each line's number in the file for the profiler
+	struct SourceFile* next_file;
+};
+
+// A connection to wsh --serve and the process running its script
+struct ServeSession {
+	pid_t session_pid;
+	int session_fd;
+	struct ServeSession* next_session;
+};
+
+// One run of the each template, its output is held until the job is printed
+struct EachJob {
+	pid_t job_pid;
+	int pid_fd;
+	int out_fd; // memfds for the job's stdout and stderr
+	int err_fd;
+	int job_status;
+	int job_done;
+};
+
+// Read ahead for the read builtin, kept per fd or per file for a < redirect
+struct ReadBuffer {
+	int read_fd;
+	int is_redirect; // Reads a < redirect's file, dropped when the redirect ends
+	dev_t file_dev;
+	ino_t file_ino;
+	char* buf;
+	size_t buf_cap;
+	size_t buf_start; // Unread data is buf[buf_start..buf_end)
+	size_t buf_end;
+	struct ReadBuffer* next_buffer;
+};
+
+// Start of a state save file. After it come data_len bytes of NUL ended
+// strings, the cwd, then name and val of each var in the order they were
+// added, each env var as NAME=VAL, then each history entry oldest first
+// as a 4 byte token count and its tokens
+struct StateHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t var_count;
+	uint32_t env_count;
+	uint32_t hist_count;
+	uint32_t hist_limit;
+	uint64_t data_len;
+};
+
+// A command's stdout being copied to files by a writer thread
+struct TeeStage {
+	pthread_t writer;
+	int in_fd; // Read end of the pipe that is the command's stdout
+	int out_fd; // Where stdout went before, the first target
+	int saved_stdout; // Put back on fd 1 once the command is done
+	int side_pipe[2]; // tee(2) copies into here before it is spliced to a file
+	int file_fds[TEE_MAX_FILES];
+	int file_count;
+	char* buf; // For targets splice can't write to
+	int detached; // Set for & jobs, the writer frees the stage at EOF
+};
+
+// One name in a walked dir, subdir is set for dirs that are walked too
+struct WalkEntry {
+	char* entry_name;
+	long long entry_blocks; // 512 byte blocks, only filled in for du
+	int is_dir;
+	struct WalkDir* subdir;
+};
+
+// A dir of the walk, entries are sorted once it has been read
+struct WalkDir {
+	char* dir_path; // From the walk's root, . for the root
+	char* names; // One allocation for all of the entry names
+	struct WalkEntry* entries;
+	int entry_count;
+	int walk_error;
+};
+
+// A worker's dirs to read. The owner takes the newest for depth first
+// order, idle workers steal the oldest which are nearer the root
+struct WalkQueue {
+	pthread_mutex_t queue_lock;
+	struct WalkDir** dirs;
+	size_t queue_head;
+	size_t queue_tail;
+	size_t queue_cap;
+};
+
+// Shared by the workers of one walk
+struct DirWalk {
+	int root_fd;
+	int walk_mode;
+	int worker_count;
+	long pending; // Dirs queued or being read, the walk ends at 0
+	struct WalkQueue queues[WALK_MAX_THREADS];
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work_ready; // Signalled on a push and broadcast when pending reaches 0
+	int idle_count; // Workers sleeping on work_ready
+};
+
+// A worker thread's walk and its own queue
+struct WalkWorker {
+	pthread_t worker_thread;
+	struct DirWalk* my_walk;
+	int worker_index;
+};
+
+// Where an arithmetic expression is being read
+struct ArithParser {
+	char* expr_pos;
+	int skip_depth; // Inside the unused side of && or || nothing is assigned
+	int arith_error;
+};
+
+// Profiler totals for one folded stack or one frame label
+struct ProfileEntry {
+	char* entry_key;
+	char* entry_text; // The line's text for --profile-top, NULL for stacks
+	long wall_us;
+	long cpu_us;
+	long spawns;
+	long calls;
+	struct ProfileEntry* next_entry;
+};
+
+// A running line, function or history recall in the profiler
+struct ProfileFrame {
+	char* stack_key; // Labels of the frames down to this one joined with ;
+	char* frame_label; // Points into stack_key
+	struct timespec start;
+	long start_cpu_us;
+	long start_spawns;
+	long nested_wall_us; // Time spent in frames called by this one
+	long nested_cpu_us;
+	long nested_spawns;
+};
+
+// A function or alias, its body is tokenized once when it is defined
+struct ShellFunc {
+	char* func_name;
+	TokenArr* func_body;
+	struct ShellFunc* next_func;
+};
+
+// Node in the command name trie, children are kept sorted
+struct TrieNode {
+	char node_char;
+	int is_word;
+	int word_count; // Words ending at or below this node
+	struct TrieNode* first_child;
+	struct TrieNode* next_sibling;
+};
+
+// A growable line of text with a cursor
+struct EditLine {
+	char* text;
+	size_t len;
+	size_t cap;
+	size_t pos;
+};
+
 // Commands must be added to end to preserve indices
 const char* COMMAND_ARR[] = 
 {
@@ -38,7 +408,28 @@ const char* COMMAND_ARR[] =
 	"export",
 	"local",
 	"vars",
-	"history"
+	"history",
+	"set",
+	"timeout",
+	"ulimit",
+	"cpus",
+	"nice",
+	"ionice",
+	"jobs",
+	"fg",
+	"bg",
+	"mem",
+	"source",
+	".",
+	"alias",
+	"unalias",
+	"each",
+	"let",
+	"read",
+	"state",
+	"exec",
+	"du",
+	"pwd"
 };
 
 // BUILT IN FUNCTIONS
@@ -55,12 +446,99 @@ void wshExit();
 **/
 int wshLs();
 
+/**
+* Built in command du [-s] [-h|-k] [DIR...], walks each DIR in turn
+**/
+int wshDu(TokenArr* my_tokens);
+
+/**
+* Reads du's flags into walk_mode and human_sizes. Returns the index of the
+* first path, or -1 for a flag only the du on PATH has
+**/
+int parseDuFlags(TokenArr* my_tokens, int* walk_mode, int* human_sizes);
+
+/**
+* Prints one du line, in KB or with a K, M or G suffix for -h
+**/
+void printDuSize(long long size_kb, char* print_path, int human_sizes);
+
+/**
+* Built in command ls -R [DIR] and the walk behind du.
+* Reads the tree with a pool of threads and prints it sorted, each path
+* for ls -R or each dir's size after its subdirs for du
+**/
+int wshWalk(char* root_path, int walk_mode, int human_sizes);
+
+/**
+* Worker thread, reads dirs from its own queue or steals from the others
+* and sleeps on work_ready when there are none, until no dirs are left
+**/
+void* walkWorker(void* worker_arg);
+
+/**
+* Takes a dir from a worker's own queue, or steals one from another's
+**/
+struct WalkDir* findWalkDir(struct DirWalk* my_walk, int worker_index);
+
+/**
+* Reads one dir with getdents64, sorts its entries and queues its subdirs
+**/
+void readWalkDir(struct DirWalk* my_walk, struct WalkDir* my_dir, int worker_index);
+
+/**
+* Adds a dir to a worker's queue
+**/
+int pushWalkDir(struct DirWalk* my_walk, int worker_index, struct WalkDir* my_dir);
+
+/**
+* Takes the newest dir from a worker's own queue, or the oldest when stealing
+**/
+struct WalkDir* takeWalkDir(struct WalkQueue* my_queue, int steal);
+
+/**
+* Prints the walked tree in order, returns the blocks under my_dir
+**/
+long long printWalkDir(struct WalkDir* my_dir, char* print_path, int walk_mode, int human_sizes, int* had_error);
+
+/**
+* Frees a walked dir and everything under it
+**/
+void freeWalkDir(struct WalkDir* my_dir);
+
 /**
 *	Shell change directory command.
-*	Takes param to new dir 
+*	Takes param to new dir, - for OLDPWD, and looks relative names up in CDPATH
 **/
 int wshCd(char* new_dir);
 
+/**
+* Built in command pwd [-L|-P], prints the cached cwd or with -P the real one
+**/
+int wshPwd(int physical);
+
+/**
+* Returns the cached cwd, only checking it against the real dir when it is stale
+* NULL if the cwd can't be found
+**/
+char* getCwd();
+
+/**
+* Caches the new cwd and updates PWD and OLDPWD, takes ownership of new_cwd
+**/
+void setCwd(char* new_cwd);
+
+/**
+* Joins rel_path onto base_path and removes ., .. and repeated slashes
+* without looking at the filesystem. Returns a malloced path
+**/
+char* normalizePath(char* base_path, char* rel_path);
+
+/**
+* Finds new_dir under the CDPATH dirs, returns the malloced path or NULL
+* used_entry is set when a non empty CDPATH entry matched
+**/
+char* findCdPath(char* new_dir, int* used_entry);
+
 /**
 * Sets environment variable var_name=var_val
 **/
@@ -87,108 +565,1073 @@ int wshGetHist();
 **/
 int wshSetHist(int new_size);
 
+/**
+* Built in command that runs a command and kills it
+* if it hasn't exited within timeout_ms. Returns 124 on a timeout
+**/
+int wshTimeout(long timeout_ms, TokenArr* my_tokens);
 
-// Internal shell functions
+/**
+* Built in command that runs a command pinned to the cpus in cpu_list
+**/
+int wshCpus(char* cpu_list, TokenArr* my_tokens);
 
 /**
-* Gets the index of a built in command in the COMMAND_ARR
-* Returns -1 if command isnt built in
+* Built in command that runs a command with its niceness raised by nice_val.
+* The command starts shift tokens into my_tokens
 **/
-int checkBuiltIn(char* my_command);
+int wshNice(int nice_val, int shift, TokenArr* my_tokens);
 
 /**
-* Retrieves the variable value associated with the variable name.
-* If the variable is not found then return empty string
+* Built in command that runs a command with the given I/O class and level.
+* The command starts shift tokens into my_tokens
 **/
-char* getShellVar(char* var_name);
+int wshIonice(int io_class, int io_level, int shift, TokenArr* my_tokens);
 
 /**
-* Gets the index of a shell variable denoted by
-* the var_name
+* Built in command that lists background and stopped jobs
 **/
-int findShellVar(char* var_name);
+int wshJobs();
 
 /**
-* Frees the memory allocated by the my_tokens variable.
-* my_tokens and its contents must be allocated
+* Built in command that continues a job in the foreground and waits on it.
+* job_arg is %N or N, or NULL for the most recent job
 **/
-void freeTokenArr(TokenArr* my_tokens);
+int wshFg(char* job_arg);
 
 /**
-* Runs the program indefinitely until exit or eof
+* Built in command that continues a stopped job in the background
 **/
-void programLoop(FILE* input_stream);
+int wshBg(char* job_arg);
 
 /**
-* Replaces any shell vars in the tokens with their variable value
-**/ 
-int substituteShellVars(TokenArr* my_tokens);
+* Built in command that reports live objects and bytes in each node pool
+* along with the total heap in use
+**/
+int wshMem();
 
 /**
-* Retrieves the next line in the program.
-* The retrieved line and its length are stored within
-* *input_buffer and *input_size respectively
+* Built in command that runs each line of a file in the current shell.
+* Returns the status of the last command run
 **/
-int parseInputs(char* input_buffer, int* input_size, FILE* input_stream);
+int wshSource(char* file_path);
 
+/**
+* Finds the cached lines of a file, tokenizing it again if it changed
+* since it was cached or was cached in the same second it was written
+**/
+struct SourceFile* getSourceFile(char* file_path);
 
 /**
-* Takes in two TokenArrs, arr1 and arr2, and returns 0 if ne and 1 if equal
+* Reads and tokenizes every line of a stream into a new SourceFile
 **/
-int tokenCmp(TokenArr* arr1, TokenArr* arr2);
+struct SourceFile* parseSourceFile(FILE* src_stream);
 
 /**
-* Creates a copy of the TokenArr* including a tokens** field which points
-* to a separate region in memory
+* Frees a SourceFile and its lines
 **/
-TokenArr* copyTokenArr(TokenArr* my_tokens);
+void freeSourceFile(struct SourceFile* my_file);
 
 /**
-* Pushes entry into the command history list.
-* If input exceeds the size limit, removes the last entry
+* Frees every cached SourceFile
 **/
-int addHistEntry(TokenArr* my_tokens);
+void freeSourceCache();
 
 /**
-* Returns the HistEntry ptr to the entry at the given index
+* Built in command that defines each NAME=VALUE arg as an alias
+* and prints each NAME arg's alias, or every alias with no args
 **/
-struct HistEntry* getHistEntry(int index);
+int wshAlias(TokenArr* my_tokens);
 
 /**
-* Determines which command is going to be run
-* If command is wsh built-in command, input is checked and/or sanitized
+* Prints an alias the way it could be defined again
 **/
-int runCommand(TokenArr* my_tokens);
+void printAlias(struct ShellFunc* my_alias);
 
 /**
-* Removes the tail entry of the history list
+* qsort comparator ordering functions and aliases by name
 **/
-void removeHistEntry();
+int cmpShellFuncs(const void* lhs, const void* rhs);
 
 /**
-* Retrieves the path to a program in the following order.
-* 1. Looks for a relative path.
-* 2. Looks for a full path.
-* 3. Looks for a path within $PATH
+* Returns the user and system CPU time of waited children in us
 **/
-char* getPath(TokenArr* my_tokens);
+long childCpuUs();
 
 /**
-* Separates the input across token '='.
-* Returns a TokenArr of the inputs
+* Finds the profiler entry for entry_key, adding it if it is new
 **/
-TokenArr* tokenizeString(char* my_str);
+struct ProfileEntry* findProfileEntry(struct ProfileEntry** entry_buckets, char* entry_key);
 
 /**
-* Returns the symbol(s) associated with the redirect token
-* NULL if no redirect is done
+* Starts timing a script line, function call or history recall.
+* The text for --profile-top comes from frame_text or else frame_tokens
 **/
-char* getRedirect(char* my_token);
+int profileEnter(char* frame_label, char* frame_text, TokenArr* frame_tokens);
 
 /**
-* Performs the given redirect action
+* Stops timing the newest frame, its self time goes to its folded stack
+* and its total time to its label
 **/
-int performRedirect(char* my_redirect, char* my_token);
+void profileLeave();
+
+/**
+* Writes the folded stacks to profile_path, profile_path.cpu and
+* profile_path.spawns, and with --profile-top the slowest lines to stderr
+**/
+int writeProfile();
+
+/**
+* Frees the profiler tables
+**/
+void freeProfile();
+
+/**
+* Built in command each [-j N] [-k] cmd args... [::: items...].
+* Runs cmd once per item with {} in its args replaced by the item, or the item
+* added last if there is no {}. Items come from stdin lines without :::.
+* Up to N jobs run at once, and each job's output is printed in one piece
+* when it finishes, or in item order with -k.
+* Returns the number of failed jobs, up to 101
+**/
+int wshEach(TokenArr* my_tokens);
+
+/**
+* Reads stdin into one item per line
+**/
+int readEachItems(TokenArr* my_items);
+
+/**
+* Builds the args of one job by putting my_item into the template
+**/
+char** buildEachArgs(char** template_tokens, int template_count, char* my_item);
+
+/**
+* Forks a job with its output going to new memfds
+**/
+int startEachJob(struct EachJob* my_job, char* path_val, char** job_args);
+
+/**
+* Writes a finished job's held output to stdout and stderr and closes it
+**/
+void printEachJob(struct EachJob* my_job);
+
+/**
+* Built in command read [-r] [-u FD] [VAR...].
+* Reads a line from stdin or fd FD and splits it on spaces and tabs into
+* the vars, the last var gets the rest of the line. REPLY gets the
+* whole line if no vars are given. Returns 1 at EOF.
+* With a < redirect, each read continues from where the last read of
+* that file stopped
+**/
+int wshRead(TokenArr* my_tokens);
+
+/**
+* Takes the next line from the shell's own stdin reader, so read gets the
+* line after it in a script piped to the shell. Returns its length, -1 at EOF
+**/
+ssize_t readShellLine(char** my_line);
+
+/**
+* Gets the buffer for fd, making it if needed and resetting it if fd
+* was reopened on a different file
+**/
+struct ReadBuffer* getReadBuffer(int read_fd);
+
+/**
+* Gets the next line from the buffer without its newline.
+* Returns its length, or -1 at EOF or on an error
+**/
+ssize_t readBufferLine(struct ReadBuffer* my_buffer, char** my_line);
+
+/**
+* Seeks fds back over data read ahead but not used, so a child reading
+* the same fd starts where read left off. Pipes can't seek and keep it
+**/
+void syncReadBuffers();
+
+/**
+* Frees a read buffer
+**/
+void removeReadBuffer(struct ReadBuffer* my_buffer);
+
+/**
+* Frees the buffers of a < redirect so the next read of the file starts
+* from a fresh open, called as the redirect is undone
+**/
+void dropRedirectBuffers();
+
+/**
+* Frees every read buffer
+**/
+void freeReadBuffers();
+
+/**
+* Built in command exec cmd args..., replaces the shell with cmd keeping
+* any redirect on the line. With no cmd the redirect is kept for the rest
+* of the shell. Only returns if cmd can't be run
+**/
+int wshExec(TokenArr* my_tokens);
+
+/**
+* Sets up like a forked child and execve's path_val in place of the shell.
+* Returns -1 without changing the shell if path_val can't be run
+**/
+int execInPlace(char* path_val, TokenArr* my_tokens);
+
+/**
+* Puts back the limits, cpus, niceness and I/O priority execInPlace saved.
+* A setting that can't be undone is cleared from childSched so the fork
+* that follows doesn't apply it a second time
+**/
+void restoreShellSched(struct rlimit* saved_limits, cpu_set_t* saved_cpus, int saved_nice, int saved_ioprio);
+
+/**
+* Built in command state save FILE or state load FILE.
+* save writes the vars, env, history and cwd to FILE, load restores them
+**/
+int wshState(TokenArr* my_tokens);
+
+/**
+* Appends data to a growing buffer, returns -1 if it can't grow
+**/
+int appendState(char** state_buf, size_t* state_len, size_t* state_cap, const void* my_data, size_t data_len);
+
+/**
+* Writes the shell state to a temp file and renames it over file_path
+**/
+int saveState(char* file_path);
+
+/**
+* Maps a state file, checks all of it, then sets the vars and env, replaces
+* the history and changes to the saved cwd
+**/
+int loadState(char* file_path);
+
+/**
+* Gets the next NUL ended string at cursor and moves past it.
+* Returns NULL if the string runs past state_end
+**/
+char* nextStateString(char** cursor, char* state_end);
+
+/**
+* Built in command that removes an alias
+**/
+int wshUnalias(char* alias_name);
+
+/**
+* Finds a function or alias by name in the given table
+**/
+struct ShellFunc* findShellFunc(struct ShellFunc** func_buckets, char* func_name);
+
+/**
+* Adds or replaces a function or alias, the table takes the body
+**/
+int setShellFunc(struct ShellFunc** func_buckets, char* func_name, TokenArr* func_body);
+
+/**
+* Frees every function or alias in the given table
+**/
+void freeShellFuncs(struct ShellFunc** func_buckets);
+
+/**
+* Checks for a line starting with NAME() {
+**/
+int isFuncStart(TokenArr* my_tokens);
+
+/**
+* Starts a function from a NAME() { line, the body is read
+* until a line ending in }
+**/
+int defineFunction(TokenArr* my_tokens);
+
+/**
+* Adds the tokens from start onward to the function being defined,
+* ending the definition if the last one is }
+**/
+int addFuncLine(TokenArr* my_tokens, int start);
+
+/**
+* Runs a copy of a function's body with the call's tokens as $1..$n
+**/
+int callShellFunc(struct ShellFunc* my_func, TokenArr* my_tokens);
+
+/**
+* Runs a function called with & in a forked copy of the shell, added as a job
+**/
+int backgroundShellFunc(struct ShellFunc* my_func, TokenArr* my_tokens);
+
+/**
+* Replaces each alias in command position with its tokens
+**/
+int expandAliases(TokenArr* my_tokens);
+
+/**
+* Saves the redirect globals and clears them for a nested run of lines
+**/
+void stashFileDescs(int* saved_descs);
+
+/**
+* Puts back redirect globals saved by stashFileDescs
+**/
+void unstashFileDescs(int* saved_descs);
+
+/**
+* Built in command that prints or sets the limits given to children.
+* my_flag is 0 to print all limits, my_val is NULL to print one
+**/
+int wshUlimit(char my_flag, char* my_val);
+
+/**
+* Built in command that toggles shell options.
+* -e exits on a failed command, +e turns that back off
+**/
+int wshSet(char* my_option);
+
+
+// Internal shell functions
+
+/**
+* Gets the index of a built in command in the COMMAND_ARR
+* Returns -1 if command isnt built in
+**/
+int checkBuiltIn(char* my_command);
+
+/**
+* Retrieves the variable value associated with the variable name.
+* If the variable is not found then return empty string
+**/
+char* getShellVar(char* var_name);
+
+/**
+* Gets the shell variable denoted by the var_name
+* Returns NULL if the var isn't set
+**/
+struct ShellVar* findShellVar(char* var_name);
+
+/**
+* FNV-1a hash used to index the shell vars
+**/
+unsigned long hashVarName(char* var_name);
+
+/**
+* Doubles the number of var hash buckets and rehashes every var
+**/
+int growVarBuckets();
+
+/**
+* Frees the memory allocated by the my_tokens variable.
+* my_tokens and its contents must be allocated
+**/
+void freeTokenArr(TokenArr* my_tokens);
+
+/**
+* Serves scripts sent over a Unix socket until SIGTERM or SIGINT.
+* Each connection runs in a forked copy of the server, so sessions have
+* their own vars and cwd but start from whatever init_path set up.
+* Only returns on a setup error
+**/
+int wshServe(char* sock_path, char* init_path);
+
+/**
+* Binds and listens on a Unix socket, replacing a stale socket file
+**/
+int openServeSocket(char* sock_path);
+
+/**
+* Runs one connection's script in a forked session, never returns
+**/
+void runServeSession(int conn_fd);
+
+/**
+* Runs the program indefinitely until exit or eof
+**/
+void programLoop(FILE* input_stream);
+
+/**
+* Runs one tokenized line, or stores it if a function body is being read.
+* Returns the status of the line
+**/
+int runLine(TokenArr* my_tokens);
+
+/**
+* Replaces any shell vars in the tokens with their variable value
+**/ 
+int substituteShellVars(TokenArr* my_tokens);
+
+/**
+* Replaces every $((expr)) in the tokens with the value of expr
+**/
+int expandArithmetic(TokenArr* my_tokens);
+
+/**
+* Evaluates an integer expression with C operators and assignment to
+* shell vars, returns -1 on a syntax error or division by zero
+**/
+int evalArithmetic(char* my_expr, long long* expr_val);
+
+/**
+* Reads an assignment or, if there is none, a binary expression
+**/
+long long parseArithAssign(struct ArithParser* my_parser);
+
+/**
+* Reads binary operators of at least min_prec by precedence climbing
+**/
+long long parseArithBinary(struct ArithParser* my_parser, int min_prec);
+
+/**
+* Reads a unary operator, a number, a var or a bracketed expression
+**/
+long long parseArithUnary(struct ArithParser* my_parser);
+
+/**
+* Gets the binary operator at op_str, returns its precedence or 0 if there is none
+**/
+int arithOperator(char* op_str, int* op_len);
+
+/**
+* Checks for an op like += or <<= and gets the length of the op before the =
+**/
+int isCompoundAssign(char* op_str, int* op_len);
+
+/**
+* Applies a binary or compound assignment operator
+**/
+long long applyArithOp(struct ArithParser* my_parser, char* op_str, int op_len, long long lhs, long long rhs);
+
+/**
+* Gets a var as a number, using the var's cached number when it has one
+**/
+int getArithVar(char* var_name, long long* var_num);
+
+/**
+* Sets a var to a number and caches the number on the var
+**/
+int setArithVar(char* var_name, long long var_num);
+
+/**
+* Built in command let expr..., evaluates each expr.
+* Returns 0 if the last value is non zero, 1 if it is 0
+**/
+int wshLet(TokenArr* my_tokens);
+
+/**
+* Retrieves the next line in the program.
+* The retrieved line and its length are stored within
+* *input_line and *input_size respectively.
+* The line is only valid until the next call
+**/
+int parseInputs(char** input_line, ssize_t* input_size, FILE* input_stream);
+
+
+/**
+* Sets up the epoll loop for interactive input.
+* Watches stdin and a signalfd for SIGCHLD, so an idle shell never wakes
+**/
+int initEventLoop();
+
+/**
+* Closes the event loop fds and unblocks SIGCHLD.
+* Also restores the terminal and frees the line editor
+**/
+void freeEventLoop();
+
+/**
+* Waits in the event loop until a full line of input is buffered.
+* The line is handed back in place in the reader buffer.
+* Background jobs are reaped and idle work is done while waiting
+**/
+int readEventLoop(char** input_line, ssize_t* input_size);
+
+/**
+* Reads whatever stdin has ready into the reader buffer
+**/
+int fillReader();
+
+/**
+* Returns 1 once the input stream has no lines left
+**/
+int inputAtEOF(FILE* input_stream);
+
+/**
+* Turns on the line editor when stdin is a terminal
+**/
+int initLineEditor();
+
+/**
+* Starts editing a new line and puts the terminal in raw mode
+**/
+void beginEditLine();
+
+/**
+* Puts the terminal back in the mode it was in before editing
+**/
+void endEditLine();
+
+/**
+* Runs the buffered input through the line editor.
+* Returns 1 once enter is pressed with the line in *input_line,
+* 0 if more input is needed
+**/
+int editReader(char** input_line, ssize_t* input_size);
+
+/**
+* Decodes the key at the front of the reader buffer into *key_len bytes.
+* Returns -1 if an escape sequence is only partly read
+**/
+int decodeKey(size_t* key_len);
+
+/**
+* Applies one key to the line or to the search
+**/
+int editKey(int my_key, char** input_line, ssize_t* input_size);
+
+/**
+* Applies one key while in Ctrl-R search mode.
+* Returns 1 if the key should also be applied to the line
+**/
+int searchKey(int my_key);
+
+/**
+* Redraws only the part of the line that differs from what is shown
+**/
+void refreshEditLine();
+
+/**
+* Forgets what is shown so the next refresh redraws the whole line
+**/
+void resetEditShown();
+
+/**
+* Completes the word before the cursor in my_line.
+* The first word is completed from the command trie, $ words from
+* env and shell vars and anything else from file paths.
+* Returns the number of matches, and fills my_matches when
+* nothing could be added and there is more than one
+**/
+int completeWord(struct EditLine* my_line, TokenArr* my_matches);
+
+/**
+* Reads the word before the cursor the way the lexer would into my_word,
+* with its quotes and backslashes removed. Sets the quote still open at
+* the cursor and whether the word is a $ var. Returns 1 for the first word
+**/
+int scanEditWord(struct EditLine* my_line, struct EditLine* my_word, char* open_quote, int* var_word);
+
+/**
+* Inserts completed text, escaped for the quote the word is in
+**/
+int insertCompletion(struct EditLine* my_line, const char* my_text, size_t text_len, char open_quote);
+
+/**
+* Closes the word's open quote and adds a space after a lone match
+**/
+int finishCompletion(struct EditLine* my_line, char open_quote);
+
+/**
+* Finds file names in the word's dir that start with its last part
+**/
+int collectFileMatches(char* my_word, TokenArr* my_matches);
+
+/**
+* Finds env and shell var names that start with var_prefix
+**/
+int collectVarMatches(char* var_prefix, TokenArr* my_matches);
+
+/**
+* Inserts text into a line at its cursor
+**/
+int insertEditText(struct EditLine* my_line, const char* my_text, size_t text_len);
+
+/**
+* Rebuilds the command trie from the builtins and PATH if PATH
+* or the mtime of one of its dirs changed since it was built
+**/
+int refreshCommandTrie();
+
+/**
+* Adds a word to the trie under root
+**/
+int trieInsert(struct TrieNode* root, const char* my_word);
+
+/**
+* Returns the node where my_prefix ends or NULL if no word starts with it
+**/
+struct TrieNode* trieFind(struct TrieNode* root, const char* my_prefix, size_t prefix_len);
+
+/**
+* Adds every word below node to my_matches, with my_word holding the chars up to node
+**/
+int trieCollect(struct TrieNode* node, struct EditLine* my_word, TokenArr* my_matches);
+
+/**
+* Frees a trie node and everything below it
+**/
+void freeTrie(struct TrieNode* node);
+
+/**
+* Frees the command trie and the PATH state it was built from
+**/
+void freeCompletion();
+
+/**
+* Takes an object from the pool, carving a new slab when the free list is empty
+**/
+void* poolAlloc(struct NodePool* my_pool);
+
+/**
+* Returns an object to its pool's free list
+**/
+void poolFree(struct NodePool* my_pool, void* my_obj);
+
+/**
+* Frees every slab in a pool, live objects included
+**/
+void freePool(struct NodePool* my_pool);
+
+/**
+* Prints a line for each pool that still has live objects.
+* Returns the number of leaked objects
+**/
+size_t reportLeaks();
+
+/**
+* Makes room for need chars plus a terminator in a line
+**/
+int growEditLine(struct EditLine* my_line, size_t need);
+
+/**
+* Replaces the text of a line and moves its cursor to the end
+**/
+int setEditLine(struct EditLine* my_line, const char* my_text, size_t text_len);
+
+/**
+* Adds a forked child to the job list as running or stopped
+**/
+int addBgJob(pid_t job_pid, TokenArr* my_tokens, int job_state);
+
+/**
+* Reaps any finished jobs and tracks jobs that stop or continue.
+* Prints a notice for each one if notify is set.
+* Returns the number of jobs reaped or newly stopped
+**/
+int reapJobs(int notify);
+
+/**
+* Prints a job as [id] state command
+**/
+void printJob(struct BgJob* my_job, const char* state_str);
+
+/**
+* Finds a job from %N or N, or the most recent job if job_arg is NULL
+**/
+struct BgJob* findJob(char* job_arg);
+
+/**
+* Unlinks a job from the job list and frees it
+**/
+void removeJob(struct BgJob* my_job);
+
+/**
+* Sends a signal to every process in a job
+**/
+int signalJob(struct BgJob* my_job, int sig);
+
+/**
+* Hangs up any stopped jobs if hang_up is set and frees the job list on exit
+**/
+void freeJobs(int hang_up);
+
+/**
+* Turns on job control when stdin is a terminal.
+* The shell takes its own process group and the terminal,
+* and ignores the signals a terminal sends to the foreground job
+**/
+int initJobControl();
+
+/**
+* Gives the terminal to the given process group if job control is on
+**/
+void giveTerminal(pid_t my_pgid);
+
+/**
+* Puts a forked child in its own process group and restores the
+* signals the shell ignores. Only called in the child before execve
+**/
+void setupChildJob();
+
+/**
+* Takes in two TokenArrs, arr1 and arr2, and returns 0 if ne and 1 if equal
+**/
+int tokenCmp(TokenArr* arr1, TokenArr* arr2);
+
+/**
+* Creates a copy of the TokenArr* including a tokens** field which points
+* to a separate region in memory
+**/
+TokenArr* copyTokenArr(TokenArr* my_tokens);
+
+/**
+* Pushes entry into the command history list.
+* If input exceeds the size limit, removes the last entry
+**/
+int addHistEntry(TokenArr* my_tokens);
+
+/**
+* Returns the HistEntry ptr to the entry at the given index
+**/
+struct HistEntry* getHistEntry(int index);
+
+/**
+* Finds the posting list for a trigram.
+* Creates an empty one if create is set and the index is built
+**/
+struct TrigramPosting* findPosting(uint32_t trigram, int create);
+
+/**
+* Joins the tokens with spaces into a new string
+**/
+char* joinTokens(TokenArr* my_tokens);
+
+/**
+* Gives a new history entry its line and seq, the typed line when there is one.
+* Its trigrams are only indexed once the index has been built
+**/
+int indexHistEntry(struct HistEntry* my_entry);
+
+/**
+* Adds a history entry's seq to the posting list of each of its trigrams
+**/
+int addTrigrams(struct HistEntry* my_entry);
+
+/**
+* Builds the trigram index over every history entry, run by the first search
+**/
+int buildTrigramIndex();
+
+/**
+* Frees the trigram index and its posting lists
+**/
+void freeTrigramIndex();
+
+/**
+* Drops the oldest history entry's seq from its posting lists
+**/
+void unindexHistEntry(struct HistEntry* my_entry);
+
+/**
+* Returns the history entry with the given seq or NULL if it was removed
+**/
+struct HistEntry* histEntryBySeq(unsigned int seq);
+
+/**
+* Finds the newest history entry older than before_seq whose line contains query.
+* Lines are only compared against the rarest trigram's posting list
+**/
+struct HistEntry* searchHistory(char* query, unsigned int before_seq);
+
+/**
+* Runs a line split into segments by &&, || and ;.
+* Later segments only run when the operator before them allows it.
+* Returns the status of the last segment that ran
+**/
+int runCommandList(TokenArr* my_tokens);
+
+/**
+* Substitutes vars, applies any redirect and runs one command
+**/
+int runSegment(TokenArr* my_tokens);
+
+/**
+* Replaces each token holding *, ? or [ with the sorted paths it matches.
+* Tokens that match nothing are left as typed
+**/
+int expandGlobs(TokenArr* my_tokens);
+
+/**
+* Globs the token at *index and splices the matches into my_tokens.
+* *index is moved to the last match
+**/
+int expandGlobToken(TokenArr* my_tokens, int* index);
+
+/**
+* Appends every path matching my_pattern to my_matches.
+* Supports *, ?, [...] within a segment and ** across dirs
+**/
+int globToken(char* my_pattern, TokenArr* my_matches);
+
+/**
+* Matches segments[seg_index] onwards under base_path
+**/
+int globWalk(char* base_path, char** segments, int seg_count, int seg_index, TokenArr* my_matches);
+
+/**
+* Frees the paths in a match list that was never spliced in
+**/
+void freeMatches(TokenArr* my_matches);
+
+/**
+* Appends a copy of my_path to my_matches
+**/
+int addGlobMatch(TokenArr* my_matches, char* my_path);
+
+/**
+* Returns base_path/my_name in a new string
+**/
+char* joinPath(char* base_path, char* my_name);
+
+/**
+* Returns 1 if the string has any unquoted glob characters
+**/
+int hasGlobChars(char* my_str);
+
+/**
+* Removes the backslash escapes from a literal glob segment
+**/
+void unescapeGlob(char* my_str);
+
+/**
+* qsort comparator for an array of strings
+**/
+int cmpStrings(const void* lhs, const void* rhs);
+
+/**
+* Returns the cached listing of dir_path.
+* The dir is only read again if its mtime changed since the last scan
+**/
+struct DirCache* getDirCache(char* dir_path);
+
+/**
+* Reads and sorts every entry of dir_path into my_cache
+**/
+int scanDir(char* dir_path, struct DirCache* my_cache);
+
+/**
+* Frees one cached listing
+**/
+void freeDirCacheEntry(struct DirCache* my_cache);
+
+/**
+* Frees a listing dropped from the cache, or holds it
+* until the current glob finishes walking it
+**/
+void retireDirCacheEntry(struct DirCache* my_cache);
+
+/**
+* qsort comparator for cached dir entries
+**/
+int cmpDirEntries(const void* lhs, const void* rhs);
+
+/**
+* Frees every cached listing
+**/
+void freeDirCache();
+
+/**
+* Returns 1 if the token is &&, || or ;
+**/
+int isListOperator(char* my_token);
+
+/**
+* Creates a copy of the tokens in [start, end) as a new TokenArr
+**/
+TokenArr* sliceTokenArr(TokenArr* my_tokens, int start, int end);
+
+/**
+* Waits on the child and returns its exit status.
+* Children killed by a signal return 128 + the signal number.
+* With job control *stopped is set if the child was stopped instead
+**/
+int waitChild(pid_t child_pid, int* stopped);
+
+/**
+* Waits on the child with a pidfd and poll.
+* Kills the child once timeout_ms passes
+**/
+int waitChildTimeout(pid_t child_pid, long timeout_ms, int* stopped);
+
+/**
+* Returns the ms passed since start
+**/
+long elapsedMs(struct timespec* start);
+
+/**
+* Returns the us passed since start
+**/
+long elapsedUs(struct timespec* start);
+
+/**
+* Applies the ulimit settings to the calling process.
+* Only called in the child before execve
+**/
+int applyChildLimits();
+
+/**
+* Applies the cpu, nice and I/O settings to the calling process.
+* Only called in the child before execve
+**/
+int applyChildSched();
+
+/**
+* Parses a list like 0-3,6 into my_cpus
+**/
+int parseCpuList(char* cpu_list, cpu_set_t* my_cpus);
+
+/**
+* Runs the command that starts shift tokens into my_tokens.
+* Used by prefix builtins such as timeout and nice
+**/
+int runShifted(TokenArr* my_tokens, int shift);
+
+/**
+* Converts a raw wait status into a shell exit status
+**/
+int decodeStatus(int status);
+
+/**
+* Determines which command is going to be run
+* If command is wsh built-in command, input is checked and/or sanitized
+**/
+int runCommand(TokenArr* my_tokens);
+
+/**
+* Removes the tail entry of the history list
+**/
+void removeHistEntry();
+
+/**
+* Retrieves the path to a program in the following order.
+* 1. Looks for a relative path.
+* 2. Looks for a full path.
+* 3. Looks for a path within $PATH
+**/
+char* getPath(TokenArr* my_tokens);
+
+/**
+* Splits the input into words on runs of spaces and tabs.
+* Handles single and double quotes, backslash escapes and && || &.
+* Quoted special chars are marked with CTLESC.
+* Returns NULL on an unterminated quote
+**/
+TokenArr* tokenizeString(char* my_str);
+
+/**
+* Returns the index of the first byte of my_str found in byte_set,
+* or len if there is none. Uses AVX2 or SSE2 when available
+**/
+size_t scanBytes(const char* my_str, size_t len, const char* byte_set);
+
+/**
+* Byte at a time version of scanBytes
+**/
+size_t scanBytesScalar(const char* my_str, size_t len, const char* byte_set);
+
+#if defined(__x86_64__)
+/**
+* scanBytes over 16 byte blocks
+**/
+size_t scanBytesSse2(const char* my_str, size_t len, const char* byte_set);
+
+/**
+* scanBytes over 32 byte blocks
+**/
+size_t scanBytesAvx2(const char* my_str, size_t len, const char* byte_set);
+#endif
+
+/**
+* Appends a quoted char to word, marking it with CTLESC if it is special
+**/
+void addQuotedChar(char* word, size_t* word_len, char my_char);
+
+/**
+* Appends a copy of the word to my_tokens
+**/
+int addToken(TokenArr* my_tokens, int* token_arr_size, char* word, size_t word_len);
+
+/**
+* Copies a $((...)) at pos into word with its expression quoted so the
+* lexer and later stages leave it alone
+**/
+int lexArithmetic(char* my_str, size_t len, size_t* pos, char* word, size_t* word_len);
+
+/**
+* strstr that skips quoted chars
+**/
+char* findUnquoted(char* my_str, char* my_needle);
+
+/**
+* Removes the CTLESC marks from a string in place
+**/
+void dequoteString(char* my_str);
+
+/**
+* Removes the CTLESC marks from every token
+**/
+void dequoteTokens(TokenArr* my_tokens);
+
+/**
+* Returns the symbol(s) associated with the redirect token
+* NULL if no redirect is done
+**/
+char* getRedirect(char* my_token);
+
+/**
+* Splits a copy of the redirect token into its lhs and rhs.
+* token_copy is modified and lhs/rhs point into it
+**/
+int parseRedirect(char* my_redirect, char* token_copy, char** lhs, char** rhs);
+
+/**
+* Performs the given redirect action
+**/
+int performRedirect(char* my_redirect, char* my_token);
+
+/**
+* Checks if a token is a |>file or |>>file tee redirect
+**/
+int isTeeRedirect(char* my_token);
+
+/**
+* Opens the file of a |> token as another target of the stage
+**/
+int addTeeFile(struct TeeStage* my_tee, char* my_token);
+
+/**
+* Points stdout at a pipe and starts the writer thread that copies it to
+* the old stdout and the files
+**/
+int startTee(struct TeeStage* my_tee);
+
+/**
+* Puts stdout back, which lets the writer see EOF once the command's
+* copies are closed too. Waits for it unless the command is a & job
+**/
+void stopTee(struct TeeStage* my_tee);
+
+/**
+* The writer thread, duplicates each chunk with tee(2) into the side
+* pipe for every file and then splices it to the old stdout
+**/
+void* teeWriter(void* tee_arg);
+
+/**
+* Moves len bytes from a pipe to out_fd with splice, or through buf if
+* out_fd can't be spliced to. pipe_fd -1 writes what is already in buf,
+* out_fd -1 only reads into buf
+**/
+int drainPipe(int pipe_fd, int out_fd, size_t len, char* buf);
+
+/**
+* Closes a stage's fds and frees it
+**/
+void freeTee(struct TeeStage* my_tee);
+
+/**
+* Waits for the writers of & jobs' tees, so the shell doesn't exit
+* while one is still copying a job's output
+**/
+void waitTeeWriters();
 
 /**
 * Sets rhs for reading on the lhs file desc
@@ -0,0 +1,146 @@
+/**
+* Thin client for wsh --serve.
+* Sends its stdout, stderr and cwd to the server, streams a script
+* from a file or stdin and exits with the script's status.
+*
+* Usage: wshc [-s SOCK] [script]
+* The socket defaults to $WSH_SOCK
+*
+* wsh_startup.c includes this file with WSHC_NO_MAIN defined
+* to talk to the server without starting a client process
+**/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Must match wsh.h
+#define SERVE_HELLO 'W'
+#define SERVE_FDS 3
+
+/**
+* Sends the hello byte with the fds the session takes over
+**/
+int sendHello(int sock_fd, int* my_fds) {
+	char hello = SERVE_HELLO;
+	struct iovec hello_iov = {&hello, 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+	} control;
+	struct msghdr hello_msg = {0};
+	struct cmsghdr* my_cmsg;
+
+	hello_msg.msg_iov = &hello_iov;
+	hello_msg.msg_iovlen = 1;
+	hello_msg.msg_control = control.buf;
+	hello_msg.msg_controllen = sizeof(control.buf);
+	my_cmsg = CMSG_FIRSTHDR(&hello_msg);
+	my_cmsg->cmsg_level = SOL_SOCKET;
+	my_cmsg->cmsg_type = SCM_RIGHTS;
+	my_cmsg->cmsg_len = CMSG_LEN(SERVE_FDS * sizeof(int));
+	memcpy(CMSG_DATA(my_cmsg), my_fds, SERVE_FDS * sizeof(int));
+	return sendmsg(sock_fd, &hello_msg, 0) == 1 ? 0 : -1;
+}
+
+/**
+* Copies the script to the socket, ending it with a newline
+* so a last line without one still runs
+**/
+int sendScript(int sock_fd, int script_fd) {
+	char script_buf[65536];
+	ssize_t read_len;
+	char last_char = '\n';
+
+	while((read_len = read(script_fd, script_buf, sizeof(script_buf))) > 0) {
+		for(ssize_t sent = 0; sent < read_len;) {
+			ssize_t write_len = write(sock_fd, script_buf + sent, read_len - sent);
+			if(write_len <= 0) {
+				return -1;
+			}
+			sent += write_len;
+		}
+		last_char = script_buf[read_len - 1];
+	}
+	if(read_len == -1 || (last_char != '\n' && write(sock_fd, "\n", 1) != 1)) {
+		return -1;
+	}
+	return shutdown(sock_fd, SHUT_WR);
+}
+
+/**
+* Connects to the server's socket, returns the socket or -1
+**/
+int connectServer(const char* sock_path) {
+	struct sockaddr_un sock_addr = {0};
+	int sock_fd;
+
+	if(strlen(sock_path) >= sizeof(sock_addr.sun_path)) {
+		fprintf(stderr, "Error, socket path %s is too long\n", sock_path);
+		return -1;
+	}
+	sock_addr.sun_family = AF_UNIX;
+	strcpy(sock_addr.sun_path, sock_path);
+	sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock_fd == -1 || connect(sock_fd, (struct sockaddr*)&sock_addr, sizeof(sock_addr)) == -1) {
+		fprintf(stderr, "Error connecting to %s\n", sock_path);
+		if(sock_fd != -1) {
+			close(sock_fd);
+		}
+		return -1;
+	}
+	return sock_fd;
+}
+
+#ifndef WSHC_NO_MAIN
+int main(int argc, char* argv[]) {
+	char* sock_path = getenv("WSH_SOCK");
+	int my_fds[SERVE_FDS] = {STDOUT_FILENO, STDERR_FILENO, -1};
+	int script_fd = STDIN_FILENO;
+	int sock_fd;
+	int status;
+	int arg = 1;
+
+	if(argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		sock_path = argv[2];
+		arg = 3;
+	}
+	if(sock_path == NULL || argc - arg > 1) {
+		fprintf(stderr, "Usage: %s [-s SOCK] [script], or set WSH_SOCK\n", argv[0]);
+		return 1;
+	}
+	if(arg < argc) {
+		script_fd = open(argv[arg], O_RDONLY);
+		if(script_fd == -1) {
+			fprintf(stderr, "Error opening %s\n", argv[arg]);
+			return 1;
+		}
+	}
+
+	// The session runs in this cwd
+	my_fds[2] = open(".", O_RDONLY | O_DIRECTORY);
+	if(my_fds[2] == -1) {
+		fprintf(stderr, "Error opening cwd\n");
+		return 1;
+	}
+	sock_fd = connectServer(sock_path);
+	if(sock_fd == -1) {
+		return 1;
+	}
+	if(sendHello(sock_fd, my_fds) == -1 || sendScript(sock_fd, script_fd) == -1) {
+		fprintf(stderr, "Error sending script\n");
+		return 1;
+	}
+
+	// The server answers with the status once the session has exited
+	if(read(sock_fd, &status, sizeof(status)) != sizeof(status)) {
+		fprintf(stderr, "Error, server closed the connection\n");
+		return 1;
+	}
+	return status & 0xFF;
+}
+#endif
@@ -0,0 +1,250 @@
+/**
+* Fuzz harness for the wsh parser.
+* Runs a line through tokenizing, arithmetic, var substitution, list splitting
+* and redirect parsing without running any commands, and checks the line
+* reads back the same after Tab completion escapes it.
+*
+* Built with -DWSH_LIBFUZZER it is a libFuzzer target.
+* Otherwise it replays files given as args (AFL style, stdin if none)
+* and can generate random lines with -random N
+**/
+#define WSH_NO_MAIN
+#include "wsh.c"
+
+int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size);
+int LLVMFuzzerInitialize(int* argc, char*** argv);
+
+// Fragments the random mode builds lines out of
+const char* FUZZ_PIECES[] =
+{
+	" ", "  ", "echo", "ls", "$", "$?", "$a", "$PATH", "$missing", "&&", "||", "&",
+	">", ">>", "<", "&>", "&>>", "2>", "1>>", ">out", "<in", "&>err", "=", "a=b",
+	"#", "history", "local", "export", "\t", "\"", "'", "\\", "x",
+	";", "f()", "{", "}", "$1", "alias", "a=b c", "$((", "))", "(", ")", "1+2", "<<",
+	"a+=3", "/0", "let"
+};
+
+int fuzz_vars_set = 0;
+
+/**
+* Aborts unless the name survives being completed and read back by the lexer
+**/
+void checkCompletion(char* my_name);
+
+int LLVMFuzzerInitialize(int* argc, char*** argv) {
+	(void)argc;
+	(void)argv;
+
+	// Parse errors are expected, sanitizer reports still go to fd 2
+	FILE* null_stream = fopen("/dev/null", "w");
+	if(null_stream != NULL) {
+		stderr = null_stream;
+	}
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size) {
+	TokenArr* my_tokens;
+	TokenArr* segment;
+	char* input_copy;
+	char* token_copy;
+	char* redirect_val;
+	char* lhs;
+	char* rhs;
+	int seg_start = 0;
+
+	// Give $a and friends something to expand to
+	if(!fuzz_vars_set) {
+		wshLocal("a", "value");
+		wshLocal("b", "");
+		fuzz_vars_set = 1;
+	}
+
+	input_copy = malloc(size + 1);
+	if(input_copy == NULL) {
+		return 0;
+	}
+	memcpy(input_copy, data, size);
+	input_copy[size] = '\0';
+
+	my_tokens = tokenizeString(input_copy);
+	if(my_tokens == NULL) {
+		free(input_copy);
+		return 0;
+	}
+
+	// Split across &&, || and ; like runCommandList
+	for(int i = 0; i <= my_tokens->token_count; i++) {
+		if(i < my_tokens->token_count && !isListOperator(my_tokens->tokens[i])) {
+			continue;
+		}
+		segment = sliceTokenArr(my_tokens, seg_start, i);
+		seg_start = i + 1;
+		if(segment == NULL) {
+			continue;
+		}
+		if(segment->token_count > 0 && expandArithmetic(segment) == 0 && substituteShellVars(segment) == 0) {
+			redirect_val = getRedirect(segment->tokens[segment->token_count - 1]);
+			if(redirect_val != NULL) {
+				token_copy = strdup(segment->tokens[segment->token_count - 1]);
+				if(token_copy != NULL) {
+					parseRedirect(redirect_val, token_copy, &lhs, &rhs);
+					free(token_copy);
+				}
+			}
+		}
+		freeTokenArr(segment);
+	}
+	freeTokenArr(my_tokens);
+	checkCompletion(input_copy);
+	free(input_copy);
+	return 0;
+}
+
+void checkCompletion(char* my_name) {
+	const char open_quotes[] = {'\0', '"', '\''};
+	struct EditLine my_line = {0};
+	struct EditLine my_word = {0};
+	TokenArr* my_tokens;
+	char open_quote;
+	int var_word;
+
+	// A completed name inserted in any quote must read back as the same name
+	for(size_t i = 0; i < sizeof(open_quotes) && my_name[0] != '\0'; i++) {
+		if(setEditLine(&my_line, "x ", 2) == -1 || (open_quotes[i] != '\0' && insertEditText(&my_line, open_quotes + i, 1) == -1)
+			|| insertCompletion(&my_line, my_name, strlen(my_name), open_quotes[i]) == -1) {
+			break;
+		}
+		if(scanEditWord(&my_line, &my_word, &open_quote, &var_word) != 0 || open_quote != open_quotes[i] 
+			|| strcmp(my_word.text, my_name) != 0) {
+			abort();
+		}
+		if(finishCompletion(&my_line, open_quote) == -1) {
+			break;
+		}
+		my_tokens = tokenizeString(my_line.text);
+		if(my_tokens == NULL || my_tokens->token_count != 2) {
+			abort();
+		}
+		dequoteTokens(my_tokens);
+		if(strcmp(my_tokens->tokens[1], my_name) != 0) {
+			abort();
+		}
+		freeTokenArr(my_tokens);
+	}
+	free(my_line.text);
+	free(my_word.text);
+}
+
+#ifndef WSH_LIBFUZZER
+
+/**
+* Runs the harness over the whole contents of a stream
+**/
+int fuzzStream(FILE* input_stream) {
+	unsigned char* data = NULL;
+	size_t size = 0;
+	size_t cap = 0;
+	size_t read_ret;
+	do {
+		if(size == cap) {
+			unsigned char* alloc_ret = realloc(data, cap * 2 + 4096);
+			if(alloc_ret == NULL) {
+				free(data);
+				return -1;
+			}
+			data = alloc_ret;
+			cap = cap * 2 + 4096;
+		}
+		read_ret = fread(data + size, 1, cap - size, input_stream);
+		size += read_ret;
+	} while(read_ret > 0);
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	return 0;
+}
+
+/**
+* Generates lines out of FUZZ_PIECES and random bytes
+**/
+void fuzzRandom(long runs) {
+	int piece_count = sizeof(FUZZ_PIECES) / sizeof(char*);
+	unsigned long state = 88172645463325252UL;
+	unsigned char line[8192];
+	size_t line_len;
+	size_t piece_len;
+	long target_len;
+
+	for(long run = 0; run < runs; run++) {
+		line_len = 0;
+
+		// Mostly short lines with the odd long one
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		target_len = (state % 16 == 0) ? state % sizeof(line) : state % 256;
+		while((long)line_len < target_len) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			if(state % 8 == 0) {
+				line[line_len++] = state >> 8; // Any byte
+				continue;
+			}
+			piece_len = strlen(FUZZ_PIECES[state % piece_count]);
+			if(line_len + piece_len > sizeof(line)) {
+				break;
+			}
+			memcpy(line + line_len, FUZZ_PIECES[state % piece_count], piece_len);
+			line_len += piece_len;
+		}
+		LLVMFuzzerTestOneInput(line, line_len);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	FILE* input_stream;
+	int arg = 1;
+
+	LLVMFuzzerInitialize(&argc, &argv);
+	if(argc >= 3 && strcmp(argv[1], "-random") == 0) {
+		fuzzRandom(atol(argv[2]));
+		arg = 3;
+	}
+	else if(argc == 1) {
+		return fuzzStream(stdin) == -1;
+	}
+
+	// Replay each file given, such as a crash or the corpus
+	for(; arg < argc; arg++) {
+		DIR* corpus_dir = opendir(argv[arg]);
+		if(corpus_dir != NULL) {
+			struct dirent* my_dirent;
+			char file_path[4096];
+			while((my_dirent = readdir(corpus_dir)) != NULL) {
+				if(my_dirent->d_name[0] == '.') {
+					continue;
+				}
+				snprintf(file_path, sizeof(file_path), "%s/%s", argv[arg], my_dirent->d_name);
+				input_stream = fopen(file_path, "r");
+				if(input_stream != NULL) {
+					fuzzStream(input_stream);
+					fclose(input_stream);
+				}
+			}
+			closedir(corpus_dir);
+			continue;
+		}
+		input_stream = fopen(argv[arg], "r");
+		if(input_stream == NULL) {
+			fprintf(stderr, "Error opening %s\n", argv[arg]);
+			return 1;
+		}
+		fuzzStream(input_stream);
+		fclose(input_stream);
+	}
+	freeShellVars();
+	printf("Fuzzing finished with no crashes\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,248 @@
+/**
+* Startup benchmark for wsh builds.
+* Launches each wsh binary given as an arg on a few tiny scripts and
+* reports the median time in microseconds over many runs.
+*
+* first_cmd is the time from fork until the first command's output
+* arrives, the rest are the time from fork until the shell has exited.
+* req/s is every run of the binary over the total time they took.
+* The same scripts are the training run for the wsh-static PGO build.
+*
+* An arg of serve:SOCK sends the scripts to a running wsh --serve the
+* way an orchestrator would, with no client process in between
+**/
+#define WSHC_NO_MAIN
+#include "wsh_client.c"
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_RUNS 200
+
+// A script to launch wsh on and whether to stop the clock at its first output
+struct StartupScript {
+	const char* name;
+	const char* text;
+	int first_byte;
+};
+
+struct StartupScript STARTUP_SCRIPTS[] =
+{
+	{"first_cmd", "echo first\nlocal a=1\n", 1},
+	{"one_builtin", "local a=1\n", 0},
+	{"small_script",
+		"local a=1\n"
+		"export B=2\n"
+		"local c=$a$B\n"
+		"echo $a $B $c\n"
+		"true && echo and\n"
+		"false || echo or\n"
+		"history set 20\n"
+		"history\n"
+		"vars\n"
+		"# comment\n"
+		"local a=\"quoted $c\"\n"
+		"echo 'single $a' \"double $a\"\n"
+		"cd /\n"
+		"ls\n"
+		"echo done\n", 0}
+};
+
+long elapsedUs(struct timespec* start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int compareLong(const void* a, const void* b) {
+	long lhs = *(const long*)a;
+	long rhs = *(const long*)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+* Runs wsh on the script once and returns the time taken in us, -1 on error
+**/
+long runScript(const char* wsh_path, const char* script_path, int first_byte) {
+	struct timespec start;
+	char* args[] = {(char*)wsh_path, (char*)script_path, NULL};
+	char read_buf[4096];
+	long time_us = -1;
+	int out_pipe[2];
+	int status;
+	pid_t wsh_pid;
+
+	if(pipe(out_pipe) == -1) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wsh_pid = fork();
+	if(wsh_pid == -1) {
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		return -1;
+	}
+	if(wsh_pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(out_pipe[1], STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		execv(wsh_path, args);
+		_exit(127);
+	}
+	close(out_pipe[1]);
+
+	// Drain the output so the shell never blocks on a full pipe
+	if(first_byte && read(out_pipe[0], read_buf, 1) == 1) {
+		time_us = elapsedUs(&start);
+	}
+	while(read(out_pipe[0], read_buf, sizeof(read_buf)) > 0) {
+	}
+	close(out_pipe[0]);
+	if(waitpid(wsh_pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+		return -1;
+	}
+	if(!first_byte) {
+		time_us = elapsedUs(&start);
+	}
+	return time_us;
+}
+
+/**
+* Sends the script to wsh --serve once and returns the time taken in us, -1 on error
+**/
+long runServed(const char* sock_path, const char* script_path, int first_byte) {
+	struct timespec start;
+	char read_buf[4096];
+	long time_us = -1;
+	int out_pipe[2];
+	int session_fds[SERVE_FDS];
+	int script_fd;
+	int sock_fd;
+	int status;
+
+	script_fd = open(script_path, O_RDONLY);
+	if(script_fd == -1) {
+		return -1;
+	}
+	if(pipe(out_pipe) == -1) {
+		close(script_fd);
+		return -1;
+	}
+	session_fds[0] = out_pipe[1];
+	session_fds[1] = open("/dev/null", O_WRONLY);
+	session_fds[2] = open(".", O_RDONLY | O_DIRECTORY);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sock_fd = connectServer(sock_path);
+	if(sock_fd != -1 && sendHello(sock_fd, session_fds) == 0 && sendScript(sock_fd, script_fd) == 0) {
+		close(out_pipe[1]);
+		out_pipe[1] = -1;
+		if(first_byte && read(out_pipe[0], read_buf, 1) == 1) {
+			time_us = elapsedUs(&start);
+		}
+		while(read(out_pipe[0], read_buf, sizeof(read_buf)) > 0) {
+		}
+		if(read(sock_fd, &status, sizeof(status)) != sizeof(status) || status == 127) {
+			time_us = -1;
+		}
+		else if(!first_byte) {
+			time_us = elapsedUs(&start);
+		}
+	}
+	if(sock_fd != -1) {
+		close(sock_fd);
+	}
+	if(out_pipe[1] != -1) {
+		close(out_pipe[1]);
+	}
+	close(out_pipe[0]);
+	close(session_fds[1]);
+	close(session_fds[2]);
+	close(script_fd);
+	return time_us;
+}
+
+int main(int argc, char* argv[]) {
+	int script_count = sizeof(STARTUP_SCRIPTS) / sizeof(struct StartupScript);
+	char dir_path[64];
+	char script_paths[sizeof(STARTUP_SCRIPTS) / sizeof(struct StartupScript)][96];
+	long* times;
+	long runs = DEFAULT_RUNS;
+	int arg = 1;
+	int failed = 0;
+
+	if(argc >= 3 && strcmp(argv[1], "-runs") == 0) {
+		runs = atol(argv[2]);
+		arg = 3;
+	}
+	if(arg == argc || runs < 1) {
+		fprintf(stderr, "Usage: %s [-runs N] wsh_binary...\n", argv[0]);
+		return 1;
+	}
+	times = malloc(runs * sizeof(long));
+	if(times == NULL) {
+		fprintf(stderr, "Error allocating times\n");
+		return 1;
+	}
+
+	// Scripts go on tmpfs when there is one so reading them stays cheap
+	snprintf(dir_path, sizeof(dir_path), "%s/wsh-startup-XXXXXX", access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp");
+	if(mkdtemp(dir_path) == NULL) {
+		fprintf(stderr, "Error making script dir\n");
+		free(times);
+		return 1;
+	}
+	for(int i = 0; i < script_count; i++) {
+		FILE* script_file;
+		snprintf(script_paths[i], sizeof(script_paths[i]), "%s/%s.wsh", dir_path, STARTUP_SCRIPTS[i].name);
+		script_file = fopen(script_paths[i], "w");
+		if(script_file == NULL) {
+			fprintf(stderr, "Error writing %s\n", script_paths[i]);
+			free(times);
+			return 1;
+		}
+		fputs(STARTUP_SCRIPTS[i].text, script_file);
+		fclose(script_file);
+	}
+
+	printf("%-28s", "binary");
+	for(int i = 0; i < script_count; i++) {
+		printf(" %14s", STARTUP_SCRIPTS[i].name);
+	}
+	printf(" %10s   (median us of %ld runs)\n", "req/s", runs);
+	for(; arg < argc; arg++) {
+		long total_us = 0;
+		printf("%-28s", argv[arg]);
+		for(int i = 0; i < script_count; i++) {
+			long run = 0;
+			for(; run < runs; run++) {
+				if(strncmp(argv[arg], "serve:", 6) == 0) {
+					times[run] = runServed(argv[arg] + 6, script_paths[i], STARTUP_SCRIPTS[i].first_byte);
+				}
+				else {
+					times[run] = runScript(argv[arg], script_paths[i], STARTUP_SCRIPTS[i].first_byte);
+				}
+				if(times[run] == -1) {
+					break;
+				}
+				total_us += times[run];
+			}
+			if(run < runs) {
+				printf(" %14s", "FAILED");
+				failed = 1;
+				continue;
+			}
+			qsort(times, runs, sizeof(long), compareLong);
+			printf(" %14ld", times[runs / 2]);
+		}
+		printf(" %10ld\n", total_us > 0 ? runs * script_count * 1000000 / total_us : 0);
+		fflush(stdout);
+	}
+
+	for(int i = 0; i < script_count; i++) {
+		unlink(script_paths[i]);
+	}
+	rmdir(dir_path);
+	free(times);
+	return failed;
+}
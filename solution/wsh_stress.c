@@ -0,0 +1,733 @@
+/**
+* Scale tests for wsh internals.
+* Each test runs in its own child so its time and peak RSS
+* can be checked against a budget. Exits 1 if any budget is blown
+**/
+#define WSH_NO_MAIN
+#include "wsh.c"
+#include <sys/resource.h>
+
+#define LINE_TOKENS 10000
+#define VAR_COUNT 100000
+#define HIST_OPS 1000000
+#define HIST_SEARCH_ENTRIES 100000
+#define GLOB_FILES 5000
+#define PATH_BINARIES 10000
+#define COMPLETE_OPS 10000
+#define LONG_LINES 200
+#define LONG_LINE_LEN 100000
+#define SOURCE_LINES 200
+#define SOURCE_RUNS 2000
+#define FUNC_CALLS 100000
+#define ARITH_LINES 200000
+#define READ_LINES 200000
+#define STATE_VARS 5000
+#define STATE_LOADS 200
+#define WALK_DIRS 100
+#define WALK_FILES 200
+#define WALK_RUNS 20
+#define CD_OPS 100000
+
+// A scale test and the budgets it has to stay inside
+struct StressTest {
+	const char* name;
+	int (*run)();
+	long time_budget_ms;
+	long rss_budget_mb;
+};
+
+/**
+* Builds a line of LINE_TOKENS space separated tokens
+* with each token made by the given format
+**/
+char* buildLine(const char* token_fmt) {
+	char* line = malloc(LINE_TOKENS * 16);
+	size_t line_len = 0;
+	if(line == NULL) {
+		return NULL;
+	}
+	for(int i = 0; i < LINE_TOKENS; i++) {
+		line_len += sprintf(line + line_len, token_fmt, i);
+		line[line_len++] = ' ';
+	}
+	line[line_len] = '\0';
+	return line;
+}
+
+/**
+* Makes a temp dir for file heavy tests, on tmpfs when there is one
+* so disk speed doesn't count against the budget
+**/
+int makeStressDir(char* dir_path, size_t path_size) {
+	const char* base_dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	snprintf(dir_path, path_size, "%s/wsh-stress-XXXXXX", base_dir);
+	return mkdtemp(dir_path) == NULL ? -1 : 0;
+}
+
+int stressTokenize() {
+	char* line = buildLine("tok%d");
+	char* line_copy;
+	TokenArr* my_tokens;
+	if(line == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < 200; i++) {
+		line_copy = strdup(line);
+		my_tokens = tokenizeString(line_copy);
+		if(my_tokens == NULL || my_tokens->token_count != LINE_TOKENS) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+		free(line_copy);
+	}
+	free(line);
+	return 0;
+}
+
+int stressSubstitute() {
+	char* line = buildLine("$v%d");
+	char* line_copy;
+	char var_name[32];
+	TokenArr* my_tokens;
+	if(line == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < LINE_TOKENS; i++) {
+		sprintf(var_name, "v%d", i);
+		wshLocal(var_name, "value");
+	}
+	for(int i = 0; i < 50; i++) {
+		line_copy = strdup(line);
+		my_tokens = tokenizeString(line_copy);
+		if(my_tokens == NULL || substituteShellVars(my_tokens) == -1) {
+			return -1;
+		}
+		if(strcmp(my_tokens->tokens[LINE_TOKENS - 1], "value") != 0) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+		free(line_copy);
+	}
+	free(line);
+	freeShellVars();
+	return 0;
+}
+
+int stressVars() {
+	char var_name[32];
+	char var_val[32];
+
+	// Add, overwrite and then read back every var
+	for(int i = 0; i < VAR_COUNT; i++) {
+		sprintf(var_name, "var%d", i);
+		if(wshLocal(var_name, "first") == -1) {
+			return -1;
+		}
+	}
+	for(int i = 0; i < VAR_COUNT; i++) {
+		sprintf(var_name, "var%d", i);
+		sprintf(var_val, "%d", i);
+		if(wshLocal(var_name, var_val) == -1) {
+			return -1;
+		}
+	}
+	for(int i = 0; i < VAR_COUNT; i++) {
+		sprintf(var_name, "var%d", i);
+		if(atoi(getShellVar(var_name)) != i) {
+			return -1;
+		}
+	}
+	freeShellVars();
+	if(shellVarPool.live_count != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int stressHistory() {
+	char* tokens[] = {"echo", NULL, NULL};
+	char count_str[32];
+	TokenArr my_tokens = {2, tokens};
+
+	// Adds past the limit so every add also removes the oldest entry
+	wshSetHist(1000);
+	tokens[1] = count_str;
+	for(int i = 0; i < HIST_OPS; i++) {
+		sprintf(count_str, "%d", i);
+		if(addHistEntry(&my_tokens) == -1) {
+			return -1;
+		}
+	}
+	if(histSize != 1000 || strcmp(getHistEntry(1)->entry_tokens->tokens[1], count_str) != 0) {
+		return -1;
+	}
+
+	// Every removed entry has to go back to the pools
+	freeHistory();
+	if(histEntryPool.live_count != 0 || tokenArrPool.live_count != 0 || histEntryPool.peak_count > 1001) {
+		return -1;
+	}
+	return 0;
+}
+
+int stressHistSearch() {
+	char* tokens[] = {"make", NULL, NULL, NULL};
+	char target_str[32];
+	char count_str[32];
+	char query[32];
+	TokenArr my_tokens = {3, tokens};
+	struct HistEntry* my_match;
+
+	// Keeps every entry so the index covers all of them
+	wshSetHist(HIST_SEARCH_ENTRIES);
+	tokens[1] = target_str;
+	tokens[2] = count_str;
+	for(int i = 0; i < HIST_SEARCH_ENTRIES; i++) {
+		sprintf(target_str, "target%d", i % 1000);
+		sprintf(count_str, "-j%d", i);
+		if(addHistEntry(&my_tokens) == -1) {
+			return -1;
+		}
+	}
+
+	// Searches like Ctrl-R would, each newest first
+	for(int i = 0; i < 10000; i++) {
+		sprintf(query, "target%d -j", i % 1000);
+		my_match = searchHistory(query, UINT_MAX);
+		if(my_match == NULL || strstr(my_match->entry_line, query) == NULL) {
+			return -1;
+		}
+		if(searchHistory(query, my_match->entry_seq) == NULL) {
+			return -1;
+		}
+	}
+	if(searchHistory("no such command", UINT_MAX) != NULL) {
+		return -1;
+	}
+	freeHistory();
+	return 0;
+}
+
+int stressRedirect() {
+	const char* redirects[] = {"2>out.txt", ">>log", "<input", "&>all", "&>>all", "1>"};
+	int redirect_count = sizeof(redirects) / sizeof(char*);
+	char token_copy[64];
+	char* my_redirect;
+	char* lhs;
+	char* rhs;
+	for(int i = 0; i < HIST_OPS; i++) {
+		strcpy(token_copy, redirects[i % redirect_count]);
+		my_redirect = getRedirect(token_copy);
+		if(my_redirect == NULL) {
+			return -1;
+		}
+		parseRedirect(my_redirect, token_copy, &lhs, &rhs);
+	}
+	return 0;
+}
+
+int stressGlob() {
+	char dir_path[64];
+	char file_path[96];
+	char* tokens[] = {"echo", NULL, NULL};
+	TokenArr* my_tokens;
+	int fd;
+
+	if(makeStressDir(dir_path, sizeof(dir_path)) == -1) {
+		return -1;
+	}
+	for(int i = 0; i < GLOB_FILES; i++) {
+		sprintf(file_path, "%s/f%d.log", dir_path, i);
+		fd = open(file_path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+		if(fd == -1) {
+			return -1;
+		}
+		close(fd);
+	}
+
+	// Backdate the dir so the first scan isn't in the same second as its last change
+	struct timespec backdated[2] = {{0, UTIME_OMIT}, {time(NULL) - 10, 0}};
+	if(utimensat(AT_FDCWD, dir_path, backdated, 0) == -1) {
+		return -1;
+	}
+	sprintf(file_path, "%s/*.log", dir_path);
+	tokens[1] = file_path;
+	for(int i = 0; i < 200; i++) {
+		TokenArr pattern_tokens = {2, tokens};
+		my_tokens = copyTokenArr(&pattern_tokens);
+		if(my_tokens == NULL || expandGlobs(my_tokens) == -1 || my_tokens->token_count != GLOB_FILES + 1) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+	}
+
+	for(int i = 0; i < GLOB_FILES; i++) {
+		sprintf(file_path, "%s/f%d.log", dir_path, i);
+		unlink(file_path);
+	}
+	rmdir(dir_path);
+	freeDirCache();
+	return 0;
+}
+
+int stressLongLines() {
+	FILE* script_stream = tmpfile();
+	char* input_line;
+	ssize_t input_size;
+	TokenArr* my_tokens;
+	if(script_stream == NULL) {
+		return -1;
+	}
+
+	// Lines far past any fixed buffer, each a single long word
+	for(int i = 0; i < LONG_LINES; i++) {
+		fputs("echo ", script_stream);
+		for(int j = 0; j < LONG_LINE_LEN; j++) {
+			fputc('a' + j % 26, script_stream);
+		}
+		fputc('\n', script_stream);
+	}
+	rewind(script_stream);
+
+	for(int i = 0; i < LONG_LINES; i++) {
+		if(parseInputs(&input_line, &input_size, script_stream) == -1 || input_size != LONG_LINE_LEN + 5) {
+			return -1;
+		}
+		my_tokens = tokenizeString(input_line);
+		if(my_tokens == NULL || my_tokens->token_count != 2 || strlen(my_tokens->tokens[1]) != LONG_LINE_LEN) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+	}
+	fclose(script_stream);
+	free(line_buf);
+	return 0;
+}
+
+int stressComplete() {
+	char dir_path[64];
+	char file_path[96];
+	struct EditLine my_line = {0};
+	struct timespec start;
+	long slowest_ms = 0;
+	int fd;
+
+	if(makeStressDir(dir_path, sizeof(dir_path)) == -1) {
+		return -1;
+	}
+	for(int i = 0; i < PATH_BINARIES; i++) {
+		sprintf(file_path, "%s/bin%d", dir_path, i);
+		fd = open(file_path, O_CREAT | O_WRONLY, S_IRWXU);
+		if(fd == -1) {
+			return -1;
+		}
+		close(fd);
+	}
+	wshExport("PATH", dir_path);
+
+	// Backdate the dir so the first build isn't redone, which is timed below
+	struct timespec backdated[2] = {{0, UTIME_OMIT}, {time(NULL) - 10, 0}};
+	if(utimensat(AT_FDCWD, dir_path, backdated, 0) == -1) {
+		return -1;
+	}
+	setEditLine(&my_line, "bin", 3);
+	if(completeWord(&my_line, NULL) != PATH_BINARIES) {
+		return -1;
+	}
+
+	// Every Tab after the first build should be a few stats and a trie walk
+	for(int i = 0; i < COMPLETE_OPS; i++) {
+		sprintf(file_path, "bin%d", i % PATH_BINARIES);
+		setEditLine(&my_line, file_path, strlen(file_path));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if(completeWord(&my_line, NULL) < 1) {
+			return -1;
+		}
+		if(elapsedMs(&start) > slowest_ms) {
+			slowest_ms = elapsedMs(&start);
+		}
+	}
+	if(slowest_ms > 5) {
+		return -1;
+	}
+
+	// A new binary changes the dir's mtime so the next Tab finds it
+	sprintf(file_path, "%s/newbin", dir_path);
+	fd = open(file_path, O_CREAT | O_WRONLY, S_IRWXU);
+	if(fd == -1) {
+		return -1;
+	}
+	close(fd);
+	setEditLine(&my_line, "newb", 4);
+	if(completeWord(&my_line, NULL) != 1 || strcmp(my_line.text, "newbin ") != 0) {
+		return -1;
+	}
+
+	unlink(file_path);
+	for(int i = 0; i < PATH_BINARIES; i++) {
+		sprintf(file_path, "%s/bin%d", dir_path, i);
+		unlink(file_path);
+	}
+	rmdir(dir_path);
+	free(my_line.text);
+	freeCompletion();
+	freeDirCache();
+	return 0;
+}
+
+int stressSource() {
+	char dir_path[64];
+	char file_path[96];
+	struct SourceFile* first_parse;
+	FILE* src_stream;
+
+	if(makeStressDir(dir_path, sizeof(dir_path)) == -1) {
+		return -1;
+	}
+	sprintf(file_path, "%s/lib.wsh", dir_path);
+	src_stream = fopen(file_path, "w");
+	if(src_stream == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < SOURCE_LINES; i++) {
+		fprintf(src_stream, "local v%d=%d\n", i % 16, i);
+	}
+	fclose(src_stream);
+
+	// Backdate the file so the cached lines can be trusted right away
+	struct timespec backdated[2] = {{0, UTIME_OMIT}, {time(NULL) - 10, 0}};
+	if(utimensat(AT_FDCWD, file_path, backdated, 0) == -1) {
+		return -1;
+	}
+	if(wshSource(file_path) != 0) {
+		return -1;
+	}
+	first_parse = sourceCache;
+	for(int i = 1; i < SOURCE_RUNS; i++) {
+		if(wshSource(file_path) != 0 || sourceCache != first_parse) {
+			return -1;
+		}
+	}
+	if(atoi(getShellVar("v7")) != SOURCE_LINES - 1) {
+		return -1;
+	}
+
+	unlink(file_path);
+	rmdir(dir_path);
+	freeSourceCache();
+	freeShellVars();
+	return 0;
+}
+
+int stressFunctions() {
+	char define_line[] = "bump() { local a=$1; local b=$2; local c=$a }";
+	char call_line[] = "bump 1 2";
+	TokenArr* my_tokens;
+	TokenArr* call_tokens;
+
+	my_tokens = tokenizeString(define_line);
+	if(my_tokens == NULL || runLine(my_tokens) != 0) {
+		return -1;
+	}
+	freeTokenArr(my_tokens);
+
+	// Each call copies the stored body, nothing is tokenized again
+	call_tokens = tokenizeString(call_line);
+	if(call_tokens == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < FUNC_CALLS; i++) {
+		my_tokens = copyTokenArr(call_tokens);
+		if(my_tokens == NULL || runLine(my_tokens) != 0) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+	}
+	freeTokenArr(call_tokens);
+	if(strcmp(getShellVar("b"), "2") != 0) {
+		return -1;
+	}
+	freeShellFuncs(funcBuckets);
+	freeShellVars();
+	return 0;
+}
+
+int stressArithmetic() {
+	char let_line[] = "let \"i += 1\" \"j = (i * 3 + j) % 1000 + 1\"";
+	TokenArr* let_tokens;
+	TokenArr* my_tokens;
+
+	// A counter loop, the vars are read back from their cached numbers
+	let_tokens = tokenizeString(let_line);
+	if(let_tokens == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < ARITH_LINES; i++) {
+		my_tokens = copyTokenArr(let_tokens);
+		if(my_tokens == NULL || runLine(my_tokens) != 0) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+	}
+	freeTokenArr(let_tokens);
+	if(atoi(getShellVar("i")) != ARITH_LINES) {
+		return -1;
+	}
+	freeShellVars();
+	return 0;
+}
+
+int stressRead() {
+	char dir_path[] = "/dev/shm/wsh-stress-XXXXXX";
+	char file_path[64];
+	char read_line[96];
+	FILE* data_file;
+	TokenArr* read_tokens;
+	TokenArr* my_tokens;
+	int read_fd;
+
+	if(mkdtemp(dir_path) == NULL) {
+		return -1;
+	}
+	snprintf(file_path, sizeof(file_path), "%s/data", dir_path);
+	data_file = fopen(file_path, "w");
+	if(data_file == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < READ_LINES; i++) {
+		fprintf(data_file, "%d field_%d the rest of line %d\n", i, i, i);
+	}
+	fclose(data_file);
+
+	// A < redirect is a fresh open, so it reads the first line and keeps no buffer
+	snprintf(read_line, sizeof(read_line), "read num name rest <%s", file_path);
+	my_tokens = tokenizeString(read_line);
+	if(my_tokens == NULL || runLine(my_tokens) != 0 || atoi(getShellVar("num")) != 0 || readBuffers != NULL) {
+		return -1;
+	}
+	freeTokenArr(my_tokens);
+
+	// read -u carries on through the fd from where the last read stopped
+	read_fd = open(file_path, O_RDONLY);
+	if(read_fd == -1) {
+		return -1;
+	}
+	snprintf(read_line, sizeof(read_line), "read -u %d num name rest", read_fd);
+	read_tokens = tokenizeString(read_line);
+	if(read_tokens == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < READ_LINES; i++) {
+		my_tokens = copyTokenArr(read_tokens);
+		if(my_tokens == NULL || runLine(my_tokens) != 0) {
+			return -1;
+		}
+		freeTokenArr(my_tokens);
+	}
+	if(atoi(getShellVar("num")) != READ_LINES - 1 || strcmp(getShellVar("rest"), "the rest of line 199999") != 0) {
+		return -1;
+	}
+	my_tokens = copyTokenArr(read_tokens);
+	if(my_tokens == NULL || runLine(my_tokens) != 1) {
+		return -1;
+	}
+	freeTokenArr(my_tokens);
+	freeReadBuffers();
+	close(read_fd);
+	freeTokenArr(read_tokens);
+	unlink(file_path);
+	rmdir(dir_path);
+	freeShellVars();
+	return 0;
+}
+
+int stressState() {
+	char file_path[] = "/dev/shm/wsh-stress-state-XXXXXX";
+	char var_name[32];
+	char var_val[64];
+	int state_fd;
+
+	state_fd = mkstemp(file_path);
+	if(state_fd == -1) {
+		return -1;
+	}
+	close(state_fd);
+	for(int i = 0; i < STATE_VARS; i++) {
+		snprintf(var_name, sizeof(var_name), "var_%d", i);
+		snprintf(var_val, sizeof(var_val), "value of var %d", i);
+		if(wshLocal(var_name, var_val) == -1) {
+			return -1;
+		}
+	}
+	if(saveState(file_path) == -1) {
+		return -1;
+	}
+
+	// Loads into a fresh shell each time, like a worker warming up
+	for(int i = 0; i < STATE_LOADS; i++) {
+		freeShellVars();
+		if(loadState(file_path) == -1) {
+			return -1;
+		}
+	}
+	if(strcmp(getShellVar("var_4999"), "value of var 4999") != 0) {
+		return -1;
+	}
+	unlink(file_path);
+	freeShellVars();
+	freeHistory();
+	return 0;
+}
+
+int stressWalk() {
+	char dir_path[64];
+	char file_path[128];
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	int fd;
+
+	if(saved_stdout == -1 || null_fd == -1 || makeStressDir(dir_path, sizeof(dir_path)) == -1) {
+		return -1;
+	}
+	for(int i = 0; i < WALK_DIRS; i++) {
+		sprintf(file_path, "%s/d%d", dir_path, i);
+		if(mkdir(file_path, S_IRWXU) == -1) {
+			return -1;
+		}
+		for(int j = 0; j < WALK_FILES; j++) {
+			sprintf(file_path, "%s/d%d/f%d", dir_path, i, j);
+			fd = open(file_path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+			if(fd == -1) {
+				return -1;
+			}
+			close(fd);
+		}
+	}
+
+	// Output goes to /dev/null so only the walk and sort are timed
+	fflush(stdout);
+	dup2(null_fd, STDOUT_FILENO);
+	for(int i = 0; i < WALK_RUNS; i++) {
+		if(wshWalk(dir_path, i % 2 == 0 ? WALK_LIST : WALK_DU, 0) == -1) {
+			dup2(saved_stdout, STDOUT_FILENO);
+			return -1;
+		}
+		fflush(stdout);
+	}
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+
+	for(int i = 0; i < WALK_DIRS; i++) {
+		for(int j = 0; j < WALK_FILES; j++) {
+			sprintf(file_path, "%s/d%d/f%d", dir_path, i, j);
+			unlink(file_path);
+		}
+		sprintf(file_path, "%s/d%d", dir_path, i);
+		rmdir(file_path);
+	}
+	rmdir(dir_path);
+	return 0;
+}
+
+int stressCd() {
+	char dir_path[64];
+	char sub_path[96];
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+
+	if(saved_stdout == -1 || null_fd == -1 || makeStressDir(dir_path, sizeof(dir_path)) == -1) {
+		return -1;
+	}
+	sprintf(sub_path, "%s/sub", dir_path);
+	if(mkdir(sub_path, S_IRWXU) == -1 || wshExport("CDPATH", dir_path) == -1 || wshCd(dir_path) == -1) {
+		return -1;
+	}
+
+	// Alternates a CDPATH lookup with a .. so both paths through cd are timed,
+	// the dirs CDPATH finds are printed so stdout goes to /dev/null
+	fflush(stdout);
+	dup2(null_fd, STDOUT_FILENO);
+	for(int i = 0; i < CD_OPS; i++) {
+		if(wshCd(i % 2 == 0 ? "sub" : "..") == -1) {
+			dup2(saved_stdout, STDOUT_FILENO);
+			return -1;
+		}
+	}
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+	if(strcmp(getCwd(), dir_path) != 0 || strcmp(getenv("OLDPWD"), sub_path) != 0) {
+		return -1;
+	}
+	rmdir(sub_path);
+	rmdir(dir_path);
+	return 0;
+}
+
+struct StressTest STRESS_TESTS[] =
+{
+	{"tokenize_10k_tokens", stressTokenize, 1000, 16},
+	{"substitute_10k_vars", stressSubstitute, 1000, 8},
+	{"vars_100k", stressVars, 500, 32},
+	{"history_1m_ops", stressHistory, 1500, 16},
+	{"hist_search_100k", stressHistSearch, 1500, 64},
+	{"redirect_parse_1m", stressRedirect, 500, 8},
+	{"glob_5k_files_x200", stressGlob, 3000, 32},
+	{"complete_10k_binaries", stressComplete, 6000, 32},
+	{"long_lines_100k_x200", stressLongLines, 1000, 8},
+	{"source_200_lines_x2k", stressSource, 1000, 8},
+	{"func_calls_100k", stressFunctions, 1000, 8},
+	{"let_200k_lines", stressArithmetic, 1000, 8},
+	{"read_200k_lines", stressRead, 1500, 16},
+	{"state_load_5k_vars_x200", stressState, 1000, 16},
+	{"walk_20k_files_x20", stressWalk, 2000, 32},
+	{"cd_100k", stressCd, 1000, 8}
+};
+
+int main() {
+	int test_count = sizeof(STRESS_TESTS) / sizeof(struct StressTest);
+	struct timespec start;
+	struct rusage child_usage;
+	int status;
+	int failed = 0;
+	long time_ms;
+	long rss_mb;
+	pid_t test_pid;
+
+	printf("%-22s %10s %10s %10s %10s\n", "test", "time(ms)", "budget", "rss(MB)", "budget");
+	for(int i = 0; i < test_count; i++) {
+		fflush(stdout); // Tests that flush stdout mustn't repeat the table
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		test_pid = fork();
+		if(test_pid == -1) {
+			fprintf(stderr, "Error forking test\n");
+			return 1;
+		}
+		if(test_pid == 0) {
+			_exit(STRESS_TESTS[i].run() == 0 ? 0 : 1);
+		}
+		if(wait4(test_pid, &status, 0, &child_usage) == -1) {
+			fprintf(stderr, "Error waiting on test\n");
+			return 1;
+		}
+		time_ms = elapsedMs(&start);
+		rss_mb = child_usage.ru_maxrss / 1024;
+
+		printf("%-22s %10ld %10ld %10ld %10ld  ", STRESS_TESTS[i].name, time_ms,
+			STRESS_TESTS[i].time_budget_ms, rss_mb, STRESS_TESTS[i].rss_budget_mb);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("FAILED\n");
+			failed = 1;
+		}
+		else if(time_ms > STRESS_TESTS[i].time_budget_ms || rss_mb > STRESS_TESTS[i].rss_budget_mb) {
+			printf("OVER BUDGET\n");
+			failed = 1;
+		}
+		else {
+			printf("ok\n");
+		}
+	}
+	return failed;
+}